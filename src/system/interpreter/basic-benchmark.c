@@ -0,0 +1,384 @@
+/**
+ * OrionRisc-128 BASIC Interpreter Benchmark
+ *
+ * Runs a fixed set of BASIC workloads and reports, for each one, load
+ * speed in lines per second, run speed in statements per second, peak
+ * program and string memory, and allocations per run. The best time of
+ * several runs is used, which is the most stable figure on a busy host.
+ *
+ *   basic-benchmark                     run and print the report
+ *   basic-benchmark --save FILE         also write the results as a baseline
+ *   basic-benchmark --baseline FILE     compare against a saved baseline
+ *
+ * Against a baseline, a workload whose statements per second drop by
+ * more than the tolerance (10% unless --tolerance PERCENT) is reported
+ * as a regression and the program exits with status 1. Baselines hold
+ * timings, so they are only comparable on the machine that wrote them:
+ * save one from the unchanged tree, then compare the change against it.
+ *
+ * A second table times the interpreter's number conversions against
+ * the C library: basic_parse_float against strtod, and
+ * basic_format_number against snprintf with the same precision.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "basic-interpreter.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define MAX_WORKLOADS 16
+#define MIN_RUNS 3
+#define MIN_SECONDS 0.5
+
+#define NUMBER_SAMPLES 1024
+#define NUMBER_SECONDS 0.2
+
+// One standard program and what it measured
+typedef struct {
+    const char *name;
+    const char *programText;
+
+    int lineCount;
+    double linesPerSecond;        // Load: tokenize and compile
+    unsigned long statements;     // Statements per run
+    double statementsPerSecond;
+    int peakBytes;                // Program arena plus string pool
+    unsigned long allocations;    // Per run
+    double baseline;              // Saved statements per second, 0 if none
+} Workload;
+
+static const char *loopProgram =
+    "10 S = 0\n"
+    "20 FOR I = 1 TO 20000\n"
+    "30 S = S + I * 2 - 1\n"
+    "40 NEXT I\n";
+
+// Recursive Fibonacci with GOSUB and an explicit argument stack
+static const char *gosubProgram =
+    "10 DIM K(30)\n"
+    "20 T = 0 : P = 0\n"
+    "30 N = 15 : GOSUB 100\n"
+    "40 END\n"
+    "100 IF N < 2 THEN T = T + N : RETURN\n"
+    "110 P = P + 1 : K(P) = N\n"
+    "120 N = K(P) - 1 : GOSUB 100\n"
+    "130 N = K(P) - 2 : GOSUB 100\n"
+    "140 P = P - 1 : RETURN\n";
+
+static const char *arrayProgram =
+    "10 DIM A(999)\n"
+    "20 FOR R = 1 TO 10\n"
+    "30 FOR I = 0 TO 999 : A(I) = I * R : NEXT I\n"
+    "40 S = 0\n"
+    "50 FOR I = 999 TO 0 STEP -1 : S = S + A(I) : NEXT I\n"
+    "60 NEXT R\n";
+
+static const char *stringProgram =
+    "10 N = 0\n"
+    "15 FOR R = 1 TO 100\n"
+    "20 R$ = \"\"\n"
+    "30 FOR I = 1 TO 40\n"
+    "40 R$ = R$ + CHR$(65 + I - INT(I / 26) * 26) + \"-\"\n"
+    "50 NEXT I\n"
+    "60 N = N + LEN(MID$(R$, 10, 20))\n"
+    "70 NEXT R\n";
+
+static const char *printProgram =
+    "10 FOR I = 1 TO 2000\n"
+    "20 PRINT \"LINE \"; I; \" OF \"; 2000\n"
+    "30 NEXT I\n";
+
+// Built at startup: many DATA lines read several times over
+static char dataProgram[MAX_PROGRAM_SIZE];
+
+// Number conversion samples: whole numbers, short decimals, and full
+// precision values as arithmetic produces them
+static double numberValues[NUMBER_SAMPLES];
+static char numberTexts[NUMBER_SAMPLES][32];
+static volatile double numberSink;
+
+static Workload workloads[MAX_WORKLOADS];
+static int workloadCount = 0;
+
+static double nowSeconds(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/**
+ * Output sink: PRINT-heavy workloads measure the interpreter, not the terminal
+ */
+static void discardOutput(void *context, const char *text, int length) {
+    (void)context;
+    (void)text;
+    (void)length;
+}
+
+static void buildDataProgram(void) {
+    int length = 0;
+    int line, item;
+
+    length += sprintf(dataProgram + length, "5 S = 0\n");
+    length += sprintf(dataProgram + length, "10 FOR R = 1 TO 20\n");
+    length += sprintf(dataProgram + length, "20 RESTORE\n");
+    length += sprintf(dataProgram + length, "30 FOR I = 1 TO 1500 : READ X : S = S + X : NEXT I\n");
+    length += sprintf(dataProgram + length, "40 NEXT R\n");
+    length += sprintf(dataProgram + length, "50 END\n");
+
+    for (line = 0; line < 150; line++) {
+        length += sprintf(dataProgram + length, "%d DATA", 100 + line);
+        for (item = 0; item < 10; item++) {
+            length += sprintf(dataProgram + length, "%s %d.5", item ? "," : "", line * 10 + item);
+        }
+        length += sprintf(dataProgram + length, "\n");
+    }
+}
+
+static void buildNumberSamples(void) {
+    unsigned int seed = 12345;
+    int i;
+
+    for (i = 0; i < NUMBER_SAMPLES; i++) {
+        double value;
+
+        seed = seed * 1103515245u + 12345u;
+        switch (i % 3) {
+            case 0: value = (double)(seed % 100000); break;
+            case 1: value = (seed % 100000) / 100.0; break;
+            default: value = (seed % 1000000) / 7.0; break;
+        }
+        numberValues[i] = value;
+        snprintf(numberTexts[i], sizeof(numberTexts[i]), "%.*g", FORMAT_DIGITS, value);
+    }
+}
+
+/**
+ * Nanoseconds per sample for one conversion routine (0 parse, 1 strtod,
+ * 2 format, 3 snprintf), repeating passes for at least NUMBER_SECONDS
+ */
+static double timeConversion(int routine) {
+    char text[64];
+    double start = nowSeconds(), elapsed;
+    long calls = 0;
+    int i;
+
+    do {
+        for (i = 0; i < NUMBER_SAMPLES; i++) {
+            const char *cursor = numberTexts[i];
+
+            switch (routine) {
+                case 0: numberSink = basic_parse_float(&cursor); break;
+                case 1: numberSink = strtod(cursor, NULL); break;
+                case 2: numberSink = basic_format_number(numberValues[i], text); break;
+                default: numberSink = snprintf(text, sizeof(text), "%.*G", FORMAT_DIGITS, numberValues[i]); break;
+            }
+        }
+        calls += NUMBER_SAMPLES;
+        elapsed = nowSeconds() - start;
+    } while (elapsed < NUMBER_SECONDS);
+
+    return elapsed * 1e9 / calls;
+}
+
+static void measureNumbers(void) {
+    double parse = timeConversion(0), libcParse = timeConversion(1);
+    double format = timeConversion(2), libcFormat = timeConversion(3);
+
+    printf("\n%-16s %14s %14s %8s\n", "Conversion", "Interpreter ns", "C library ns", "Speedup");
+    printf("%-16s %14.1f %14.1f %7.2fx\n", "parse", parse, libcParse, parse > 0.0 ? libcParse / parse : 0.0);
+    printf("%-16s %14.1f %14.1f %7.2fx\n", "format", format, libcFormat, format > 0.0 ? libcFormat / format : 0.0);
+}
+
+static void addWorkload(const char *name, const char *programText) {
+    if (workloadCount < MAX_WORKLOADS) {
+        workloads[workloadCount].name = name;
+        workloads[workloadCount].programText = programText;
+        workloads[workloadCount].baseline = 0.0;
+        workloadCount++;
+    }
+}
+
+/**
+ * Measure one workload. Timed runs have profiling off; one extra
+ * profiled run counts the statements and allocations.
+ */
+static int measure(BASICState *state, Workload *workload) {
+    double best = 0.0, total = 0.0, start, elapsed;
+    int runs = 0;
+
+    // Load speed
+    while (runs < MIN_RUNS || total < MIN_SECONDS) {
+        start = nowSeconds();
+        if (!basic_load_program(state, workload->programText)) {
+            return 0;
+        }
+        elapsed = nowSeconds() - start;
+        if (runs == 0 || elapsed < best) {
+            best = elapsed;
+        }
+        total += elapsed;
+        runs++;
+    }
+    workload->lineCount = state->lineCount;
+    workload->linesPerSecond = best > 0.0 ? state->lineCount / best : 0.0;
+
+    // Statement counts and allocations
+    basic_set_profiling(state, 1);
+    if (!basic_run_program(state)) {
+        basic_set_profiling(state, 0);
+        return 0;
+    }
+    basic_set_profiling(state, 0);
+    workload->statements = state->profile.statements;
+    workload->allocations = state->profile.allocations;
+    workload->peakBytes = state->programArena.highWater + state->stringPool.highWater;
+
+    // Run speed
+    best = total = 0.0;
+    runs = 0;
+    while (runs < MIN_RUNS || total < MIN_SECONDS) {
+        start = nowSeconds();
+        if (!basic_run_program(state)) {
+            return 0;
+        }
+        elapsed = nowSeconds() - start;
+        if (runs == 0 || elapsed < best) {
+            best = elapsed;
+        }
+        total += elapsed;
+        runs++;
+    }
+    workload->statementsPerSecond = best > 0.0 ? workload->statements / best : 0.0;
+
+    return 1;
+}
+
+/**
+ * Baseline files hold one "name statementsPerSecond" pair per line
+ */
+static int loadBaseline(const char *path) {
+    FILE *file = fopen(path, "r");
+    char name[64];
+    double value;
+    int i;
+
+    if (!file) {
+        fprintf(stderr, "Cannot read baseline %s\n", path);
+        return 0;
+    }
+
+    while (fscanf(file, "%63s %lf", name, &value) == 2) {
+        for (i = 0; i < workloadCount; i++) {
+            if (strcmp(workloads[i].name, name) == 0) {
+                workloads[i].baseline = value;
+            }
+        }
+    }
+
+    fclose(file);
+    return 1;
+}
+
+static int saveBaseline(const char *path) {
+    FILE *file = fopen(path, "w");
+    int i;
+
+    if (!file) {
+        fprintf(stderr, "Cannot write baseline %s\n", path);
+        return 0;
+    }
+
+    for (i = 0; i < workloadCount; i++) {
+        fprintf(file, "%s %.0f\n", workloads[i].name, workloads[i].statementsPerSecond);
+    }
+
+    fclose(file);
+    return 1;
+}
+
+int main(int argc, char **argv) {
+    static BASICState state;
+    const char *baselinePath = NULL;
+    const char *savePath = NULL;
+    double tolerance = 10.0;
+    int regressions = 0;
+    int failures = 0;
+    int i;
+
+    for (i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--baseline") == 0 && i + 1 < argc) {
+            baselinePath = argv[++i];
+        } else if (strcmp(argv[i], "--save") == 0 && i + 1 < argc) {
+            savePath = argv[++i];
+        } else if (strcmp(argv[i], "--tolerance") == 0 && i + 1 < argc) {
+            tolerance = atof(argv[++i]);
+        } else {
+            fprintf(stderr, "Usage: %s [--baseline FILE] [--save FILE] [--tolerance PERCENT]\n", argv[0]);
+            return 2;
+        }
+    }
+
+    buildDataProgram();
+    addWorkload("for-loop", loopProgram);
+    addWorkload("gosub-recursion", gosubProgram);
+    addWorkload("array-sweep", arrayProgram);
+    addWorkload("string-build", stringProgram);
+    addWorkload("print-output", printProgram);
+    addWorkload("data-read", dataProgram);
+
+    if (baselinePath && !loadBaseline(baselinePath)) {
+        return 2;
+    }
+
+    printf("OrionRisc-128 BASIC Interpreter Benchmark\n");
+    printf("=========================================\n\n");
+    printf("%-16s %6s %12s %12s %14s %8s %8s %9s\n",
+           "Workload", "Lines", "Lines/s", "Statements", "Statements/s", "Peak", "Allocs", "Baseline");
+
+    for (i = 0; i < workloadCount; i++) {
+        Workload *workload = &workloads[i];
+        int measured;
+
+        // A fresh state per workload keeps the memory peaks separate
+        basic_init(&state);
+        basic_set_output_sink(&state, discardOutput, NULL);
+        measured = measure(&state, workload);
+        basic_shutdown(&state);
+
+        if (!measured) {
+            printf("%-16s failed: %s (line %d)\n",
+                   workload->name, state.errorMessage, state.currentLineNumber);
+            failures++;
+            continue;
+        }
+
+        printf("%-16s %6d %12.0f %12lu %14.0f %8d %8lu",
+               workload->name, workload->lineCount, workload->linesPerSecond,
+               workload->statements, workload->statementsPerSecond,
+               workload->peakBytes, workload->allocations);
+
+        if (workload->baseline > 0.0) {
+            double change = 100.0 * (workload->statementsPerSecond / workload->baseline - 1.0);
+            int regressed = change < -tolerance;
+
+            printf(" %+8.1f%%%s", change, regressed ? " REGRESSION" : "");
+            regressions += regressed;
+        }
+        printf("\n");
+    }
+
+    if (savePath && !failures && !saveBaseline(savePath)) {
+        return 2;
+    }
+
+    buildNumberSamples();
+    measureNumbers();
+
+    printf("\n%d workloads, %d failed, %d regressed\n", workloadCount, failures, regressions);
+    return failures || regressions ? 1 : 0;
+}
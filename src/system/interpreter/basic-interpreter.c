@@ -23,34 +23,204 @@
 #include <stdio.h>
 #include <math.h>
 #include <ctype.h>
-
-// Global BASIC state
-static BASICState globalState;
+#include <stddef.h>
+#include <time.h>
+
+// Statement budget of runs that go until the program stops
+#define NO_BUDGET ((unsigned long)-1)
+
+// Memory charged for one variable slot (see basic_get_memory)
+#define SLOT_BYTES ((long)(sizeof(double) + sizeof(int) + 1 + sizeof(Variable)))
+
+// Numeric evaluation stack entry; the compiler tracks which member holds
+// the value at every point of the code
+typedef union {
+    double number;
+    int integer;
+} NumericSlot;
+
+// Built-in function implementation. Arguments arrive split by type, in
+// order of appearance; the result replaces numbers[0] or strings[0].
+typedef int (*BuiltinHandler)(BASICState *state, NumericSlot *numbers, StringRef *strings, int argumentCount);
+
+// Built-in function table entry, indexed by FunctionId
+typedef struct {
+    const char *name;
+    ValueType resultType;
+    const char *signature;  // Argument types in order: 'N' number, 'S' string
+    int minArguments;
+    double (*math)(double); // Pure numeric function of one argument, or NULL
+    BuiltinHandler handler;
+} BuiltinFunction;
+
+static int callRnd(BASICState *state, NumericSlot *numbers, StringRef *strings, int argumentCount);
+static int callLen(BASICState *state, NumericSlot *numbers, StringRef *strings, int argumentCount);
+static int callVal(BASICState *state, NumericSlot *numbers, StringRef *strings, int argumentCount);
+static int callAsc(BASICState *state, NumericSlot *numbers, StringRef *strings, int argumentCount);
+static int callLeft(BASICState *state, NumericSlot *numbers, StringRef *strings, int argumentCount);
+static int callRight(BASICState *state, NumericSlot *numbers, StringRef *strings, int argumentCount);
+static int callMid(BASICState *state, NumericSlot *numbers, StringRef *strings, int argumentCount);
+static int callStr(BASICState *state, NumericSlot *numbers, StringRef *strings, int argumentCount);
+static int callChr(BASICState *state, NumericSlot *numbers, StringRef *strings, int argumentCount);
+
+static const BuiltinFunction builtinFunctions[FN_COUNT] = {
+    { "ABS",    VALUE_NUMBER, "N",   1, basic_abs, NULL },
+    { "RND",    VALUE_NUMBER, "N",   1, NULL,      callRnd },
+    { "SQR",    VALUE_NUMBER, "N",   1, basic_sqr, NULL },
+    { "SIN",    VALUE_NUMBER, "N",   1, basic_sin, NULL },
+    { "COS",    VALUE_NUMBER, "N",   1, basic_cos, NULL },
+    { "TAN",    VALUE_NUMBER, "N",   1, basic_tan, NULL },
+    { "LOG",    VALUE_NUMBER, "N",   1, basic_log, NULL },
+    { "EXP",    VALUE_NUMBER, "N",   1, basic_exp, NULL },
+    { "INT",    VALUE_NUMBER, "N",   1, basic_int, NULL },
+    { "SGN",    VALUE_NUMBER, "N",   1, basic_sgn, NULL },
+    { "LEN",    VALUE_NUMBER, "S",   1, NULL,      callLen },
+    { "VAL",    VALUE_NUMBER, "S",   1, NULL,      callVal },
+    { "ASC",    VALUE_NUMBER, "S",   1, NULL,      callAsc },
+    { "LEFT$",  VALUE_STRING, "SN",  2, NULL,      callLeft },
+    { "RIGHT$", VALUE_STRING, "SN",  2, NULL,      callRight },
+    { "MID$",   VALUE_STRING, "SNN", 2, NULL,      callMid },
+    { "STR$",   VALUE_STRING, "N",   1, NULL,      callStr },
+    { "CHR$",   VALUE_STRING, "N",   1, NULL,      callChr },
+    { "SUM",    VALUE_NUMBER, "A",   1, NULL,      NULL }      // 'A' array name, special-cased
+};
 
 // Forward declarations for static functions
-static int executeStatement(BASICState *state, const char **linePtr);
+static int executeStatement(BASICState *state, const unsigned char **codePtr);
 static ProgramLine *findLine(BASICState *state, int lineNumber);
-static int addLine(BASICState *state, int lineNumber, const char *lineText);
+static int addLine(BASICState *state, int lineNumber, const char *lineText, int textLength, int copyText);
+static int loadProgram(BASICState *state, const char *programText, int length, int copyText);
 static void removeLine(BASICState *state, int lineNumber);
+static int readSymbol(const unsigned char **codePtr);
+static double readNumber(const unsigned char **codePtr);
+static void skipToken(const unsigned char **codePtr);
+static int isStatementEnd(const unsigned char *code);
+static int scanLine(BASICState *state, const char *lineText, unsigned char *buffer, int bufferSize);
+static int compileLine(BASICState *state, const unsigned char *tokens, unsigned char *buffer, int bufferSize);
+static int executeBranch(BASICState *state, const unsigned char **codePtr);
+static int findLineSlot(BASICState *state, int lineNumber);
+static void linkProgram(BASICState *state);
+static void unlinkAnalysis(BASICState *state);
+static int collectData(BASICState *state);
+static int readLineNumber(BASICState *state, const char **ptr, const char *end);
+static int readTarget(BASICState *state, const unsigned char **codePtr, int *slot, int indices[], int *count);
+static int assignString(BASICState *state, int slot, StringRef value);
+static char *allocScratch(BASICState *state, int size);
+static ValueType slotType(BASICState *state, int slot);
+static int toInteger(BASICState *state, double value, int *result);
+static int setIntegerSlot(BASICState *state, int slot, int value);
+static ProgramLine *readLineRef(BASICState *state, const unsigned char **codePtr);
+static int runFrom(BASICState *state, ProgramLine *line, const unsigned char *codePtr, unsigned long budget);
+static ProgramPosition positionAfter(ProgramLine *line, const unsigned char *codePtr);
+static int skipLoopBody(BASICState *state, ProgramPosition body);
+static int forInteger(BASICState *state, const unsigned char **codePtr, int slot, int initial);
+static void resetRuntime(BASICState *state);
+static void releaseProgram(BASICState *state);
+static unsigned long readProfileClock(BASICState *state);
+static void instrumentStatement(BASICState *state, ProgramLine *line, const unsigned char *statement,
+                                unsigned long *lastTick);
+static double arraySum(const ArrayValue *array);
+static int unshareArray(BASICState *state, ArrayValue *array);
+static double *writableElement(BASICState *state, int slot, const int indices[], int count);
+static int reserveMemory(BASICState *state, MemoryCategory category, long bytes);
+static void releaseMemory(BASICState *state, MemoryCategory category, long bytes);
+static void setMemoryUsed(BASICState *state, MemoryCategory category, long bytes);
+static void *programAlloc(BASICState *state, int tokenBytes, int textBytes, const char *failure);
+static char *allocString(BASICState *state, int size);
+static void freeString(BASICState *state, char *text);
+static double *allocArray(BASICState *state, int count, int clear);
+static void freeArray(BASICState *state, double *block, int count);
 
 /**
  * Initialize the BASIC interpreter
+ *
+ * Expects a fresh state; use basic_shutdown to return its memory.
  */
 void basic_init(BASICState *state) {
     if (!state) {
-        state = &globalState;
+        return;
+    }
+
+    basic_arena_init(&state->programArena);
+    basic_pool_init(&state->stringPool);
+    state->outputLength = 0;
+    state->outputLineBuffered = 1;
+    state->outputSink = NULL;
+    state->outputContext = NULL;
+    state->randomState = 1;
+    state->scratchUsed = 0;
+    memset(&state->profile, 0, sizeof(state->profile));
+    memset(&state->memory, 0, sizeof(state->memory));
+    state->loopHook = NULL;
+    state->loopHookContext = NULL;
+    state->statementHook = NULL;
+    state->statementHookContext = NULL;
+    state->programVersion = 0;
+    resetRuntime(state);
+}
+
+/**
+ * Release all memory held by an interpreter state
+ */
+void basic_shutdown(BASICState *state) {
+    if (!state) {
+        return;
+    }
+
+    basic_flush_output(state);
+    releaseProgram(state);
+    basic_arena_release(&state->programArena);
+    basic_pool_release(&state->stringPool);
+    resetRuntime(state);
+}
+
+/**
+ * Drop the program and all variable storage in one step. The arenas
+ * keep their chunks, so loading the next program allocates nothing new
+ * from the system until it outgrows the previous one.
+ */
+static void releaseProgram(BASICState *state) {
+    int i;
+
+    // Blocks still shared with a snapshot belong to it
+    for (i = 0; i < state->arrayCount; i++) {
+        if (!state->arrays[i].shared) {
+            basic_free(state->arrays[i].numericArray);
+        }
     }
 
+    basic_arena_reset(&state->programArena);
+    basic_pool_reset(&state->stringPool);
+}
+
+/**
+ * Reset program, variables and runtime state (allocators untouched)
+ */
+static void resetRuntime(BASICState *state) {
     // Clear program lines
     state->programLines = NULL;
+    state->analyzed = 0;
+    state->programVersion++;
     state->currentLineNumber = 0;
     state->programSize = 0;
+    state->lineCount = 0;
+    state->sourceChecksum = 0;
 
     // Clear variables
     state->variableCount = 0;
+    state->stringCount = 0;
+    state->arrayCount = 0;
+    memset(state->symbolHash, 0, sizeof(state->symbolHash));
+
+    // Nothing is charged once the arena, pool and arrays are released;
+    // quotas and peaks carry over to the next program
+    memset(state->memory.used, 0, sizeof(state->memory.used));
+    state->memory.total = 0;
 
     // Initialize runtime state
     state->running = 0;
+    state->currentLine = NULL;
+    state->jumpPending = 0;
     state->errorCode = ERR_NONE;
     state->errorMessage[0] = '\0';
 
@@ -59,12 +229,18 @@ void basic_init(BASICState *state) {
     state->gosubStackPtr = 0;
 
     // Initialize DATA handling
-    state->dataPointer = NULL;
+    state->dataPool = NULL;
     state->dataCount = 0;
+    state->dataCursor = 0;
+    state->dataStale = 0;
 
     // Initialize I/O
     state->inputBuffer[0] = '\0';
     state->inputIndex = 0;
+    state->stepping = 0;
+    state->suspended = 0;
+    state->waitingForInput = 0;
+    state->inputReady = 0;
 
     // Clear error state
     basic_set_error(state, ERR_NONE, "No error");
@@ -72,10 +248,13 @@ void basic_init(BASICState *state) {
 
 /**
  * Load a BASIC program from text
+ *
+ * The text is copied once into the program arena, so the caller may
+ * release it as soon as this returns.
  */
 int basic_load_program(BASICState *state, const char *programText) {
     if (!state) {
-        state = &globalState;
+        return 0;
     }
 
     if (!programText) {
@@ -83,21 +262,82 @@ int basic_load_program(BASICState *state, const char *programText) {
         return 0;
     }
 
-    basic_init(state);
+    return loadProgram(state, programText, strlen(programText), 1);
+}
+
+/**
+ * Load a BASIC program without copying its text
+ *
+ * Lines keep slices into the caller's buffer (for example a memory-mapped
+ * file), which need not be NUL-terminated. The buffer must stay valid and
+ * unchanged until the next load or basic_shutdown.
+ */
+int basic_load_program_in_place(BASICState *state, const char *programText, int length) {
+    if (!state) {
+        return 0;
+    }
+
+    if (!programText || length < 0) {
+        basic_set_error(state, ERR_SYNTAX, "Null program text");
+        return 0;
+    }
+
+    return loadProgram(state, programText, length, 0);
+}
+
+/**
+ * Read the line number at the start of a program line. Returns -1 with
+ * ERR_SYNTAX set if it is above MAX_LINE_NUMBER.
+ */
+static int readLineNumber(BASICState *state, const char **ptr, const char *end) {
+    int lineNumber = 0;
+
+    while (*ptr < end && isdigit(**ptr)) {
+        lineNumber = lineNumber * 10 + (**ptr - '0');
+        if (lineNumber > MAX_LINE_NUMBER) {
+            basic_set_error(state, ERR_SYNTAX, "Line number out of range");
+            return -1;
+        }
+        (*ptr)++;
+    }
+
+    return lineNumber;
+}
 
-    // Parse program line by line
-    const char *ptr = programText;
-    char lineBuffer[MAX_LINE_LENGTH];
+/**
+ * Split program text into numbered lines and add each one. Every line is
+ * a slice ending at a newline or NUL, which is where the scanner stops.
+ */
+static int loadProgram(BASICState *state, const char *programText, int length, int copyText) {
+    const char *ptr;
+    const char *end;
+    const char *lineStart;
     int lineNumber;
-    char *lineStart;
 
-    while (*ptr) {
+    releaseProgram(state);
+    resetRuntime(state);
+    state->sourceChecksum = basic_checksum(programText, length);
+
+    if (copyText) {
+        char *copy = (char *)programAlloc(state, 0, length + 1, "Cannot allocate program memory");
+        if (!copy) {
+            return 0;
+        }
+        memcpy(copy, programText, length);
+        copy[length] = '\0';
+        programText = copy;
+    }
+
+    ptr = programText;
+    end = programText + length;
+
+    while (ptr < end && *ptr) {
         // Skip empty lines
-        while (*ptr == '\n' || *ptr == '\r') {
+        while (ptr < end && (*ptr == '\n' || *ptr == '\r')) {
             ptr++;
         }
 
-        if (!*ptr) break;
+        if (ptr == end || !*ptr) break;
 
         // Parse line number
         if (!isdigit(*ptr)) {
@@ -105,39 +345,72 @@ int basic_load_program(BASICState *state, const char *programText) {
             return 0;
         }
 
-        lineNumber = 0;
-        while (isdigit(*ptr)) {
-            lineNumber = lineNumber * 10 + (*ptr - '0');
-            ptr++;
+        lineNumber = readLineNumber(state, &ptr, end);
+        if (lineNumber < 0) {
+            return 0;
         }
 
         // Skip whitespace after line number
-        while (*ptr == ' ' || *ptr == '\t') {
+        while (ptr < end && (*ptr == ' ' || *ptr == '\t')) {
             ptr++;
         }
 
-        // Get line content
-        lineStart = lineBuffer;
-        while (*ptr && *ptr != '\n' && *ptr != '\r') {
-            if (lineStart - lineBuffer >= MAX_LINE_LENGTH - 1) {
-                basic_set_error(state, ERR_LINE_NOT_FOUND, "Line too long");
-                return 0;
-            }
-            *lineStart++ = *ptr++;
+        // Find the end of the line content
+        lineStart = ptr;
+        while (ptr < end && *ptr && *ptr != '\n' && *ptr != '\r') {
+            ptr++;
+        }
+        if (ptr - lineStart >= MAX_LINE_LENGTH) {
+            basic_set_error(state, ERR_LINE_NOT_FOUND, "Line too long");
+            return 0;
         }
-        *lineStart = '\0';
 
-        // Add line to program
-        if (!addLine(state, lineNumber, lineBuffer)) {
+        // Add line to program. A last line that runs to the end of an
+        // unterminated buffer has no terminator to stop the scanner, so
+        // only that one is copied.
+        if (!addLine(state, lineNumber, lineStart, ptr - lineStart, !copyText && ptr == end)) {
             return 0; // Error already set
         }
 
         // Skip line endings
-        while (*ptr == '\n' || *ptr == '\r') {
+        while (ptr < end && (*ptr == '\n' || *ptr == '\r')) {
             ptr++;
         }
     }
 
+    // Point every jump at its target so taken branches need no lookup
+    linkProgram(state);
+
+    return collectData(state);
+}
+
+/**
+ * Reset the run-time state for a run from the first line
+ */
+static int startRun(BASICState *state) {
+    if (!state->programLines) {
+        basic_set_error(state, ERR_SYNTAX, "No program loaded");
+        return 0;
+    }
+
+    state->currentLineNumber = 0;
+    state->forStackPtr = 0;
+    state->gosubStackPtr = 0;
+    state->suspended = 0;
+    state->waitingForInput = 0;
+    state->inputReady = 0;
+    basic_set_error(state, ERR_NONE, "No error");
+
+    // Edits since the last run may have added or removed DATA
+    if (state->dataStale && !collectData(state)) {
+        return 0;
+    }
+    state->dataCursor = 0;
+
+    // Each profiled run starts from zero
+    if (state->profile.enabled) {
+        basic_reset_profile(state);
+    }
     return 1;
 }
 
@@ -145,116 +418,402 @@ int basic_load_program(BASICState *state, const char *programText) {
  * Run the loaded BASIC program
  */
 int basic_run_program(BASICState *state) {
+    if (!state || !startRun(state)) {
+        return 0;
+    }
+
+    // Execute program from first line
+    return runFrom(state, state->programLines, state->programLines->tokens, NO_BUDGET);
+}
+
+/**
+ * Prepare the loaded program for basic_step, suspended before its
+ * first statement
+ */
+int basic_start_program(BASICState *state) {
+    if (!state || !startRun(state)) {
+        return 0;
+    }
+
+    state->suspended = 1;
+    state->resumeAt.line = state->programLines;
+    state->resumeAt.code = state->programLines->tokens;
+    state->resumeVersion = state->programVersion;
+    return 1;
+}
+
+/**
+ * Run a started program for at most budget statements
+ *
+ * Nothing blocks: INPUT suspends the program and basic_step returns
+ * BASIC_STEP_WAITING until the host calls basic_provide_input, so one
+ * thread can interleave many states from its own event loop.
+ */
+BasicStepResult basic_step(BASICState *state, unsigned long budget) {
+    ProgramPosition position;
+
     if (!state) {
-        state = &globalState;
+        return BASIC_STEP_FINISHED;
+    }
+    state->budgetLeft = budget;
+    if (!state->suspended) {
+        return BASIC_STEP_FINISHED;
+    }
+    if (state->waitingForInput && !state->inputReady) {
+        return BASIC_STEP_WAITING;
     }
 
-    if (!state->programLines) {
-        basic_set_error(state, ERR_SYNTAX, "No program loaded");
+    // The saved position points into code an edit may have replaced
+    state->suspended = 0;
+    state->waitingForInput = 0;
+    if (state->resumeVersion != state->programVersion) {
+        state->inputReady = 0;
+        basic_set_error(state, ERR_SYNTAX, "Cannot continue after program edit");
+        return BASIC_STEP_FINISHED;
+    }
+
+    position = state->resumeAt;
+    state->stepping = 1;
+    runFrom(state, position.line, position.code, budget);
+    state->stepping = 0;
+
+    if (!state->suspended) {
+        return BASIC_STEP_FINISHED;
+    }
+    state->resumeVersion = state->programVersion;
+    return state->waitingForInput ? BASIC_STEP_WAITING : BASIC_STEP_RUNNING;
+}
+
+/**
+ * Supply the line a waiting INPUT asked for; a trailing line end is
+ * dropped, as from the console. Returns 0 if no INPUT is waiting.
+ */
+int basic_provide_input(BASICState *state, const char *text, int length) {
+    if (!state || !text || !state->waitingForInput) {
         return 0;
     }
 
+    if (length < 0) {
+        length = strlen(text);
+    }
+    while (length > 0 && (text[length - 1] == '\n' || text[length - 1] == '\r')) {
+        length--;
+    }
+    if (length > (int)sizeof(state->inputBuffer) - 1) {
+        length = sizeof(state->inputBuffer) - 1;
+    }
+
+    memcpy(state->inputBuffer, text, length);
+    state->inputBuffer[length] = '\0';
+    state->inputReady = 1;
+    return 1;
+}
+
+#if BASIC_THREADED_DISPATCH
+
+// Run the statement at codePtr through its handler label
+#define DISPATCH_STATEMENT() do { \
+        if (budget-- == 0) { \
+            goto outOfBudget; \
+        } \
+        state->jumpPending = 0; \
+        state->scratchUsed = 0; \
+        statement = codePtr; \
+        type = *codePtr; \
+        if (type != TOK_VARIABLE && type != TOK_EOL && type != TOK_COLON) { \
+            codePtr++; \
+        } \
+        goto *statementLabels[type]; \
+    } while (0)
+
+// Follow a statement; a ':' dispatches the next one in place, so
+// multi-statement lines never return to the line loop
+#define FINISH_STATEMENT() do { \
+        if (instrumented) { \
+            instrumentStatement(state, line, statement, &lastTick); \
+        } \
+        if (!ok || !state->running) { \
+            goto finished; \
+        } \
+        if (state->jumpPending) { \
+            line = state->jumpTarget.line; \
+            codePtr = state->jumpTarget.code; \
+            goto enterLine; \
+        } \
+        if (*codePtr == TOK_COLON) { \
+            codePtr++; \
+            DISPATCH_STATEMENT(); \
+        } \
+        goto nextLine; \
+    } while (0)
+
+#define STATEMENT(label, handler) \
+    label: \
+        ok = handler(state, &codePtr); \
+        FINISH_STATEMENT()
+
+/**
+ * Run statements starting at a position until the program ends, stops
+ * or fails, or budget statements have run. Handlers redirect control by
+ * setting jumpTarget; otherwise execution continues after a ':' or with
+ * the next line. Each handler has a label in statementLabels, and every
+ * label ends with its own jump to the next statement's label.
+ */
+static int runFrom(BASICState *state, ProgramLine *line, const unsigned char *codePtr, unsigned long budget) {
+    static void *const statementLabels[256] = {
+        [0 ... 255] = &&doUnknown,
+        [TOK_EOL] = &&doEmpty,
+        [TOK_COLON] = &&doEmpty,
+        [TOK_PRINT] = &&doPrint,
+        [TOK_INPUT] = &&doInput,
+        [TOK_LET] = &&doLet,
+        [TOK_VARIABLE] = &&doLet,
+        [TOK_IF] = &&doIf,
+        [TOK_FOR] = &&doFor,
+        [TOK_NEXT] = &&doNext,
+        [TOK_GOSUB] = &&doGosub,
+        [TOK_RETURN] = &&doReturn,
+        [TOK_GOTO] = &&doGoto,
+        [TOK_READ] = &&doRead,
+        [TOK_DATA] = &&doData,
+        [TOK_RESTORE] = &&doRestore,
+        [TOK_DIM] = &&doDim,
+        [TOK_MAT] = &&doMat,
+        [TOK_END] = &&doEnd,
+        [TOK_STOP] = &&doStop,
+        [TOK_REM] = &&doRem
+    };
+    // Without profiling or tracing the loop pays one test of a local per
+    // statement
+    int instrumented = state->profile.enabled || state->statementHook;
+    unsigned long lastTick = instrumented ? readProfileClock(state) : 0;
+    const unsigned char *statement = codePtr;
+    unsigned char type;
+    int ok;
+
     state->running = 1;
-    state->currentLineNumber = 0;
 
-    // Find first line
-    ProgramLine *currentLine = state->programLines;
-    if (!currentLine) {
-        basic_set_error(state, ERR_SYNTAX, "Program is empty");
-        return 0;
+enterLine:
+    if (!codePtr) {
+        goto finished;
+    }
+    state->currentLine = line;
+    state->currentLineNumber = line ? line->lineNumber : 0;
+    DISPATCH_STATEMENT();
+
+nextLine:
+    // A THEN branch that ran stops at ELSE; the rest is skipped
+    if (*codePtr != TOK_EOL && *codePtr != TOK_ELSE) {
+        basic_set_error(state, ERR_SYNTAX, "Unexpected token after statement");
+        goto finished;
     }
+    line = line ? line->next : NULL;
+    codePtr = line ? line->tokens : NULL;
+    goto enterLine;
+
+    STATEMENT(doPrint, basic_handle_print);
+    STATEMENT(doInput, basic_handle_input);
+    STATEMENT(doLet, basic_handle_let);
+    STATEMENT(doIf, basic_handle_if);
+    STATEMENT(doFor, basic_handle_for);
+    STATEMENT(doNext, basic_handle_next);
+    STATEMENT(doGosub, basic_handle_gosub);
+    STATEMENT(doReturn, basic_handle_return);
+    STATEMENT(doGoto, basic_handle_goto);
+    STATEMENT(doRead, basic_handle_read);
+    STATEMENT(doData, basic_handle_data);
+    STATEMENT(doRestore, basic_handle_restore);
+    STATEMENT(doDim, basic_handle_dim);
+    STATEMENT(doMat, basic_handle_mat);
+    STATEMENT(doEnd, basic_handle_end);
+    STATEMENT(doStop, basic_handle_stop);
+    STATEMENT(doRem, basic_handle_rem);
+
+doEmpty:
+    ok = 1;
+    FINISH_STATEMENT();
+
+doUnknown:
+    basic_set_error(state, ERR_SYNTAX, "Unrecognized statement");
+    ok = 0;
+    FINISH_STATEMENT();
+
+outOfBudget:
+    // Stopped before the statement at codePtr; basic_step resumes there
+    state->suspended = 1;
+    state->resumeAt.line = line;
+    state->resumeAt.code = codePtr;
+    budget = 0;
+
+finished:
+    state->budgetLeft = budget;
+    state->running = 0;
+    basic_flush_output(state);
+    return state->errorCode == ERR_NONE;
+}
 
-    // Execute program from first line
-    while (state->running && currentLine) {
-        state->currentLineNumber = currentLine->lineNumber;
+#undef STATEMENT
+#undef FINISH_STATEMENT
+#undef DISPATCH_STATEMENT
+
+#else
+
+/**
+ * Run statements starting at a position until the program ends, stops
+ * or fails, or budget statements have run. Handlers redirect control by
+ * setting jumpTarget; otherwise execution continues after a ':' or with
+ * the next line.
+ */
+static int runFrom(BASICState *state, ProgramLine *line, const unsigned char *codePtr, unsigned long budget) {
+    // Without profiling or tracing the loop pays one test of a local per
+    // statement
+    int instrumented = state->profile.enabled || state->statementHook;
+    unsigned long lastTick = instrumented ? readProfileClock(state) : 0;
+    int ok;
+
+    state->running = 1;
 
-        // Execute the line
-        const char *linePtr = currentLine->lineText;
-        if (!executeStatement(state, &linePtr)) {
+    while (state->running && codePtr) {
+        if (budget-- == 0) {
+            // basic_step resumes at this statement
+            state->suspended = 1;
+            state->resumeAt.line = line;
+            state->resumeAt.code = codePtr;
+            budget = 0;
+            break;
+        }
+
+        state->currentLine = line;
+        state->currentLineNumber = line ? line->lineNumber : 0;
+        state->jumpPending = 0;
+        state->scratchUsed = 0;
+
+        const unsigned char *statement = codePtr;
+        ok = executeStatement(state, &codePtr);
+
+        if (instrumented) {
+            instrumentStatement(state, line, statement, &lastTick);
+        }
+
+        if (!ok) {
             // Error occurred
             break;
         }
 
-        // Move to next line
-        currentLine = currentLine->next;
+        if (state->jumpPending) {
+            line = state->jumpTarget.line;
+            codePtr = state->jumpTarget.code;
+            continue;
+        }
+
+        // A THEN branch that ran stops at ELSE; the rest is skipped
+        if (*codePtr != TOK_EOL && *codePtr != TOK_COLON && *codePtr != TOK_ELSE) {
+            basic_set_error(state, ERR_SYNTAX, "Unexpected token after statement");
+            break;
+        }
+
+        // Move to next statement
+        ProgramPosition next = positionAfter(line, codePtr);
+        line = next.line;
+        codePtr = next.code;
     }
 
+    state->budgetLeft = budget;
     state->running = 0;
+    basic_flush_output(state);
     return state->errorCode == ERR_NONE;
 }
 
+#endif // BASIC_THREADED_DISPATCH
+
 /**
- * Execute a single BASIC statement
+ * Position of the statement that follows the one ending at codePtr
  */
-int executeStatement(BASICState *state, const char **linePtr) {
-    Token *token;
+static ProgramPosition positionAfter(ProgramLine *line, const unsigned char *codePtr) {
+    ProgramPosition position;
 
-    // Skip leading whitespace
-    basic_skip_whitespace(linePtr);
+    if (*codePtr == TOK_COLON) {
+        position.line = line;
+        position.code = codePtr + 1;
+    } else {
+        position.line = line ? line->next : NULL;
+        position.code = position.line ? position.line->tokens : NULL;
+    }
+
+    return position;
+}
+
+/**
+ * Execute a single BASIC statement
+ */
+int executeStatement(BASICState *state, const unsigned char **codePtr) {
+    TokenType type = (TokenType)**codePtr;
 
-    if (!**linePtr) {
-        return 1; // Empty line, success
+    if (type == TOK_EOL || type == TOK_COLON) {
+        return 1; // Empty statement, success
     }
 
-    // Get first token
-    token = basic_get_token(linePtr);
-    if (!token) {
-        basic_set_error(state, ERR_SYNTAX, "Invalid token");
-        return 0;
+    // Consume the statement keyword; assignments keep the variable token
+    if (type != TOK_VARIABLE) {
+        (*codePtr)++;
     }
 
     // Handle statements based on token type
-    switch (token->type) {
+    switch (type) {
         case TOK_PRINT:
-            return basic_handle_print(state, linePtr);
+            return basic_handle_print(state, codePtr);
 
         case TOK_INPUT:
-            return basic_handle_input(state, linePtr);
+            return basic_handle_input(state, codePtr);
 
         case TOK_LET:
-            return basic_handle_let(state, linePtr);
+            return basic_handle_let(state, codePtr);
 
         case TOK_IF:
-            return basic_handle_if(state, linePtr);
+            return basic_handle_if(state, codePtr);
 
         case TOK_FOR:
-            return basic_handle_for(state, linePtr);
+            return basic_handle_for(state, codePtr);
 
         case TOK_NEXT:
-            return basic_handle_next(state, linePtr);
+            return basic_handle_next(state, codePtr);
 
         case TOK_GOSUB:
-            return basic_handle_gosub(state, linePtr);
+            return basic_handle_gosub(state, codePtr);
 
         case TOK_RETURN:
-            return basic_handle_return(state, linePtr);
+            return basic_handle_return(state, codePtr);
 
         case TOK_GOTO:
-            return basic_handle_goto(state, linePtr);
+            return basic_handle_goto(state, codePtr);
 
         case TOK_READ:
-            return basic_handle_read(state, linePtr);
+            return basic_handle_read(state, codePtr);
 
         case TOK_DATA:
-            return basic_handle_data(state, linePtr);
+            return basic_handle_data(state, codePtr);
+
+        case TOK_RESTORE:
+            return basic_handle_restore(state, codePtr);
 
         case TOK_DIM:
-            return basic_handle_dim(state, linePtr);
+            return basic_handle_dim(state, codePtr);
+
+        case TOK_MAT:
+            return basic_handle_mat(state, codePtr);
 
         case TOK_END:
-            return basic_handle_end(state, linePtr);
+            return basic_handle_end(state, codePtr);
 
         case TOK_STOP:
-            return basic_handle_stop(state, linePtr);
+            return basic_handle_stop(state, codePtr);
 
         case TOK_REM:
-            return basic_handle_rem(state, linePtr);
+            return basic_handle_rem(state, codePtr);
 
         case TOK_VARIABLE:
             // Handle variable assignment without LET
-            // Rewind to process as LET statement
-            (*linePtr) -= strlen(token->stringValue);
-            return basic_handle_let(state, linePtr);
+            return basic_handle_let(state, codePtr);
 
         default:
             basic_set_error(state, ERR_SYNTAX, "Unrecognized statement");
@@ -266,8 +825,10 @@ int executeStatement(BASICState *state, const char **linePtr) {
  * Execute a single line of BASIC code
  */
 int basic_execute_line(BASICState *state, const char *lineText) {
+    unsigned char tokens[MAX_TOKENIZED_LENGTH];
+
     if (!state) {
-        state = &globalState;
+        return 0;
     }
 
     if (!lineText) {
@@ -275,8 +836,37 @@ int basic_execute_line(BASICState *state, const char *lineText) {
         return 0;
     }
 
-    const char *linePtr = lineText;
-    return executeStatement(state, &linePtr);
+    basic_set_error(state, ERR_NONE, "No error");
+
+    // A numbered line edits the stored program in place: it replaces or
+    // inserts that line, or deletes it when nothing follows the number
+    const char *ptr = lineText;
+    basic_skip_whitespace(&ptr);
+    if (isdigit(*ptr)) {
+        int lineNumber = readLineNumber(state, &ptr, ptr + strlen(ptr));
+        if (lineNumber < 0) {
+            return 0;
+        }
+        basic_skip_whitespace(&ptr);
+
+        if (!*ptr) {
+            removeLine(state, lineNumber);
+            return 1;
+        }
+        if (strlen(ptr) >= MAX_LINE_LENGTH) {
+            basic_set_error(state, ERR_LINE_NOT_FOUND, "Line too long");
+            return 0;
+        }
+        return addLine(state, lineNumber, ptr, strlen(ptr), 1);
+    }
+
+    // Immediate mode runs through the same tokenized path as programs
+    if (basic_tokenize_line(state, lineText, tokens, sizeof(tokens)) < 0) {
+        return 0; // Error already set
+    }
+
+    // A jump from immediate mode continues in the stored program
+    return runFrom(state, NULL, tokens, NO_BUDGET);
 }
 
 /**
@@ -284,7 +874,7 @@ int basic_execute_line(BASICState *state, const char *lineText) {
  */
 void basic_set_error(BASICState *state, int errorCode, const char *message) {
     if (!state) {
-        state = &globalState;
+        return;
     }
 
     state->errorCode = errorCode;
@@ -292,83 +882,151 @@ void basic_set_error(BASICState *state, int errorCode, const char *message) {
     state->errorMessage[sizeof(state->errorMessage) - 1] = '\0';
 }
 
+/**
+ * Find the index slot for a line number: the position of the line if it
+ * exists, otherwise the position where it would be inserted
+ */
+static int findLineSlot(BASICState *state, int lineNumber) {
+    int low = 0;
+    int high = state->lineCount;
+
+    while (low < high) {
+        int middle = (low + high) / 2;
+        if (state->lineIndex[middle]->lineNumber < lineNumber) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+
+    return low;
+}
+
 /**
  * Find a program line by line number
  */
 static ProgramLine *findLine(BASICState *state, int lineNumber) {
-    ProgramLine *current = state->programLines;
+    int slot = findLineSlot(state, lineNumber);
 
-    while (current) {
-        if (current->lineNumber == lineNumber) {
-            return current;
-        }
-        if (current->lineNumber > lineNumber) {
-            return NULL; // Lines are stored in order
-        }
-        current = current->next;
+    if (slot < state->lineCount && state->lineIndex[slot]->lineNumber == lineNumber) {
+        return state->lineIndex[slot];
     }
 
     return NULL;
 }
 
 /**
- * Add a line to the program
+ * Add a line to the program, or replace the line with the same number.
+ * Only that line's code, its index entry and its links are touched.
  */
-static int addLine(BASICState *state, int lineNumber, const char *lineText) {
-    ProgramLine *newLine;
-    ProgramLine *current = state->programLines;
-    ProgramLine *previous = NULL;
-
-    // Check program size limit
-    if (state->programSize + strlen(lineText) + 100 > MAX_PROGRAM_SIZE) {
+static int addLine(BASICState *state, int lineNumber, const char *lineText, int textLength, int copyText) {
+    ProgramLine *line;
+    ProgramLine *previous;
+    unsigned char tokens[MAX_TOKENIZED_LENGTH];
+    unsigned char *code;
+    int tokenLength;
+    int copyLength;
+    int slot;
+    int replacing;
+
+    unlinkAnalysis(state);
+
+    // Locate the line in the index
+    slot = findLineSlot(state, lineNumber);
+    line = slot < state->lineCount ? state->lineIndex[slot] : NULL;
+    replacing = line && line->lineNumber == lineNumber;
+
+    // Check program size limit against the source actually stored
+    if (state->programSize - (replacing ? line->textLength : 0) + textLength > MAX_PROGRAM_SIZE) {
         basic_set_error(state, ERR_PROGRAM_TOO_LARGE, "Program too large");
         return 0;
     }
 
-    // Allocate memory for new line
-    newLine = (ProgramLine *)basic_malloc(sizeof(ProgramLine));
-    if (!newLine) {
-        basic_set_error(state, ERR_OUT_OF_MEMORY, "Cannot allocate line memory");
+    if (!replacing && state->lineCount >= MAX_LINES) {
+        basic_set_error(state, ERR_PROGRAM_TOO_LARGE, "Too many lines");
         return 0;
     }
 
-    newLine->lineNumber = lineNumber;
-    newLine->lineText = (char *)basic_malloc(strlen(lineText) + 1);
-    if (!newLine->lineText) {
-        basic_free(newLine);
-        basic_set_error(state, ERR_OUT_OF_MEMORY, "Cannot allocate line text memory");
-        return 0;
+    // Tokenize once so the run loop never lexes this line again. Text to
+    // be copied may lack a terminator, so it is scanned from a local copy.
+    if (copyText) {
+        char terminated[MAX_LINE_LENGTH];
+        memcpy(terminated, lineText, textLength);
+        terminated[textLength] = '\0';
+        tokenLength = basic_tokenize_line(state, terminated, tokens, sizeof(tokens));
+    } else {
+        tokenLength = basic_tokenize_line(state, lineText, tokens, sizeof(tokens));
+    }
+    if (tokenLength < 0) {
+        return 0; // Error already set
     }
 
-    strcpy(newLine->lineText, lineText);
-    newLine->next = NULL;
+    // Tokens and (when copied) the source share one arena block. A retyped
+    // line reuses its old block when the new version fits.
+    copyLength = copyText ? textLength + 1 : 0;
+    if (replacing && tokenLength + copyLength <= line->capacity) {
+        code = line->tokens;
+    } else {
+        code = (unsigned char *)programAlloc(state, tokenLength, copyLength, "Cannot allocate line memory");
+        if (!code) {
+            return 0;
+        }
+        if (replacing) {
+            line->capacity = tokenLength + copyLength;
+        }
+    }
 
-    // Insert in sorted order
-    while (current && current->lineNumber < lineNumber) {
-        previous = current;
-        current = current->next;
+    memcpy(code, tokens, tokenLength);
+    if (copyText) {
+        char *text = (char *)code + tokenLength;
+        memcpy(text, lineText, textLength);
+        text[textLength] = '\0';
+        lineText = text;
     }
 
-    if (previous) {
-        newLine->next = current;
-        previous->next = newLine;
+    if (replacing) {
+        // The node stays where it is, so every jump that already points
+        // at it remains valid
+        state->programSize -= line->textLength;
     } else {
-        newLine->next = state->programLines;
-        state->programLines = newLine;
-    }
+        ProgramLine *node = (ProgramLine *)programAlloc(state, 0, sizeof(ProgramLine), "Cannot allocate line memory");
+        if (!node) {
+            return 0;
+        }
 
-    // Remove old line if it exists
-    if (current && current->lineNumber == lineNumber) {
-        if (current->next) {
-            previous->next = current->next;
+        node->lineNumber = lineNumber;
+        node->capacity = tokenLength + copyLength;
+        node->removed = 0;
+        node->dataIndex = 0;
+        node->hits = 0;
+        node->ticks = 0;
+        node->next = line;
+
+        // Open a slot in the index and link after the preceding line;
+        // jumps to this number that could not be resolved before retry
+        // on their next use
+        previous = slot > 0 ? state->lineIndex[slot - 1] : NULL;
+        memmove(&state->lineIndex[slot + 1], &state->lineIndex[slot],
+                (state->lineCount - slot) * sizeof(ProgramLine *));
+        state->lineIndex[slot] = node;
+        state->lineCount++;
+        if (previous) {
+            previous->next = node;
         } else {
-            previous->next = NULL;
+            state->programLines = node;
         }
-        basic_free(current->lineText);
-        basic_free(current);
+
+        line = node;
     }
 
-    state->programSize += strlen(lineText) + 100;
+    line->tokens = code;
+    line->tokenLength = tokenLength;
+    line->lineText = lineText;
+    line->textLength = textLength;
+
+    state->programSize += textLength;
+    state->dataStale = 1;
+    state->programVersion++;
     return 1;
 }
 
@@ -376,145 +1034,265 @@ static int addLine(BASICState *state, int lineNumber, const char *lineText) {
  * Remove a line from the program
  */
 static void removeLine(BASICState *state, int lineNumber) {
-    ProgramLine *current = state->programLines;
-    ProgramLine *previous = NULL;
+    int slot;
+    ProgramLine *current;
 
-    while (current) {
-        if (current->lineNumber == lineNumber) {
-            if (previous) {
-                previous->next = current->next;
-            } else {
-                state->programLines = current->next;
+    unlinkAnalysis(state);
+    slot = findLineSlot(state, lineNumber);
+    if (slot >= state->lineCount || state->lineIndex[slot]->lineNumber != lineNumber) {
+        return;
+    }
+
+    current = state->lineIndex[slot];
+    if (slot > 0) {
+        state->lineIndex[slot - 1]->next = current->next;
+    } else {
+        state->programLines = current->next;
+    }
+
+    memmove(&state->lineIndex[slot], &state->lineIndex[slot + 1],
+            (state->lineCount - slot - 1) * sizeof(ProgramLine *));
+    state->lineCount--;
+
+    // The node's memory stays valid until the next load; marking it lets
+    // jumps that still point here look the number up again
+    current->removed = 1;
+    state->dataStale = 1;
+    state->programVersion++;
+
+    state->programSize -= current->textLength;
+}
+
+/**
+ * Resolve every jump target in the program against the current index
+ */
+static void linkProgram(BASICState *state) {
+    int i;
+
+    for (i = 0; i < state->lineCount; i++) {
+        unsigned char *code = state->lineIndex[i]->tokens;
+
+        while (*code != TOK_EOL) {
+            if (*code == TOK_LINE_REF) {
+                LineRef ref;
+                memcpy(&ref, code + 1, sizeof(LineRef));
+                ref.target = findLine(state, ref.lineNumber);
+                memcpy(code + 1, &ref, sizeof(LineRef));
             }
+            skipToken((const unsigned char **)&code);
+        }
+    }
+}
 
-            state->programSize -= strlen(current->lineText) + 100;
-            basic_free(current->lineText);
-            basic_free(current);
-            return;
+/**
+ * Gather every DATA item in the program into one pool, in line order,
+ * and record for each line where its items start so RESTORE is a lookup
+ */
+static int collectData(BASICState *state) {
+    ProgramLine *line;
+    int pass, i, count = 0;
+
+    // First pass counts, second fills the exactly sized pool
+    for (pass = 0; pass < 2; pass++) {
+        count = 0;
+
+        for (i = 0; i < state->lineCount; i++) {
+            const unsigned char *code;
+
+            line = state->lineIndex[i];
+            code = line->tokens;
+            line->dataIndex = count;
+
+            while (*code != TOK_EOL) {
+                if (*code != TOK_DATA) {
+                    skipToken(&code);
+                    continue;
+                }
+                code++;
+
+                while (!isStatementEnd(code)) {
+                    DataItem *item = pass ? &state->dataPool[count] : NULL;
+                    double sign = 1.0;
+
+                    if (*code == TOK_COMMA) {
+                        code++;
+                        continue;
+                    }
+
+                    if (*code == TOK_MINUS || *code == TOK_PLUS) {
+                        sign = *code == TOK_MINUS ? -1.0 : 1.0;
+                        code++;
+                    }
+
+                    if (*code == TOK_NUMBER) {
+                        code++;
+                        if (item) {
+                            item->isString = 0;
+                            item->number = sign * readNumber(&code);
+                            item->text = NULL;
+                            item->length = 0;
+                        } else {
+                            code += sizeof(double);
+                        }
+                    } else if (*code == TOK_STRING && sign > 0.0) {
+                        if (item) {
+                            item->isString = 1;
+                            item->number = 0.0;
+                            item->length = code[1];
+                            item->text = (const char *)code + 2;
+                        }
+                        skipToken(&code);
+                    } else {
+                        state->currentLineNumber = line->lineNumber;
+                        basic_set_error(state, ERR_SYNTAX, "Invalid DATA item");
+                        return 0;
+                    }
+                    count++;
+                }
+            }
         }
 
-        previous = current;
-        current = current->next;
+        if (pass == 0) {
+            state->dataPool = count ? (DataItem *)programAlloc(state, 0, count * sizeof(DataItem),
+                                                                "Cannot allocate DATA pool") : NULL;
+            if (count && !state->dataPool) {
+                return 0;
+            }
+        }
     }
+
+    state->dataCount = count;
+    state->dataCursor = 0;
+    state->dataStale = 0;
+    return 1;
 }
 
 /**
- * Get next token from input line
+ * Scan the next token from a source line into caller-provided storage
+ *
+ * The source is only read, never modified, and the scanner keeps no
+ * state of its own, so any number of lines can be scanned at once.
+ * Returns 1 on success, or 0 with the error set on the given state.
  */
-Token *basic_get_token(const char **linePtr) {
-    static Token token;
-    char *tokenStart;
+int basic_get_token(BASICState *state, const char **linePtr, Token *token) {
+    const char *tokenStart;
 
     // Skip whitespace
     basic_skip_whitespace(linePtr);
 
-    if (!**linePtr) {
-        token.type = TOK_EOL;
-        return &token;
+    if (!**linePtr || **linePtr == '\n' || **linePtr == '\r') {
+        token->type = TOK_EOL;
+        token->text = *linePtr;
+        token->length = 0;
+        return 1;
     }
 
-    tokenStart = (char *)*linePtr;
+    tokenStart = *linePtr;
+    token->text = tokenStart;
+    token->length = 0;
 
     // Check for numbers
     if (isdigit(**linePtr) || (**linePtr == '.' && isdigit(*(*linePtr + 1)))) {
-        token.type = TOK_NUMBER;
-        token.floatValue = basic_parse_float(linePtr);
-        return &token;
+        token->type = TOK_NUMBER;
+        token->floatValue = basic_parse_float(linePtr);
+        return 1;
     }
 
     // Check for quoted strings
     if (**linePtr == '"') {
         (*linePtr)++; // Skip opening quote
-        tokenStart = (char *)*linePtr;
-        while (**linePtr && **linePtr != '"') {
+        tokenStart = *linePtr;
+        while (**linePtr && **linePtr != '"' && **linePtr != '\n' && **linePtr != '\r') {
             (*linePtr)++;
         }
 
-        if (**linePtr) {
-            **linePtr = '\0'; // Null terminate the string
+        token->type = TOK_STRING;
+        token->text = tokenStart;
+        token->length = *linePtr - tokenStart;
+        int copied = token->length < MAX_VAR_NAME_LENGTH - 1 ? token->length : MAX_VAR_NAME_LENGTH - 1;
+        memcpy(token->stringValue, tokenStart, copied);
+        token->stringValue[copied] = '\0';
+
+        if (**linePtr == '"') {
             (*linePtr)++; // Skip closing quote
         }
-
-        token.type = TOK_STRING;
-        strncpy(token.stringValue, tokenStart, MAX_VAR_NAME_LENGTH - 1);
-        token.stringValue[MAX_VAR_NAME_LENGTH - 1] = '\0';
-        return &token;
+        return 1;
     }
 
     // Check for operators and punctuation
     switch (**linePtr) {
         case '+':
             (*linePtr)++;
-            token.type = TOK_PLUS;
-            return &token;
+            token->type = TOK_PLUS;
+            return 1;
 
         case '-':
             (*linePtr)++;
-            token.type = TOK_MINUS;
-            return &token;
+            token->type = TOK_MINUS;
+            return 1;
 
         case '*':
             (*linePtr)++;
-            token.type = TOK_MULTIPLY;
-            return &token;
+            token->type = TOK_MULTIPLY;
+            return 1;
 
         case '/':
             (*linePtr)++;
-            token.type = TOK_DIVIDE;
-            return &token;
+            token->type = TOK_DIVIDE;
+            return 1;
 
         case '=':
             (*linePtr)++;
-            token.type = TOK_EQUALS;
-            return &token;
+            token->type = TOK_EQUALS;
+            return 1;
 
         case '<':
             (*linePtr)++;
             if (**linePtr == '=') {
                 (*linePtr)++;
-                token.type = TOK_LESS_EQUAL;
+                token->type = TOK_LESS_EQUAL;
             } else if (**linePtr == '>') {
                 (*linePtr)++;
-                token.type = TOK_NOT_EQUAL;
+                token->type = TOK_NOT_EQUAL;
             } else {
-                token.type = TOK_LESS;
+                token->type = TOK_LESS;
             }
-            return &token;
+            return 1;
 
         case '>':
             (*linePtr)++;
             if (**linePtr == '=') {
                 (*linePtr)++;
-                token.type = TOK_GREATER_EQUAL;
+                token->type = TOK_GREATER_EQUAL;
             } else {
-                token.type = TOK_GREATER;
+                token->type = TOK_GREATER;
             }
-            return &token;
+            return 1;
 
         case '(':
             (*linePtr)++;
-            token.type = TOK_LPAREN;
-            return &token;
+            token->type = TOK_LPAREN;
+            return 1;
 
         case ')':
             (*linePtr)++;
-            token.type = TOK_RPAREN;
-            return &token;
+            token->type = TOK_RPAREN;
+            return 1;
 
         case ',':
             (*linePtr)++;
-            token.type = TOK_COMMA;
-            return &token;
+            token->type = TOK_COMMA;
+            return 1;
 
         case ';':
             (*linePtr)++;
-            token.type = TOK_SEMICOLON;
-            return &token;
+            token->type = TOK_SEMICOLON;
+            return 1;
 
         case ':':
             (*linePtr)++;
-            token.type = TOK_COLON;
-            return &token;
+            token->type = TOK_COLON;
+            return 1;
 
         default:
             break;
@@ -522,46 +1300,53 @@ Token *basic_get_token(const char **linePtr) {
 
     // Check for keywords or variables
     if (basic_is_alpha(**linePtr)) {
-        tokenStart = (char *)*linePtr;
+        int length;
+
+        tokenStart = *linePtr;
         while (basic_is_alphanumeric(**linePtr)) {
             (*linePtr)++;
         }
 
-        // Null terminate the token
-        char savedChar = **linePtr;
-        **linePtr = '\0';
+        // String variables and functions carry a '$' suffix, integer
+        // variables a '%'
+        if (**linePtr == '$' || **linePtr == '%') {
+            (*linePtr)++;
+        }
 
         // Copy token
-        strncpy(token.stringValue, tokenStart, MAX_VAR_NAME_LENGTH - 1);
-        token.stringValue[MAX_VAR_NAME_LENGTH - 1] = '\0';
-        **linePtr = savedChar;
+        length = *linePtr - tokenStart;
+        if (length > MAX_VAR_NAME_LENGTH - 1) {
+            length = MAX_VAR_NAME_LENGTH - 1;
+        }
+        memcpy(token->stringValue, tokenStart, length);
+        token->stringValue[length] = '\0';
+        token->text = tokenStart;
+        token->length = *linePtr - tokenStart;
 
         // Convert to uppercase for comparison
-        basic_str_toupper(token.stringValue);
+        basic_str_toupper(token->stringValue);
 
         // Check if it's a keyword
-        token.type = basic_get_keyword_type(token.stringValue);
+        token->type = basic_get_keyword_type(token->stringValue);
 
-        if (token.type == TOK_EOL) {
+        if (token->type == TOK_EOL) {
             // Not a keyword, treat as variable or function
-            if (strlen(token.stringValue) == 1) {
-                token.type = TOK_VARIABLE;
+            const char *lookahead = *linePtr;
+            basic_skip_whitespace(&lookahead);
+
+            if (*lookahead == '(' && basic_lookup_function(token->stringValue) >= 0) {
+                token->type = TOK_FUNCTION;
             } else {
-                // Check if it ends with '(' - function call
-                if (*(*linePtr - 1) == '(') {
-                    token.type = TOK_FUNCTION;
-                } else {
-                    token.type = TOK_VARIABLE;
-                }
+                token->type = TOK_VARIABLE;
             }
         }
 
-        return &token;
+        return 1;
     }
 
     // Unknown token
-    basic_set_error(&globalState, ERR_SYNTAX, "Unrecognized character");
-    return NULL;
+    basic_set_error(state, ERR_SYNTAX, "Unrecognized character");
+    return 0;
 }
 
 /**
@@ -570,8 +1355,8 @@ Token *basic_get_token(const char **linePtr) {
 int basic_is_keyword(const char *word) {
     const char *keywords[] = {
         "PRINT", "INPUT", "LET", "IF", "THEN", "ELSE", "FOR", "TO", "STEP",
-        "NEXT", "GOSUB", "RETURN", "GOTO", "READ", "DATA", "DIM", "END",
-        "STOP", "REM", "AND", "OR", "NOT", NULL
+        "NEXT", "GOSUB", "RETURN", "GOTO", "READ", "DATA", "RESTORE", "DIM",
+        "MAT", "END", "STOP", "REM", "AND", "OR", "NOT", NULL
     };
 
     int i = 0;
@@ -604,7 +1389,9 @@ TokenType basic_get_keyword_type(const char *word) {
     if (strcmp(word, "GOTO") == 0) return TOK_GOTO;
     if (strcmp(word, "READ") == 0) return TOK_READ;
     if (strcmp(word, "DATA") == 0) return TOK_DATA;
+    if (strcmp(word, "RESTORE") == 0) return TOK_RESTORE;
     if (strcmp(word, "DIM") == 0) return TOK_DIM;
+    if (strcmp(word, "MAT") == 0) return TOK_MAT;
     if (strcmp(word, "END") == 0) return TOK_END;
     if (strcmp(word, "STOP") == 0) return TOK_STOP;
     if (strcmp(word, "REM") == 0) return TOK_REM;
@@ -616,413 +1403,3732 @@ TokenType basic_get_keyword_type(const char *word) {
 }
 
 /**
- * Evaluate a BASIC expression
+ * Check if a word names a built-in function
  */
-double basic_evaluate_expression(BASICState *state, const char **linePtr) {
-    double left = basic_evaluate_term(state, linePtr);
-
-    while (1) {
-        basic_skip_whitespace(linePtr);
-
-        if (**linePtr == '+') {
-            (*linePtr)++;
-            left += basic_evaluate_term(state, linePtr);
-        } else if (**linePtr == '-') {
-            (*linePtr)++;
-            left -= basic_evaluate_term(state, linePtr);
-        } else if (**linePtr == '=') {
-            (*linePtr)++;
-            left = (left == basic_evaluate_term(state, linePtr)) ? 1.0 : 0.0;
-        } else if (**linePtr == '<') {
-            (*linePtr)++;
-            if (**linePtr == '=') {
-                (*linePtr)++;
-                left = (left <= basic_evaluate_term(state, linePtr)) ? 1.0 : 0.0;
-            } else if (**linePtr == '>') {
-                (*linePtr)++;
-                left = (left != basic_evaluate_term(state, linePtr)) ? 1.0 : 0.0;
-            } else {
-                left = (left < basic_evaluate_term(state, linePtr)) ? 1.0 : 0.0;
-            }
-        } else if (**linePtr == '>') {
-            (*linePtr)++;
-            if (**linePtr == '=') {
-                (*linePtr)++;
-                left = (left >= basic_evaluate_term(state, linePtr)) ? 1.0 : 0.0;
-            } else {
-                left = (left > basic_evaluate_term(state, linePtr)) ? 1.0 : 0.0;
-            }
-        } else {
-            break;
-        }
-    }
-
-    return left;
+int basic_is_function(const char *word) {
+    return basic_lookup_function(word) >= 0;
 }
 
 /**
- * Evaluate a term (multiplication/division)
+ * FunctionId of a built-in function name, or -1
  */
-double basic_evaluate_term(BASICState *state, const char **linePtr) {
-    double left = basic_evaluate_factor(state, linePtr);
-
-    while (1) {
-        basic_skip_whitespace(linePtr);
+int basic_lookup_function(const char *name) {
+    int id;
 
-        if (**linePtr == '*') {
-            (*linePtr)++;
-            left *= basic_evaluate_factor(state, linePtr);
-        } else if (**linePtr == '/') {
-            (*linePtr)++;
-            double right = basic_evaluate_factor(state, linePtr);
-            if (right == 0.0) {
-                basic_set_error(state, ERR_DIVISION_BY_ZERO, "Division by zero");
-                return 0.0;
-            }
-            left /= right;
-        } else {
-            break;
+    for (id = 0; id < FN_COUNT; id++) {
+        if (strcmp(name, builtinFunctions[id].name) == 0) {
+            return id;
         }
     }
 
-    return left;
+    return -1;
 }
 
 /**
- * Evaluate a factor (numbers, variables, functions, parenthesized expressions)
+ * Hash a variable name into the symbol table (FNV-1a)
  */
-double basic_evaluate_factor(BASICState *state, const char **linePtr) {
-    double result = 0.0;
-    int sign = 1;
-
-    basic_skip_whitespace(linePtr);
+static unsigned int hashName(const char *name) {
+    unsigned int hash = 2166136261u;
 
-    // Handle unary minus
-    if (**linePtr == '-') {
-        sign = -1;
-        (*linePtr)++;
+    while (*name) {
+        hash ^= (unsigned char)*name++;
+        hash *= 16777619u;
     }
 
-    // Handle unary plus
-    if (**linePtr == '+') {
-        (*linePtr)++;
-    }
+    return hash & (SYMBOL_HASH_SIZE - 1);
+}
 
-    basic_skip_whitespace(linePtr);
+/**
+ * Look up the slot for a name, or -1 if it was never interned
+ */
+static int lookupSlot(BASICState *state, const char *name) {
+    unsigned int bucket = hashName(name);
 
-    if (**linePtr == '(') {
-        // Parenthesized expression
-        (*linePtr)++;
-        result = basic_evaluate_expression(state, linePtr);
+    state->profile.variableLookups++;
 
-        if (**linePtr != ')') {
-            basic_set_error(state, ERR_SYNTAX, "Missing closing parenthesis");
-            return 0.0;
-        }
-        (*linePtr)++;
-    } else if (isdigit(**linePtr) || **linePtr == '.') {
-        // Numeric literal
-        result = basic_parse_float(linePtr);
-    } else if (basic_is_alpha(**linePtr)) {
-        // Variable or function
-        Token *token = basic_get_token(linePtr);
-
-        if (token->type == TOK_VARIABLE) {
-            result = basic_get_variable_value(state, token->stringValue);
-        } else if (token->type == TOK_FUNCTION) {
-            // Handle function calls
-            result = basic_evaluate_function(state, token->stringValue, linePtr);
-        } else {
-            basic_set_error(state, ERR_SYNTAX, "Expected variable or function");
-            return 0.0;
+    while (state->symbolHash[bucket]) {
+        int slot = state->symbolHash[bucket] - 1;
+        if (strcmp(state->variables[slot].name, name) == 0) {
+            return slot;
         }
-    } else {
-        basic_set_error(state, ERR_SYNTAX, "Expected number, variable, or expression");
-        return 0.0;
+        bucket = (bucket + 1) & (SYMBOL_HASH_SIZE - 1);
     }
 
-    return result * sign;
+    return -1;
 }
 
 /**
- * Get variable value
+ * Intern an identifier and return its variable slot
  */
-double basic_get_variable_value(BASICState *state, const char *varName) {
-    Variable *var = basic_find_variable(state, varName);
-
-    if (!var) {
-        basic_set_error(state, ERR_UNDEFINED_VARIABLE, "Undefined variable");
-        return 0.0;
+int basic_intern_symbol(BASICState *state, const char *name) {
+    unsigned int bucket = hashName(name);
+    Variable *var;
+
+    while (state->symbolHash[bucket]) {
+        int slot = state->symbolHash[bucket] - 1;
+        if (strcmp(state->variables[slot].name, name) == 0) {
+            return slot;
+        }
+        bucket = (bucket + 1) & (SYMBOL_HASH_SIZE - 1);
     }
 
-    if (var->type == VAR_NUMERIC) {
-        return var->value.numericValue;
-    } else if (var->type == VAR_STRING) {
-        // Try to convert string to number
-        return basic_val(var->value.stringValue);
-    } else {
-        basic_set_error(state, ERR_TYPE_MISMATCH, "Variable is not numeric");
-        return 0.0;
+    if (state->variableCount >= MAX_VARIABLES) {
+        basic_set_error(state, ERR_OUT_OF_MEMORY, "Too many variables");
+        return -1;
+    }
+    if (!reserveMemory(state, MEM_VARIABLES, SLOT_BYTES)) {
+        return -1;
     }
+
+    // Reserve the slot; it stays undefined until first assignment
+    var = &state->variables[state->variableCount];
+    strncpy(var->name, name, MAX_VAR_NAME_LENGTH - 1);
+    var->name[MAX_VAR_NAME_LENGTH - 1] = '\0';
+    var->index = -1;
+    state->variableTypes[state->variableCount] = VAR_UNDEFINED;
+    state->numericValues[state->variableCount] = 0.0;
+
+    state->symbolHash[bucket] = (short)(state->variableCount + 1);
+    return state->variableCount++;
 }
 
 /**
- * Set variable value
+ * Tokenize a line of source into the compact form described in the header,
+ * with every expression compiled. The line ends at a NUL or a newline, so
+ * it may be a slice of a larger buffer. Returns the number of bytes written, or
+ * -1 with the error set.
  */
-void basic_set_variable_value(BASICState *state, const char *varName, double value) {
-    Variable *var = basic_find_variable(state, varName);
+int basic_tokenize_line(BASICState *state, const char *lineText, unsigned char *buffer, int bufferSize) {
+    unsigned char tokens[MAX_TOKENIZED_LENGTH];
 
-    if (!var) {
-        var = basic_create_variable(state, varName, VAR_NUMERIC);
+    if (scanLine(state, lineText, tokens, sizeof(tokens)) < 0) {
+        return -1;
     }
 
-    if (var && var->type == VAR_NUMERIC) {
-        var->value.numericValue = value;
-    }
+    return compileLine(state, tokens, buffer, bufferSize);
 }
 
 /**
- * Find a variable by name
+ * Scan source text into raw tokens (expressions not yet compiled)
  */
-Variable *basic_find_variable(BASICState *state, const char *name) {
-    int i;
+static int scanLine(BASICState *state, const char *lineText, unsigned char *buffer, int bufferSize) {
+    const char *linePtr = lineText;
+    int length = 0;
+    TokenType previous = TOK_EOL;
+    Token scanned;
+    Token *token = &scanned;
 
-    for (i = 0; i < state->variableCount; i++) {
-        if (strcmp(state->variables[i].name, name) == 0) {
-            return &state->variables[i];
+    while (1) {
+        if (!basic_get_token(state, &linePtr, token)) {
+            return -1;
         }
-    }
 
-    return NULL;
-}
+        // A number after a jump keyword is a line reference
+        if (token->type == TOK_NUMBER &&
+            (previous == TOK_GOTO || previous == TOK_GOSUB || previous == TOK_THEN ||
+             previous == TOK_ELSE || previous == TOK_RESTORE)) {
+            token->type = TOK_LINE_REF;
+        }
+        previous = token->type;
 
-/**
- * Create a new variable
- */
-Variable *basic_create_variable(BASICState *state, const char *name, VariableType type) {
-    if (state->variableCount >= MAX_VARIABLES) {
-        basic_set_error(state, ERR_OUT_OF_MEMORY, "Too many variables");
-        return NULL;
-    }
+        // Worst case payload is a line reference or a full string body
+        if (length + 2 + (token->type == TOK_STRING ? token->length : (int)sizeof(LineRef)) > bufferSize) {
+            basic_set_error(state, ERR_PROGRAM_TOO_LARGE, "Line too long to tokenize");
+            return -1;
+        }
 
-    Variable *var = &state->variables[state->variableCount++];
-    strncpy(var->name, name, MAX_VAR_NAME_LENGTH - 1);
-    var->name[MAX_VAR_NAME_LENGTH - 1] = '\0';
-    var->type = type;
+        buffer[length++] = (unsigned char)token->type;
 
-    if (type == VAR_NUMERIC) {
-        var->value.numericValue = 0.0;
-    } else if (type == VAR_STRING) {
-        var->value.stringValue = (char *)basic_malloc(256);
-        if (var->value.stringValue) {
-            var->value.stringValue[0] = '\0';
+        switch (token->type) {
+            case TOK_EOL:
+                return length;
+
+            case TOK_REM:
+                // Comments are never executed; the source keeps the text
+                buffer[length++] = (unsigned char)TOK_EOL;
+                return length;
+
+            case TOK_NUMBER:
+                memcpy(buffer + length, &token->floatValue, sizeof(double));
+                length += sizeof(double);
+                break;
+
+            case TOK_LINE_REF: {
+                LineRef ref;
+                if (token->floatValue > MAX_LINE_NUMBER) {
+                    basic_set_error(state, ERR_SYNTAX, "Line number out of range");
+                    return -1;
+                }
+                ref.lineNumber = (int)token->floatValue;
+                ref.target = findLine(state, ref.lineNumber);
+                memcpy(buffer + length, &ref, sizeof(LineRef));
+                length += sizeof(LineRef);
+                break;
+            }
+
+            case TOK_STRING:
+                if (token->length > 255) {
+                    basic_set_error(state, ERR_SYNTAX, "String literal too long");
+                    return -1;
+                }
+                buffer[length++] = (unsigned char)token->length;
+                memcpy(buffer + length, token->text, token->length);
+                length += token->length;
+                break;
+
+            case TOK_FUNCTION: {
+                // Resolved once here; calls never look at the name again
+                int id = basic_lookup_function(token->stringValue);
+                buffer[length++] = (unsigned char)(id & 0xFF);
+                buffer[length++] = (unsigned char)(id >> 8);
+                break;
+            }
+
+            case TOK_VARIABLE: {
+                int symbol = basic_intern_symbol(state, token->stringValue);
+                if (symbol < 0) {
+                    return -1;
+                }
+                buffer[length++] = (unsigned char)(symbol & 0xFF);
+                buffer[length++] = (unsigned char)(symbol >> 8);
+                break;
+            }
+
+            default:
+                break;
         }
     }
+}
 
-    return var;
+/**
+ * Read the 2-byte payload following a TOK_VARIABLE or TOK_FUNCTION
+ */
+static int readSymbol(const unsigned char **codePtr) {
+    int symbol = (*codePtr)[0] | ((*codePtr)[1] << 8);
+    *codePtr += 2;
+    return symbol;
 }
 
 /**
- * Utility functions
+ * Read the 8-byte payload following a TOK_NUMBER
  */
-int basic_is_numeric(const char *str) {
-    if (!str || !*str) return 0;
+static double readNumber(const unsigned char **codePtr) {
+    double value;
+    memcpy(&value, *codePtr, sizeof(double));
+    *codePtr += sizeof(double);
+    return value;
+}
 
-    while (*str) {
-        if (!isdigit(*str) && *str != '.') return 0;
-        str++;
+/**
+ * Advance past one token and its payload
+ */
+static void skipToken(const unsigned char **codePtr) {
+    TokenType type = (TokenType)**codePtr;
+
+    if (type == TOK_EOL) {
+        return; // Never run off the end of the stream
     }
 
-    return 1;
+    (*codePtr)++;
+    switch (type) {
+        case TOK_NUMBER:
+            *codePtr += sizeof(double);
+            break;
+        case TOK_STRING:
+            *codePtr += 1 + **codePtr;
+            break;
+        case TOK_VARIABLE:
+        case TOK_FUNCTION:
+            *codePtr += 2;
+            break;
+        case TOK_LINE_REF:
+            *codePtr += sizeof(LineRef);
+            break;
+        case TOK_EXPR:
+            *codePtr += 2 + ((*codePtr)[0] | ((*codePtr)[1] << 8));
+            break;
+        default:
+            break;
+    }
 }
 
-int basic_is_alpha(const char c) {
-    return (c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z');
+/**
+ * Check whether the current token terminates a statement
+ */
+static int isStatementEnd(const unsigned char *code) {
+    return *code == TOK_EOL || *code == TOK_COLON || *code == TOK_ELSE;
 }
 
-int basic_is_alphanumeric(const char c) {
-    return basic_is_alpha(c) || isdigit(c);
-}
+/**
+ * Expression compiler
+ *
+ * Raw expression tokens are parsed by recursive descent and emitted as
+ * postfix code. Each parse level reports whether what it emitted is a
+ * single constant, so operators over constants are folded as they are
+ * compiled. Precedence, lowest first: OR, AND, NOT, relational, +/-,
+ * * and /, unary sign. Every subexpression also has a static type, so
+ * type errors are reported when the line is entered rather than run.
+ */
 
-void basic_str_toupper(char *str) {
-    while (*str) {
-        *str = toupper(*str);
-        str++;
+// Output buffer shared by the line and expression compilers
+typedef struct {
+    BASICState *state;
+    unsigned char *buffer;
+    int length;
+    int capacity;
+    int depth;       // Evaluation stack depth at this point of the code
+    int stringDepth; // String stack depth at this point of the code
+    int failed;
+} CodeBuffer;
+
+// Result of compiling a subexpression
+typedef struct {
+    int start;       // Offset of its code in the output
+    ValueType type;  // Type of the value it leaves on the stack
+    int isConst;     // Code is a single OP_CONST
+    double value;    // The constant, when isConst
+} ExprNode;
+
+static ExprNode compileOr(CodeBuffer *out, const unsigned char **in);
+
+static void compileFail(CodeBuffer *out, int errorCode, const char *message) {
+    if (!out->failed) {
+        basic_set_error(out->state, errorCode, message);
+        out->failed = 1;
     }
 }
 
-int basic_parse_int(const char **linePtr) {
-    int value = 0;
-
-    while (isdigit(**linePtr)) {
-        value = value * 10 + (**linePtr - '0');
-        (*linePtr)++;
+static void emitBytes(CodeBuffer *out, const void *data, int length) {
+    if (out->length + length > out->capacity) {
+        compileFail(out, ERR_PROGRAM_TOO_LARGE, "Line too long to compile");
+        return;
     }
-
-    return value;
+    memcpy(out->buffer + out->length, data, length);
+    out->length += length;
 }
 
-double basic_parse_float(const char **linePtr) {
-    double value = 0.0;
-    int sign = 1;
+static void emitByte(CodeBuffer *out, int value) {
+    unsigned char byte = (unsigned char)value;
+    emitBytes(out, &byte, 1);
+}
 
-    // Handle sign
-    if (**linePtr == '-') {
-        sign = -1;
-        (*linePtr)++;
-    } else if (**linePtr == '+') {
-        (*linePtr)++;
+static void adjustDepth(CodeBuffer *out, int delta) {
+    out->depth += delta;
+    if (out->depth > EXPR_STACK_SIZE) {
+        compileFail(out, ERR_STACK_OVERFLOW, "Expression too complex");
     }
+}
 
-    // Parse integer part
-    while (isdigit(**linePtr)) {
-        value = value * 10.0 + (**linePtr - '0');
-        (*linePtr)++;
+static void adjustStringDepth(CodeBuffer *out, int delta) {
+    out->stringDepth += delta;
+    if (out->stringDepth > EXPR_STACK_SIZE) {
+        compileFail(out, ERR_STACK_OVERFLOW, "Expression too complex");
     }
+}
 
-    // Parse fractional part
-    if (**linePtr == '.') {
-        (*linePtr)++;
-        double fraction = 0.1;
+/**
+ * Emit a string operator: + concatenates, relational operators compare
+ * and leave a number. Both operands must be strings.
+ */
+static ExprNode emitStringBinary(CodeBuffer *out, ExprNode left, ExprNode right, ExprOp op) {
+    if (left.type != VALUE_STRING || right.type != VALUE_STRING || op == OP_SUB) {
+        compileFail(out, ERR_TYPE_MISMATCH, "Type mismatch");
+        return left;
+    }
 
-        while (isdigit(**linePtr)) {
-            value += (**linePtr - '0') * fraction;
-            fraction *= 0.1;
-            (*linePtr)++;
-        }
+    if (op == OP_ADD) {
+        emitByte(out, OP_CONCAT);
+        adjustStringDepth(out, -1);
+        return left;
     }
 
-    return value * sign;
+    emitByte(out, OP_STRCMP);
+    emitByte(out, op);
+    adjustStringDepth(out, -2);
+    adjustDepth(out, 1);
+    left.type = VALUE_NUMBER;
+    return left;
 }
 
-void basic_skip_whitespace(const char **linePtr) {
-    while (**linePtr == ' ' || **linePtr == '\t') {
-        (*linePtr)++;
+/**
+ * Fail unless a subexpression is numeric (a number or an integer)
+ */
+static void requireNumber(CodeBuffer *out, ExprNode node) {
+    if (node.type == VALUE_STRING) {
+        compileFail(out, ERR_TYPE_MISMATCH, "Type mismatch");
     }
 }
 
 /**
- * Memory management functions
+ * Type a variable slot holds, from its name's suffix: '$' for strings,
+ * '%' for integers
  */
-void *basic_malloc(int size) {
-    // Use standard library malloc
-    return malloc(size);
-}
+static ValueType slotType(BASICState *state, int slot) {
+    const char *name = state->variables[slot].name;
+    char suffix = name[0] ? name[strlen(name) - 1] : '\0';
 
-void basic_free(void *ptr) {
-    // Use standard library free
-    free(ptr);
+    if (suffix == '$') {
+        return VALUE_STRING;
+    }
+    return suffix == '%' ? VALUE_INTEGER : VALUE_NUMBER;
 }
 
-void *basic_calloc(int count, int size) {
-    // Use standard library calloc
-    return calloc(count, size);
+/**
+ * Whether a number is whole and in integer range
+ */
+static int isIntegral(double value) {
+    return value >= -2147483648.0 && value <= 2147483647.0 && value == (double)(int)value;
 }
 
 /**
- * I/O functions
+ * Emit a constant in place of everything emitted since start
  */
-void basic_print_char(char c) {
-    putchar(c);
+static ExprNode emitConst(CodeBuffer *out, int start, double value) {
+    ExprNode node;
+
+    out->length = start;
+    emitByte(out, OP_CONST);
+    emitBytes(out, &value, sizeof(double));
+
+    node.start = start;
+    node.type = VALUE_NUMBER;
+    node.isConst = 1;
+    node.value = value;
+    return node;
 }
 
-char basic_read_char() {
-    return getchar();
+/**
+ * Emit an integer constant in place of everything emitted since start
+ */
+static ExprNode emitIntConst(CodeBuffer *out, int start, int value) {
+    ExprNode node;
+
+    out->length = start;
+    emitByte(out, OP_ICONST);
+    emitBytes(out, &value, sizeof(int));
+
+    node.start = start;
+    node.type = VALUE_INTEGER;
+    node.isConst = 1;
+    node.value = value;
+    return node;
 }
 
-void basic_print_string(const char *str) {
-    printf("%s", str);
-}
+/**
+ * Turn an integer subexpression into a number. A constant is rewritten
+ * where it stands, even with later code after it; anything else gets a
+ * conversion, OP_ITOF when it is on top of the stack or OP_ITOF2 when
+ * one value has been pushed after it.
+ */
+static ExprNode widen(CodeBuffer *out, ExprNode node, ExprOp convert) {
+    if (node.type != VALUE_INTEGER) {
+        return node;
+    }
 
-void basic_print_newline() {
-    putchar('\n');
-}
+    if (node.isConst) {
+        unsigned char code[1 + sizeof(double)];
+        int oldLength = 1 + sizeof(int);
+        int tail = out->length - node.start - oldLength;
 
-void basic_input_string(char *buffer, int maxLength) {
-    if (fgets(buffer, maxLength, stdin)) {
-        // Remove trailing newline
-        char *newline = strchr(buffer, '\n');
-        if (newline) {
-            *newline = '\0';
+        if (out->length + (int)sizeof(code) - oldLength > out->capacity) {
+            compileFail(out, ERR_PROGRAM_TOO_LARGE, "Line too long to compile");
+            return node;
         }
+        code[0] = OP_CONST;
+        memcpy(code + 1, &node.value, sizeof(double));
+        memmove(out->buffer + node.start + sizeof(code), out->buffer + node.start + oldLength, tail);
+        memcpy(out->buffer + node.start, code, sizeof(code));
+        out->length += sizeof(code) - oldLength;
+    } else {
+        emitByte(out, convert);
     }
+
+    node.type = VALUE_NUMBER;
+    return node;
 }
 
 /**
- * Error handling
+ * Turn the numeric subexpression on top of the stack into an integer
  */
-const char *basic_get_error_message(int errorCode) {
-    switch (errorCode) {
-        case ERR_NONE: return "No error";
-        case ERR_SYNTAX: return "Syntax error";
-        case ERR_OUT_OF_MEMORY: return "Out of memory";
-        case ERR_UNDEFINED_VARIABLE: return "Undefined variable";
-        case ERR_TYPE_MISMATCH: return "Type mismatch";
-        case ERR_DIVISION_BY_ZERO: return "Division by zero";
-        case ERR_ARRAY_BOUNDS: return "Array bounds error";
-        case ERR_STACK_OVERFLOW: return "Stack overflow";
-        case ERR_PROGRAM_TOO_LARGE: return "Program too large";
-        case ERR_LINE_NOT_FOUND: return "Line not found";
-        case ERR_NEXT_WITHOUT_FOR: return "NEXT without FOR";
-        default: return "Unknown error";
+static ExprNode narrow(CodeBuffer *out, ExprNode node) {
+    if (node.type != VALUE_NUMBER) {
+        return node;
+    }
+
+    if (node.isConst) {
+        if (!(node.value > -2147483649.0 && node.value < 2147483648.0)) {
+            compileFail(out, ERR_OVERFLOW, "Overflow");
+            return node;
+        }
+        return emitIntConst(out, node.start, (int)node.value);
     }
+
+    emitByte(out, OP_FTOI);
+    node.type = VALUE_INTEGER;
+    return node;
 }
 
 /**
- * Statement handlers
+ * Emit a binary operator, folding it when both operands are constants
  */
+static ExprNode emitBinary(CodeBuffer *out, ExprNode left, ExprNode right, ExprOp op) {
+    ExprNode node;
+    int integer;
+
+    requireNumber(out, left);
+    requireNumber(out, right);
+
+    // Integers stay integers through +, -, * and comparisons
+    integer = left.type == VALUE_INTEGER && right.type == VALUE_INTEGER &&
+              op != OP_DIV && op != OP_AND && op != OP_OR;
+
+    if (left.isConst && right.isConst && !(op == OP_DIV && right.value == 0.0)) {
+        double a = left.value, b = right.value, result;
+
+        switch (op) {
+            case OP_ADD: result = a + b; break;
+            case OP_SUB: result = a - b; break;
+            case OP_MUL: result = a * b; break;
+            case OP_DIV: result = a / b; break;
+            case OP_EQ:  result = (a == b) ? 1.0 : 0.0; break;
+            case OP_NE:  result = (a != b) ? 1.0 : 0.0; break;
+            case OP_LT:  result = (a < b) ? 1.0 : 0.0; break;
+            case OP_LE:  result = (a <= b) ? 1.0 : 0.0; break;
+            case OP_GT:  result = (a > b) ? 1.0 : 0.0; break;
+            case OP_GE:  result = (a >= b) ? 1.0 : 0.0; break;
+            case OP_AND: result = (a != 0.0 && b != 0.0) ? 1.0 : 0.0; break;
+            default:     result = (a != 0.0 || b != 0.0) ? 1.0 : 0.0; break;
+        }
+
+        adjustDepth(out, -1);
+        if (integer && isIntegral(result)) {
+            return emitIntConst(out, left.start, (int)result);
+        }
+        return emitConst(out, left.start, result);
+    }
+
+    if (integer) {
+        switch (op) {
+            case OP_ADD: emitByte(out, OP_IADD); break;
+            case OP_SUB: emitByte(out, OP_ISUB); break;
+            case OP_MUL: emitByte(out, OP_IMUL); break;
+            default:
+                emitByte(out, OP_ICMP);
+                emitByte(out, op);
+                break;
+        }
+    } else {
+        // The right operand is on top, so it is converted first
+        widen(out, right, OP_ITOF);
+        widen(out, left, OP_ITOF2);
+        emitByte(out, op);
+    }
+    adjustDepth(out, -1);
+
+    node.start = left.start;
+    node.type = integer ? VALUE_INTEGER : VALUE_NUMBER;
+    node.isConst = 0;
+    node.value = 0.0;
+    return node;
+}
 
 /**
- * Handle PRINT statement
+ * Compile a factor (numbers, variables, functions, parenthesized expressions)
  */
-int basic_handle_print(BASICState *state, const char **linePtr) {
-    int newline = 1; // Default to newline after PRINT
+static ExprNode compileFactor(CodeBuffer *out, const unsigned char **in) {
+    ExprNode node;
+    int start = out->length;
 
-    while (1) {
-        basic_skip_whitespace(linePtr);
+    node.start = start;
+    node.type = VALUE_NUMBER;
+    node.isConst = 0;
+    node.value = 0.0;
 
-        if (!**linePtr || **linePtr == '\n' || **linePtr == ':') {
-            break;
+    // Handle unary minus
+    if (**in == TOK_MINUS) {
+        (*in)++;
+        node = compileFactor(out, in);
+        requireNumber(out, node);
+        if (node.isConst) {
+            if (node.type == VALUE_INTEGER && node.value != -2147483648.0) {
+                return emitIntConst(out, start, -(int)node.value);
+            }
+            return emitConst(out, start, -node.value);
         }
+        emitByte(out, node.type == VALUE_INTEGER ? OP_INEG : OP_NEG);
+        node.start = start;
+        return node;
+    }
 
-        if (**linePtr == ',') {
-            // Tab to next zone
-            basic_print_string("     ");
-            (*linePtr)++;
-            continue;
-        }
+    // Handle unary plus
+    if (**in == TOK_PLUS) {
+        (*in)++;
+        node = compileFactor(out, in);
+        requireNumber(out, node);
+        return node;
+    }
+
+    switch ((TokenType)**in) {
+        case TOK_LPAREN:
+            // Parenthesized expression; the parentheses emit no code
+            (*in)++;
+            node = compileOr(out, in);
+            if (**in != TOK_RPAREN) {
+                compileFail(out, ERR_SYNTAX, "Missing closing parenthesis");
+                return node;
+            }
+            (*in)++;
+            return node;
+
+        case TOK_NUMBER:
+            // Numeric literal, parsed when the line was scanned; whole
+            // numbers start out as integers and widen when mixed
+            (*in)++;
+            adjustDepth(out, 1);
+            node.value = readNumber(in);
+            if (isIntegral(node.value)) {
+                return emitIntConst(out, start, (int)node.value);
+            }
+            return emitConst(out, start, node.value);
+
+        case TOK_STRING: {
+            // String literal, carried inline in the code
+            int length;
+
+            (*in)++;
+            length = **in;
+            emitByte(out, OP_STRING);
+            emitBytes(out, *in, 1 + length);
+            *in += 1 + length;
+            adjustStringDepth(out, 1);
+            node.type = VALUE_STRING;
+            return node;
+        }
+
+        case TOK_VARIABLE: {
+            const unsigned char *name;
+            int count = 0;
+
+            (*in)++;
+            name = *in;
+            *in += 2;
+
+            if (**in != TOK_LPAREN) {
+                node.type = slotType(out->state, name[0] | (name[1] << 8));
+                if (node.type == VALUE_STRING) {
+                    emitByte(out, OP_STRVAR);
+                    emitBytes(out, name, 2);
+                    adjustStringDepth(out, 1);
+                    return node;
+                }
+                emitByte(out, node.type == VALUE_INTEGER ? OP_IVAR : OP_VAR);
+                emitBytes(out, name, 2);
+                adjustDepth(out, 1);
+                return node;
+            }
+
+            // Array element: subscripts are pushed, then indexed together
+            (*in)++;
+            while (!out->failed) {
+                ExprNode subscript = compileOr(out, in);
+                requireNumber(out, subscript);
+                narrow(out, subscript);
+                count++;
+                if (**in != TOK_COMMA) {
+                    break;
+                }
+                (*in)++;
+            }
+
+            if (**in != TOK_RPAREN) {
+                compileFail(out, ERR_SYNTAX, "Expected closing parenthesis");
+                return node;
+            }
+            (*in)++;
+
+            if (count > MAX_ARRAY_DIMENSIONS) {
+                compileFail(out, ERR_SYNTAX, "Too many subscripts");
+                return node;
+            }
+
+            emitByte(out, OP_INDEX);
+            emitBytes(out, name, 2);
+            emitByte(out, count);
+            adjustDepth(out, 1 - count);
+            return node;
+        }
+
+        case TOK_FUNCTION: {
+            // Arguments are pushed in order, checked against the signature
+            const BuiltinFunction *function;
+            ExprNode argument;
+            int numberCount = 0, stringCount = 0, count = 0;
+
+            (*in)++;
+            function = &builtinFunctions[readSymbol(in)];
+
+            if (**in != TOK_LPAREN) {
+                compileFail(out, ERR_SYNTAX, "Expected opening parenthesis");
+                return node;
+            }
+            (*in)++;
+
+            // SUM takes a whole array, named without subscripts
+            if (function == &builtinFunctions[FN_SUM]) {
+                if (**in != TOK_VARIABLE || (*in)[3] != TOK_RPAREN) {
+                    compileFail(out, ERR_SYNTAX, "Expected array name");
+                    return node;
+                }
+                emitByte(out, OP_ARRAY_SUM);
+                emitBytes(out, *in + 1, 2);
+                *in += 4;
+                adjustDepth(out, 1);
+                return node;
+            }
+
+            while (!out->failed) {
+                argument = compileOr(out, in);
+                if (count < (int)strlen(function->signature)) {
+                    if ((function->signature[count] == 'S') != (argument.type == VALUE_STRING)) {
+                        compileFail(out, ERR_TYPE_MISMATCH, "Type mismatch");
+                    }
+                    argument = widen(out, argument, OP_ITOF);
+                }
+                if (argument.type == VALUE_STRING) {
+                    stringCount++;
+                } else {
+                    numberCount++;
+                }
+                count++;
+                if (**in != TOK_COMMA) {
+                    break;
+                }
+                (*in)++;
+            }
+
+            if (**in != TOK_RPAREN) {
+                compileFail(out, ERR_SYNTAX, "Expected closing parenthesis");
+                return node;
+            }
+            (*in)++;
+
+            if (count < function->minArguments || count > (int)strlen(function->signature)) {
+                compileFail(out, ERR_SYNTAX, "Wrong number of arguments");
+                return node;
+            }
+
+            // Pure functions of a constant are folded
+            if (function->math && argument.isConst) {
+                return emitConst(out, start, function->math(argument.value));
+            }
+
+            emitByte(out, OP_CALL);
+            emitByte(out, (int)(function - builtinFunctions));
+            emitByte(out, numberCount);
+            emitByte(out, stringCount);
+
+            node.type = function->resultType;
+            adjustDepth(out, (node.type == VALUE_NUMBER) - numberCount);
+            adjustStringDepth(out, (node.type == VALUE_STRING) - stringCount);
+            return node;
+        }
+
+        default:
+            compileFail(out, ERR_SYNTAX, "Expected number, variable, or expression");
+            return node;
+    }
+}
+
+/**
+ * Compile a term (multiplication/division)
+ */
+static ExprNode compileTerm(CodeBuffer *out, const unsigned char **in) {
+    ExprNode left = compileFactor(out, in);
+
+    while (!out->failed && (**in == TOK_MULTIPLY || **in == TOK_DIVIDE)) {
+        ExprOp op = (**in == TOK_MULTIPLY) ? OP_MUL : OP_DIV;
+        (*in)++;
+        left = emitBinary(out, left, compileFactor(out, in), op);
+    }
+
+    return left;
+}
+
+/**
+ * Compile addition and subtraction
+ */
+static ExprNode compileSum(CodeBuffer *out, const unsigned char **in) {
+    ExprNode left = compileTerm(out, in);
+
+    while (!out->failed && (**in == TOK_PLUS || **in == TOK_MINUS)) {
+        ExprOp op = (**in == TOK_PLUS) ? OP_ADD : OP_SUB;
+        ExprNode right;
+
+        (*in)++;
+        right = compileTerm(out, in);
+        if (left.type == VALUE_STRING || right.type == VALUE_STRING) {
+            left = emitStringBinary(out, left, right, op);
+        } else {
+            left = emitBinary(out, left, right, op);
+        }
+    }
+
+    return left;
+}
+
+/**
+ * Compile a comparison
+ */
+static ExprNode compileRelation(CodeBuffer *out, const unsigned char **in) {
+    ExprNode left = compileSum(out, in);
+
+    while (!out->failed) {
+        ExprOp op;
+        ExprNode right;
+
+        switch ((TokenType)**in) {
+            case TOK_EQUALS:        op = OP_EQ; break;
+            case TOK_NOT_EQUAL:     op = OP_NE; break;
+            case TOK_LESS:          op = OP_LT; break;
+            case TOK_LESS_EQUAL:    op = OP_LE; break;
+            case TOK_GREATER:       op = OP_GT; break;
+            case TOK_GREATER_EQUAL: op = OP_GE; break;
+            default:                return left;
+        }
+
+        (*in)++;
+        right = compileSum(out, in);
+        if (left.type == VALUE_STRING || right.type == VALUE_STRING) {
+            left = emitStringBinary(out, left, right, op);
+        } else {
+            left = emitBinary(out, left, right, op);
+        }
+    }
+
+    return left;
+}
+
+/**
+ * Compile a logical NOT
+ */
+static ExprNode compileNot(CodeBuffer *out, const unsigned char **in) {
+    if (**in == TOK_NOT) {
+        int start = out->length;
+        ExprNode node;
+
+        (*in)++;
+        node = compileNot(out, in);
+        requireNumber(out, node);
+        node = widen(out, node, OP_ITOF);
+        if (node.isConst) {
+            return emitConst(out, start, node.value == 0.0 ? 1.0 : 0.0);
+        }
+        emitByte(out, OP_NOT);
+        return node;
+    }
+
+    return compileRelation(out, in);
+}
+
+/**
+ * Compile an AND chain
+ */
+static ExprNode compileAnd(CodeBuffer *out, const unsigned char **in) {
+    ExprNode left = compileNot(out, in);
+
+    while (!out->failed && **in == TOK_AND) {
+        (*in)++;
+        left = emitBinary(out, left, compileNot(out, in), OP_AND);
+    }
+
+    return left;
+}
+
+/**
+ * Compile an OR chain
+ */
+static ExprNode compileOr(CodeBuffer *out, const unsigned char **in) {
+    ExprNode left = compileAnd(out, in);
+
+    while (!out->failed && **in == TOK_OR) {
+        (*in)++;
+        left = emitBinary(out, left, compileAnd(out, in), OP_OR);
+    }
+
+    return left;
+}
+
+/**
+ * Compile one expression into a TOK_EXPR block. The expression must
+ * have the expected type unless that is -1; numeric expressions are
+ * converted between numbers and integers to match. Returns the type
+ * the block produces.
+ */
+static ValueType compileExpression(CodeBuffer *out, const unsigned char **in, int expected) {
+    int header = out->length;
+    int length;
+    ExprNode node;
+
+    emitByte(out, TOK_EXPR);
+    emitByte(out, 0); // Length, patched below
+    emitByte(out, 0);
+
+    out->depth = 0;
+    out->stringDepth = 0;
+    node = compileOr(out, in);
+    if (expected == VALUE_NUMBER) {
+        node = widen(out, node, OP_ITOF);
+    } else if (expected == VALUE_INTEGER) {
+        node = narrow(out, node);
+    }
+    if (expected >= 0 && node.type != (ValueType)expected) {
+        compileFail(out, ERR_TYPE_MISMATCH, "Type mismatch");
+    }
+
+    switch (node.type) {
+        case VALUE_STRING:  emitByte(out, OP_END_STRING); break;
+        case VALUE_INTEGER: emitByte(out, OP_END_INTEGER); break;
+        default:            emitByte(out, OP_END); break;
+    }
+
+    if (!out->failed) {
+        length = out->length - header - 3;
+        out->buffer[header + 1] = (unsigned char)(length & 0xFF);
+        out->buffer[header + 2] = (unsigned char)(length >> 8);
+    }
+    return node.type;
+}
+
+/**
+ * Copy one raw token (and its payload) to the output
+ */
+static void copyToken(CodeBuffer *out, const unsigned char **in) {
+    const unsigned char *start = *in;
+
+    if (**in == TOK_EOL) {
+        return;
+    }
+    skipToken(in);
+    emitBytes(out, start, *in - start);
+}
+
+/**
+ * Compile an assignment target: a variable, or an array element whose
+ * subscripts each become an expression block. Returns the type the
+ * target holds.
+ */
+static ValueType compileTarget(CodeBuffer *out, const unsigned char **in) {
+    int slot = (*in)[1] | ((*in)[2] << 8);
+
+    copyToken(out, in);
+    if (**in != TOK_LPAREN) {
+        return slotType(out->state, slot);
+    }
+
+    copyToken(out, in);
+    while (!out->failed) {
+        compileExpression(out, in, VALUE_INTEGER);
+        if (**in != TOK_COMMA) {
+            break;
+        }
+        copyToken(out, in);
+    }
+    if (**in == TOK_RPAREN) {
+        copyToken(out, in);
+    }
+    return VALUE_NUMBER;
+}
+
+/**
+ * Whether the token at code is a string literal standing alone as an
+ * item, which PRINT outputs without evaluating
+ */
+static int isLoneString(const unsigned char *code) {
+    if (*code != TOK_STRING) {
+        return 0;
+    }
+    skipToken(&code);
+    return isStatementEnd(code) || *code == TOK_COMMA || *code == TOK_SEMICOLON;
+}
+
+/**
+ * Compile one statement: keywords and punctuation are copied, every
+ * expression operand is replaced by its compiled block
+ */
+static void compileStatement(CodeBuffer *out, const unsigned char **in) {
+    TokenType type = (TokenType)**in;
+
+    switch (type) {
+        case TOK_PRINT:
+            copyToken(out, in);
+            while (!out->failed && !isStatementEnd(*in)) {
+                if (isLoneString(*in) || **in == TOK_COMMA || **in == TOK_SEMICOLON) {
+                    copyToken(out, in);
+                } else {
+                    compileExpression(out, in, -1);
+                }
+            }
+            return;
+
+        case TOK_LET:
+            copyToken(out, in);
+            if (**in != TOK_VARIABLE) {
+                break;
+            }
+            // Fall through to the assignment
+        case TOK_VARIABLE: {
+            ValueType type = compileTarget(out, in);
+            if (**in == TOK_EQUALS) {
+                copyToken(out, in);
+                compileExpression(out, in, type);
+            }
+            return;
+        }
+
+        case TOK_READ:
+            copyToken(out, in);
+            while (!out->failed && !isStatementEnd(*in)) {
+                if (**in == TOK_VARIABLE) {
+                    compileTarget(out, in);
+                } else {
+                    copyToken(out, in);
+                }
+            }
+            return;
+
+        case TOK_IF:
+            copyToken(out, in);
+            compileExpression(out, in, VALUE_NUMBER);
+            if (**in == TOK_THEN) {
+                copyToken(out, in);
+                if (**in == TOK_LINE_REF) {
+                    copyToken(out, in);
+                } else {
+                    compileStatement(out, in);
+                }
+            }
+            return;
+
+        case TOK_MAT:
+            // Array names and operators are copied; a parenthesized
+            // scalar becomes an expression block between the parentheses
+            copyToken(out, in);
+            while (!out->failed && !isStatementEnd(*in)) {
+                if (**in == TOK_LPAREN) {
+                    copyToken(out, in);
+                    compileExpression(out, in, VALUE_NUMBER);
+                } else {
+                    copyToken(out, in);
+                }
+            }
+            return;
+
+        case TOK_FOR: {
+            // An integer loop variable makes the whole loop integer
+            ValueType type = VALUE_NUMBER;
+
+            copyToken(out, in);
+            if (**in == TOK_VARIABLE) {
+                if (slotType(out->state, (*in)[1] | ((*in)[2] << 8)) == VALUE_INTEGER) {
+                    type = VALUE_INTEGER;
+                }
+                copyToken(out, in);
+            }
+            if (**in != TOK_EQUALS) {
+                break;
+            }
+            copyToken(out, in);
+            compileExpression(out, in, type);
+            if (**in == TOK_TO) {
+                copyToken(out, in);
+                compileExpression(out, in, type);
+            }
+            if (**in == TOK_STEP) {
+                copyToken(out, in);
+                compileExpression(out, in, type);
+            }
+            return;
+        }
+
+        default:
+            break;
+    }
+
+    // Statements without expression operands are copied as they are;
+    // their handlers report any syntax errors when they run
+    while (!out->failed && !isStatementEnd(*in)) {
+        copyToken(out, in);
+    }
+}
+
+/**
+ * Compile a scanned line. Returns the compiled length, or -1 with the
+ * error set.
+ */
+static int compileLine(BASICState *state, const unsigned char *tokens, unsigned char *buffer, int bufferSize) {
+    CodeBuffer out;
+    const unsigned char *in = tokens;
+
+    out.state = state;
+    out.buffer = buffer;
+    out.length = 0;
+    out.capacity = bufferSize;
+    out.depth = 0;
+    out.stringDepth = 0;
+    out.failed = 0;
+
+    while (!out.failed && *in != TOK_EOL) {
+        compileStatement(&out, &in);
+
+        // Statement separators; ELSE may be followed by a line number
+        if (*in == TOK_COLON) {
+            copyToken(&out, &in);
+        } else if (*in == TOK_ELSE) {
+            copyToken(&out, &in);
+            if (*in == TOK_LINE_REF) {
+                copyToken(&out, &in);
+            }
+        }
+    }
+
+    emitByte(&out, TOK_EOL);
+    return out.failed ? -1 : out.length;
+}
+
+/**
+ * Take bytes from the top of the temporary string stack
+ */
+static char *allocScratch(BASICState *state, int size) {
+    char *block;
+
+    if (state->scratchUsed + size > STRING_SCRATCH_SIZE) {
+        basic_set_error(state, ERR_OUT_OF_MEMORY, "Out of string space");
+        return NULL;
+    }
+
+    block = state->stringScratch + state->scratchUsed;
+    state->scratchUsed += size;
+    return block;
+}
+
+/**
+ * Concatenate right onto left. A left operand that ends at the top of
+ * the temporary stack is extended in place, so chains like A$+B$+C$ copy
+ * each piece once.
+ */
+static int concatStrings(BASICState *state, StringRef *left, StringRef right) {
+    char *text;
+
+    if (left->length + right.length > MAX_STRING_LENGTH) {
+        basic_set_error(state, ERR_OUT_OF_MEMORY, "String too long");
+        return 0;
+    }
+
+    if (left->text + left->length == state->stringScratch + state->scratchUsed) {
+        if (!allocScratch(state, right.length)) {
+            return 0;
+        }
+        memmove((char *)left->text + left->length, right.text, right.length);
+    } else {
+        text = allocScratch(state, left->length + right.length);
+        if (!text) {
+            return 0;
+        }
+        memcpy(text, left->text, left->length);
+        memcpy(text + left->length, right.text, right.length);
+        left->text = text;
+    }
+
+    left->length += right.length;
+    return 1;
+}
+
+/**
+ * Order two strings by character codes, a prefix sorting first
+ */
+static int compareStrings(StringRef left, StringRef right) {
+    int length = left.length < right.length ? left.length : right.length;
+    int order = length ? memcmp(left.text, right.text, length) : 0;
+
+    if (order != 0) {
+        return order;
+    }
+    return left.length - right.length;
+}
+
+/**
+ * Evaluate a compiled numeric expression and advance past its block
+ */
+double basic_evaluate_expression(BASICState *state, const unsigned char **codePtr) {
+    BasicValue value;
+
+    if (!basic_evaluate_value(state, codePtr, &value)) {
+        return 0.0;
+    }
+    if (value.type == VALUE_INTEGER) {
+        return value.integer;
+    }
+    if (value.type != VALUE_NUMBER) {
+        basic_set_error(state, ERR_TYPE_MISMATCH, "Type mismatch");
+        return 0.0;
+    }
+    return value.number;
+}
+
+/**
+ * Evaluate a compiled integer expression and advance past its block
+ */
+int basic_evaluate_integer(BASICState *state, const unsigned char **codePtr) {
+    BasicValue value;
+    int result = 0;
+
+    if (!basic_evaluate_value(state, codePtr, &value)) {
+        return 0;
+    }
+    if (value.type == VALUE_NUMBER) {
+        toInteger(state, value.number, &result);
+        return result;
+    }
+    if (value.type != VALUE_INTEGER) {
+        basic_set_error(state, ERR_TYPE_MISMATCH, "Type mismatch");
+        return 0;
+    }
+    return value.integer;
+}
+
+/**
+ * Evaluate a compiled expression of either type and advance past its
+ * block. String results stay valid until the next statement starts.
+ */
+int basic_evaluate_value(BASICState *state, const unsigned char **codePtr, BasicValue *result) {
+    NumericSlot stack[EXPR_STACK_SIZE];
+    NumericSlot *top = stack - 1;
+    StringRef strings[EXPR_STACK_SIZE];
+    StringRef *stringTop = strings - 1;
+    const unsigned char *pc;
+    const BuiltinFunction *function;
+    int slot, count, i, a, b;
+    long long product;
+    int indices[MAX_ARRAY_DIMENSIONS];
+    double *element;
+
+    if (**codePtr != TOK_EXPR) {
+        basic_set_error(state, ERR_SYNTAX, "Expected expression");
+        return 0;
+    }
+
+    pc = *codePtr + 3;
+    *codePtr = pc + ((*codePtr)[1] | ((*codePtr)[2] << 8));
+
+    while (1) {
+        switch ((ExprOp)*pc++) {
+            case OP_END:
+                result->type = VALUE_NUMBER;
+                result->number = top->number;
+                return 1;
+
+            case OP_END_INTEGER:
+                result->type = VALUE_INTEGER;
+                result->integer = top->integer;
+                return 1;
+
+            case OP_END_STRING:
+                result->type = VALUE_STRING;
+                result->string = *stringTop;
+                return 1;
+
+            case OP_CONST:
+                memcpy(&(++top)->number, pc, sizeof(double));
+                pc += sizeof(double);
+                break;
+
+            case OP_ICONST:
+                memcpy(&(++top)->integer, pc, sizeof(int));
+                pc += sizeof(int);
+                break;
+
+            case OP_VAR:
+                slot = pc[0] | (pc[1] << 8);
+                pc += 2;
+                if (state->variableTypes[slot] == VAR_NUMERIC) {
+                    (++top)->number = state->numericValues[slot];
+                } else {
+                    (++top)->number = basic_get_slot_value(state, slot);
+                    if (state->errorCode != ERR_NONE) {
+                        return 0;
+                    }
+                }
+                break;
+
+            case OP_IVAR:
+                slot = pc[0] | (pc[1] << 8);
+                pc += 2;
+                if (state->variableTypes[slot] != VAR_INTEGER) {
+                    basic_set_error(state, ERR_UNDEFINED_VARIABLE, "Undefined variable");
+                    return 0;
+                }
+                (++top)->integer = state->integerValues[slot];
+                break;
+
+            case OP_STRING:
+                ++stringTop;
+                stringTop->length = pc[0];
+                stringTop->text = (const char *)pc + 1;
+                pc += 1 + pc[0];
+                break;
+
+            case OP_STRVAR:
+                slot = pc[0] | (pc[1] << 8);
+                pc += 2;
+                ++stringTop;
+                if (state->variableTypes[slot] == VAR_STRING &&
+                    state->stringValues[state->variables[slot].index].text) {
+                    StringValue *value = &state->stringValues[state->variables[slot].index];
+                    stringTop->text = value->text;
+                    stringTop->length = value->length;
+                } else {
+                    // Unassigned string variables read as empty
+                    stringTop->text = "";
+                    stringTop->length = 0;
+                }
+                break;
+
+            case OP_INDEX:
+                slot = pc[0] | (pc[1] << 8);
+                count = pc[2];
+                pc += 3;
+                top -= count - 1;
+                for (i = 0; i < count; i++) {
+                    indices[i] = top[i].integer;
+                }
+                element = basic_array_element(state, slot, indices, count);
+                if (!element) {
+                    return 0;
+                }
+                top->number = *element;
+                break;
+
+            case OP_ARRAY_SUM:
+                slot = pc[0] | (pc[1] << 8);
+                pc += 2;
+                if (state->variableTypes[slot] != VAR_ARRAY_NUMERIC) {
+                    basic_set_error(state, ERR_UNDEFINED_VARIABLE, "Array not dimensioned");
+                    return 0;
+                }
+                (++top)->number = arraySum(&state->arrays[state->variables[slot].index]);
+                break;
+
+            case OP_ITOF:
+                top->number = top->integer;
+                break;
+
+            case OP_ITOF2:
+                top[-1].number = top[-1].integer;
+                break;
+
+            case OP_FTOI:
+                if (!toInteger(state, top->number, &top->integer)) {
+                    return 0;
+                }
+                break;
+
+            case OP_IADD:
+                top--;
+                a = top[0].integer;
+                b = top[1].integer;
+                if (b > 0 ? a > 2147483647 - b : a < -2147483647 - 1 - b) {
+                    basic_set_error(state, ERR_OVERFLOW, "Overflow");
+                    return 0;
+                }
+                top->integer = a + b;
+                break;
+
+            case OP_ISUB:
+                top--;
+                a = top[0].integer;
+                b = top[1].integer;
+                if (b < 0 ? a > 2147483647 + b : a < -2147483647 - 1 + b) {
+                    basic_set_error(state, ERR_OVERFLOW, "Overflow");
+                    return 0;
+                }
+                top->integer = a - b;
+                break;
+
+            case OP_IMUL:
+                top--;
+                product = (long long)top[0].integer * top[1].integer;
+                if (product > 2147483647LL || product < -2147483647LL - 1) {
+                    basic_set_error(state, ERR_OVERFLOW, "Overflow");
+                    return 0;
+                }
+                top->integer = (int)product;
+                break;
+
+            case OP_INEG:
+                if (top->integer == -2147483647 - 1) {
+                    basic_set_error(state, ERR_OVERFLOW, "Overflow");
+                    return 0;
+                }
+                top->integer = -top->integer;
+                break;
+
+            case OP_ICMP:
+                top--;
+                a = top[0].integer;
+                b = top[1].integer;
+                switch ((ExprOp)*pc++) {
+                    case OP_EQ: top->integer = a == b; break;
+                    case OP_NE: top->integer = a != b; break;
+                    case OP_LT: top->integer = a < b; break;
+                    case OP_LE: top->integer = a <= b; break;
+                    case OP_GT: top->integer = a > b; break;
+                    default:    top->integer = a >= b; break;
+                }
+                break;
+
+            case OP_CALL:
+                function = &builtinFunctions[pc[0]];
+                if (function->math) {
+                    pc += 3;
+                    top->number = function->math(top->number);
+                    break;
+                }
+
+                // Arguments are popped; the result takes the first slot
+                top -= pc[1];
+                stringTop -= pc[2];
+                pc += 3;
+                if (!function->handler(state, top + 1, stringTop + 1, (int)(pc[-2] + pc[-1]))) {
+                    return 0;
+                }
+                if (function->resultType == VALUE_NUMBER) {
+                    top++;
+                } else {
+                    stringTop++;
+                }
+                break;
+
+            case OP_CONCAT:
+                stringTop--;
+                if (!concatStrings(state, stringTop, stringTop[1])) {
+                    return 0;
+                }
+                break;
+
+            case OP_STRCMP:
+                stringTop -= 2;
+                count = compareStrings(stringTop[1], stringTop[2]);
+                top++;
+                switch ((ExprOp)*pc++) {
+                    case OP_EQ: top->number = (count == 0) ? 1.0 : 0.0; break;
+                    case OP_NE: top->number = (count != 0) ? 1.0 : 0.0; break;
+                    case OP_LT: top->number = (count < 0) ? 1.0 : 0.0; break;
+                    case OP_LE: top->number = (count <= 0) ? 1.0 : 0.0; break;
+                    case OP_GT: top->number = (count > 0) ? 1.0 : 0.0; break;
+                    default:    top->number = (count >= 0) ? 1.0 : 0.0; break;
+                }
+                break;
+
+            case OP_NEG:
+                top->number = -top->number;
+                break;
+
+            case OP_NOT:
+                top->number = (top->number == 0.0) ? 1.0 : 0.0;
+                break;
+
+            case OP_ADD: top--; top->number = top[0].number + top[1].number; break;
+            case OP_SUB: top--; top->number = top[0].number - top[1].number; break;
+            case OP_MUL: top--; top->number = top[0].number * top[1].number; break;
+
+            case OP_DIV:
+                top--;
+                if (top[1].number == 0.0) {
+                    basic_set_error(state, ERR_DIVISION_BY_ZERO, "Division by zero");
+                    return 0;
+                }
+                top->number = top[0].number / top[1].number;
+                break;
+
+            case OP_EQ:  top--; top->number = (top[0].number == top[1].number) ? 1.0 : 0.0; break;
+            case OP_NE:  top--; top->number = (top[0].number != top[1].number) ? 1.0 : 0.0; break;
+            case OP_LT:  top--; top->number = (top[0].number < top[1].number) ? 1.0 : 0.0; break;
+            case OP_LE:  top--; top->number = (top[0].number <= top[1].number) ? 1.0 : 0.0; break;
+            case OP_GT:  top--; top->number = (top[0].number > top[1].number) ? 1.0 : 0.0; break;
+            case OP_GE:  top--; top->number = (top[0].number >= top[1].number) ? 1.0 : 0.0; break;
+            case OP_AND: top--; top->number = (top[0].number != 0.0 && top[1].number != 0.0) ? 1.0 : 0.0; break;
+            case OP_OR:  top--; top->number = (top[0].number != 0.0 || top[1].number != 0.0) ? 1.0 : 0.0; break;
+
+            default:
+                basic_set_error(state, ERR_SYNTAX, "Invalid expression code");
+                return 0;
+        }
+    }
+}
+
+/**
+ * Get variable value
+ */
+double basic_get_variable_value(BASICState *state, const char *varName) {
+    int slot = lookupSlot(state, varName);
+
+    if (slot < 0) {
+        basic_set_error(state, ERR_UNDEFINED_VARIABLE, "Undefined variable");
+        return 0.0;
+    }
+
+    return basic_get_slot_value(state, slot);
+}
+
+/**
+ * Set variable value
+ */
+void basic_set_variable_value(BASICState *state, const char *varName, double value) {
+    int slot = basic_intern_symbol(state, varName);
+
+    if (slot >= 0) {
+        basic_set_slot_value(state, slot, value);
+    }
+}
+
+/**
+ * Get a string variable's value; unassigned strings read as empty
+ */
+const char *basic_get_string_value(BASICState *state, const char *varName) {
+    int slot = lookupSlot(state, varName);
+
+    if (slot < 0 || state->variableTypes[slot] != VAR_STRING ||
+        !state->stringValues[state->variables[slot].index].text) {
+        return "";
+    }
+
+    return state->stringValues[state->variables[slot].index].text;
+}
+
+/**
+ * Set a string variable, defining it on first use
+ */
+int basic_set_string_value(BASICState *state, const char *varName, const char *value) {
+    int slot = basic_intern_symbol(state, varName);
+    StringRef text;
+
+    if (slot < 0) {
+        return 0;
+    }
+
+    text.text = value;
+    text.length = strlen(value);
+    return assignString(state, slot, text);
+}
+
+/**
+ * Get the value of a variable slot resolved at tokenize time
+ */
+double basic_get_slot_value(BASICState *state, int slot) {
+    switch (state->variableTypes[slot]) {
+        case VAR_NUMERIC:
+            return state->numericValues[slot];
+
+        case VAR_INTEGER:
+            return state->integerValues[slot];
+
+        case VAR_UNDEFINED:
+            basic_set_error(state, ERR_UNDEFINED_VARIABLE, "Undefined variable");
+            return 0.0;
+
+        default:
+            basic_set_error(state, ERR_TYPE_MISMATCH, "Variable is not numeric");
+            return 0.0;
+    }
+}
+
+/**
+ * Assign a variable slot, defining it as numeric on first use
+ */
+void basic_set_slot_value(BASICState *state, int slot, double value) {
+    int integer;
+
+    if (state->variableTypes[slot] == VAR_UNDEFINED) {
+        state->variableTypes[slot] = slotType(state, slot) == VALUE_INTEGER ? VAR_INTEGER : VAR_NUMERIC;
+    }
+
+    if (state->variableTypes[slot] == VAR_NUMERIC) {
+        state->numericValues[slot] = value;
+    } else if (state->variableTypes[slot] == VAR_INTEGER) {
+        if (toInteger(state, value, &integer)) {
+            state->integerValues[slot] = integer;
+        }
+    } else {
+        basic_set_error(state, ERR_TYPE_MISMATCH, "Variable is not numeric");
+    }
+}
+
+/**
+ * Assign an integer variable slot, defining it on first use
+ */
+static int setIntegerSlot(BASICState *state, int slot, int value) {
+    if (state->variableTypes[slot] == VAR_UNDEFINED) {
+        state->variableTypes[slot] = VAR_INTEGER;
+    }
+
+    if (state->variableTypes[slot] != VAR_INTEGER) {
+        basic_set_error(state, ERR_TYPE_MISMATCH, "Variable is not an integer");
+        return 0;
+    }
+
+    state->integerValues[slot] = value;
+    return 1;
+}
+
+/**
+ * Convert a number to an integer, dropping any fraction
+ */
+static int toInteger(BASICState *state, double value, int *result) {
+    if (!(value > -2147483649.0 && value < 2147483648.0)) {
+        basic_set_error(state, ERR_OVERFLOW, "Overflow");
+        return 0;
+    }
+
+    *result = (int)value;
+    return 1;
+}
+
+/**
+ * Find a variable by name
+ */
+Variable *basic_find_variable(BASICState *state, const char *name) {
+    int slot = lookupSlot(state, name);
+
+    if (slot < 0 || state->variableTypes[slot] == VAR_UNDEFINED) {
+        return NULL;
+    }
+
+    return &state->variables[slot];
+}
+
+/**
+ * Create a new variable
+ */
+Variable *basic_create_variable(BASICState *state, const char *name, VariableType type) {
+    int slot = basic_intern_symbol(state, name);
+    if (slot < 0) {
+        return NULL;
+    }
+
+    Variable *var = &state->variables[slot];
+
+    if (type == VAR_NUMERIC) {
+        state->numericValues[slot] = 0.0;
+    } else if (type == VAR_INTEGER) {
+        state->integerValues[slot] = 0;
+    } else if (type == VAR_STRING) {
+        // Take a string side table entry unless the slot already has one
+        if (state->variableTypes[slot] != VAR_STRING) {
+            if (state->stringCount >= MAX_STRING_VARIABLES) {
+                basic_set_error(state, ERR_OUT_OF_MEMORY, "Too many string variables");
+                return NULL;
+            }
+            var->index = state->stringCount++;
+            state->stringValues[var->index].text = NULL;
+            state->stringValues[var->index].capacity = 0;
+        }
+        state->stringValues[var->index].length = 0;
+    }
+
+    state->variableTypes[slot] = (unsigned char)type;
+    return var;
+}
+
+/**
+ * Program images
+ */
+#define IMAGE_LAYOUT ((sizeof(LineRef) << 8) | sizeof(double))
+
+/**
+ * FNV-1a over a byte range
+ */
+unsigned int basic_checksum(const void *data, int length) {
+    const unsigned char *bytes = (const unsigned char *)data;
+    unsigned int hash = 2166136261u;
+    int i;
+
+    for (i = 0; i < length; i++) {
+        hash ^= bytes[i];
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+/**
+ * Bytes needed to save the loaded program as an image
+ */
+int basic_image_size(BASICState *state) {
+    ProgramLine *line;
+    int size = sizeof(BasicImageHeader) + state->lineCount * sizeof(BasicImageLine);
+    int i;
+
+    for (i = 0; i < state->variableCount; i++) {
+        size += strlen(state->variables[i].name) + 1;
+    }
+    for (i = 0; i < state->lineCount; i++) {
+        line = state->lineIndex[i];
+        size += line->tokenLength + line->textLength + 1;
+    }
+
+    return size;
+}
+
+/**
+ * Write the loaded program into buffer. Returns the image size, or 0
+ * with the error set if it does not fit.
+ */
+int basic_save_image(BASICState *state, unsigned char *buffer, int capacity) {
+    BasicImageHeader header;
+    BasicImageLine *entries;
+    ProgramLine *line;
+    unsigned char *out;
+    unsigned char *code;
+    int size = basic_image_size(state);
+    int i;
+
+    if (!buffer || capacity < size) {
+        basic_set_error(state, ERR_OUT_OF_MEMORY, "Image buffer too small");
+        return 0;
+    }
+
+    entries = (BasicImageLine *)(buffer + sizeof(BasicImageHeader));
+    out = (unsigned char *)(entries + state->lineCount);
+
+    // Symbols in slot order, so interning them again restores every slot
+    for (i = 0; i < state->variableCount; i++) {
+        int length = strlen(state->variables[i].name) + 1;
+        memcpy(out, state->variables[i].name, length);
+        out += length;
+    }
+    header.symbolBytes = out - (unsigned char *)(entries + state->lineCount);
+
+    code = out;
+    for (i = 0; i < state->lineCount; i++) {
+        unsigned char *tokens = out;
+
+        line = state->lineIndex[i];
+
+        entries[i].lineNumber = line->lineNumber;
+        entries[i].codeOffset = tokens - code;
+        entries[i].tokenLength = line->tokenLength;
+        entries[i].textLength = line->textLength;
+
+        memcpy(out, line->tokens, line->tokenLength);
+        out += line->tokenLength;
+        memcpy(out, line->lineText, line->textLength);
+        out += line->textLength;
+        *out++ = '\0';
+
+        // Cached targets are addresses in this process; drop them
+        while (*tokens != TOK_EOL) {
+            if (*tokens == TOK_LINE_REF) {
+                memset(tokens + 1 + offsetof(LineRef, target), 0, sizeof(ProgramLine *));
+            }
+            skipToken((const unsigned char **)&tokens);
+        }
+    }
+
+    memcpy(header.magic, BASIC_IMAGE_MAGIC, 4);
+    header.version = BASIC_IMAGE_VERSION;
+    header.layout = IMAGE_LAYOUT;
+    header.sourceChecksum = state->sourceChecksum;
+    header.lineCount = state->lineCount;
+    header.symbolCount = state->variableCount;
+    header.codeBytes = out - code;
+    header.checksum = basic_checksum(buffer + sizeof(BasicImageHeader), size - sizeof(BasicImageHeader));
+    memcpy(buffer, &header, sizeof(BasicImageHeader));
+
+    return size;
+}
+
+/**
+ * Check that a built-in call's function exists and that its argument
+ * counts fit the function's signature, as the compiler emits them
+ */
+static int validImageCall(const unsigned char *pc) {
+    const BuiltinFunction *function;
+    int numberCount = 0, stringCount = 0;
+    int i;
+
+    if (pc[0] >= FN_COUNT) {
+        return 0;
+    }
+    function = &builtinFunctions[pc[0]];
+    if (!function->math && !function->handler) {
+        return 0;   // SUM compiles to OP_ARRAY_SUM, never a call
+    }
+    if (pc[1] + pc[2] < function->minArguments || pc[1] + pc[2] > (int)strlen(function->signature)) {
+        return 0;
+    }
+
+    for (i = 0; i < pc[1] + pc[2]; i++) {
+        if (function->signature[i] == 'S') {
+            stringCount++;
+        } else {
+            numberCount++;
+        }
+    }
+    return numberCount == pc[1] && stringCount == pc[2];
+}
+
+/**
+ * Check one compiled expression block: every opcode is known, its
+ * payload stays inside the block, every slot and function exists, both
+ * stacks stay within their size and never underflow, and the block
+ * ends with an END opcode leaving exactly its one result
+ */
+static int validImageExpression(const unsigned char *pc, int length, int symbolCount) {
+    const unsigned char *end = pc + length;
+    int depth = 0, stringDepth = 0;
+
+    while (pc < end) {
+        ExprOp op = (ExprOp)*pc++;
+        int payload = 0, pop = 0, push = 0, stringPop = 0, stringPush = 0;
+
+        switch (op) {
+            case OP_END:
+            case OP_END_INTEGER:
+                return pc == end && depth == 1 && stringDepth == 0;
+            case OP_END_STRING:
+                return pc == end && depth == 0 && stringDepth == 1;
+
+            case OP_CONST:      payload = sizeof(double); push = 1; break;
+            case OP_ICONST:     payload = sizeof(int); push = 1; break;
+            case OP_VAR:
+            case OP_IVAR:
+            case OP_ARRAY_SUM:  payload = 2; push = 1; break;
+            case OP_STRVAR:     payload = 2; stringPush = 1; break;
+            case OP_STRING:     payload = pc < end ? 1 + pc[0] : 1; stringPush = 1; break;
+            case OP_INDEX:      payload = 3; push = 1; break;  // Pops its subscript count
+            case OP_CALL:       payload = 3; break;            // Per the signature, below
+
+            case OP_ITOF:
+            case OP_FTOI:
+            case OP_INEG:
+            case OP_NEG:
+            case OP_NOT:        pop = 1; push = 1; break;
+            case OP_ITOF2:      pop = 2; push = 2; break;
+            case OP_ICMP:       payload = 1; pop = 2; push = 1; break;
+            case OP_CONCAT:     stringPop = 2; stringPush = 1; break;
+            case OP_STRCMP:     payload = 1; stringPop = 2; push = 1; break;
+
+            case OP_IADD:
+            case OP_ISUB:
+            case OP_IMUL:
+            case OP_ADD:
+            case OP_SUB:
+            case OP_MUL:
+            case OP_DIV:
+            case OP_EQ:
+            case OP_NE:
+            case OP_LT:
+            case OP_LE:
+            case OP_GT:
+            case OP_GE:
+            case OP_AND:
+            case OP_OR:         pop = 2; push = 1; break;
+
+            default:
+                return 0;
+        }
+
+        if (payload > end - pc) {
+            return 0;
+        }
+        if ((op == OP_VAR || op == OP_IVAR || op == OP_STRVAR || op == OP_ARRAY_SUM || op == OP_INDEX) &&
+            (pc[0] | (pc[1] << 8)) >= symbolCount) {
+            return 0;
+        }
+        if (op == OP_INDEX) {
+            if (pc[2] < 1 || pc[2] > MAX_ARRAY_DIMENSIONS) {
+                return 0;
+            }
+            pop = pc[2];
+        } else if (op == OP_CALL) {
+            if (!validImageCall(pc)) {
+                return 0;
+            }
+            pop = pc[1];
+            stringPop = pc[2];
+            push = builtinFunctions[pc[0]].resultType == VALUE_NUMBER;
+            stringPush = !push;
+        }
+
+        if (depth < pop || stringDepth < stringPop) {
+            return 0;
+        }
+        depth += push - pop;
+        stringDepth += stringPush - stringPop;
+        if (depth > EXPR_STACK_SIZE || stringDepth > EXPR_STACK_SIZE) {
+            return 0;
+        }
+        pc += payload;
+    }
+
+    return 0;   // No END opcode
+}
+
+/**
+ * Check that a line's tokens stay inside it and end at its last byte,
+ * and that every slot, function and compiled expression they name is
+ * one the image can hold
+ */
+static int validImageTokens(const unsigned char *tokens, int length, int symbolCount) {
+    const unsigned char *code = tokens;
+    const unsigned char *end = tokens + length - 1;
+
+    if (length < 1 || *end != TOK_EOL) {
+        return 0;
+    }
+
+    while (code < end) {
+        // skipToken stops at an end of line, so an early one would hang
+        if (*code == TOK_EOL) {
+            return 0;
+        }
+        if ((*code == TOK_VARIABLE || *code == TOK_FUNCTION) &&
+            (code + 3 > end || (code[1] | (code[2] << 8)) >= (*code == TOK_VARIABLE ? symbolCount : FN_COUNT))) {
+            return 0;
+        }
+        if (*code == TOK_EXPR &&
+            (code + 3 > end || (code[1] | (code[2] << 8)) > end - code - 3 ||
+             !validImageExpression(code + 3, code[1] | (code[2] << 8), symbolCount))) {
+            return 0;
+        }
+        skipToken(&code);
+    }
+
+    return code == end;
+}
+
+/**
+ * Load a program from an image without lexing
+ *
+ * When programText is given, the image is only accepted if it was built
+ * from that text, so a stale image can be detected and rebuilt.
+ */
+int basic_load_image(BASICState *state, const unsigned char *image, int size,
+                     const char *programText, int length) {
+    BasicImageHeader header;
+    const BasicImageLine *entries;
+    const char *symbols;
+    const unsigned char *source;
+    ProgramLine *nodes;
+    unsigned char *code;
+    int textBytes = 0;
+    int i;
+
+    if (!state) {
+        return 0;
+    }
+
+    releaseProgram(state);
+    resetRuntime(state);
+
+    // Header, sizes and checksums first; nothing is allocated before
+    // the image is known to be whole
+    if (!image || size < (int)sizeof(BasicImageHeader)) {
+        basic_set_error(state, ERR_BAD_IMAGE, "Image truncated");
+        return 0;
+    }
+    memcpy(&header, image, sizeof(BasicImageHeader));
+
+    if (memcmp(header.magic, BASIC_IMAGE_MAGIC, 4) != 0 ||
+        header.version != BASIC_IMAGE_VERSION || header.layout != IMAGE_LAYOUT) {
+        basic_set_error(state, ERR_BAD_IMAGE, "Image format not supported");
+        return 0;
+    }
+
+    if (header.lineCount < 0 || header.lineCount > MAX_LINES ||
+        header.symbolCount < 0 || header.symbolCount > MAX_VARIABLES ||
+        header.symbolBytes < 0 || header.codeBytes < 0 ||
+        (size_t)size != sizeof(BasicImageHeader) + (size_t)header.lineCount * sizeof(BasicImageLine) +
+                        (size_t)header.symbolBytes + (size_t)header.codeBytes) {
+        basic_set_error(state, ERR_BAD_IMAGE, "Image truncated");
+        return 0;
+    }
+
+    if (basic_checksum(image + sizeof(BasicImageHeader), size - sizeof(BasicImageHeader)) != header.checksum) {
+        basic_set_error(state, ERR_BAD_IMAGE, "Image checksum mismatch");
+        return 0;
+    }
+
+    if (programText && basic_checksum(programText, length) != header.sourceChecksum) {
+        basic_set_error(state, ERR_BAD_IMAGE, "Image out of date");
+        return 0;
+    }
+
+    entries = (const BasicImageLine *)(image + sizeof(BasicImageHeader));
+    symbols = (const char *)(entries + header.lineCount);
+    source = (const unsigned char *)symbols + header.symbolBytes;
+
+    // Restore the symbol table; a fresh state hands out slots in order
+    for (i = 0; i < header.symbolCount; i++) {
+        const char *name = symbols;
+
+        while (symbols < (const char *)source && *symbols) {
+            symbols++;
+        }
+        if (symbols == (const char *)source || symbols - name >= MAX_VAR_NAME_LENGTH ||
+            basic_intern_symbol(state, name) != i) {
+            resetRuntime(state);
+            basic_set_error(state, ERR_BAD_IMAGE, "Image symbol table invalid");
+            return 0;
+        }
+        symbols++;
+    }
+
+    // One bulk copy of all code, then nodes and index filled in order.
+    // The code holds each line's text after its tokens; the text is
+    // charged as program memory, as for a loaded program.
+    for (i = 0; i < header.lineCount; i++) {
+        textBytes += entries[i].textLength + 1;
+    }
+    if (textBytes < 0 || textBytes > header.codeBytes) {
+        textBytes = header.codeBytes;
+    }
+    nodes = (ProgramLine *)programAlloc(state, 0, header.lineCount * sizeof(ProgramLine) + 1,
+                                        "Cannot allocate program memory");
+    code = nodes ? (unsigned char *)programAlloc(state, header.codeBytes - textBytes, textBytes + 1,
+                                                 "Cannot allocate program memory") : NULL;
+    if (!code) {
+        int errorCode = state->errorCode;
+        char message[sizeof(state->errorMessage)];
+
+        strcpy(message, state->errorMessage);
+        resetRuntime(state);
+        basic_set_error(state, errorCode, message);
+        return 0;
+    }
+    memcpy(code, source, header.codeBytes);
+
+    for (i = 0; i < header.lineCount; i++) {
+        const BasicImageLine *entry = &entries[i];
+        ProgramLine *line = &nodes[i];
+
+        if (entry->codeOffset < 0 || entry->tokenLength < 0 || entry->textLength < 0 ||
+            entry->textLength >= MAX_LINE_LENGTH ||
+            (size_t)entry->codeOffset + (size_t)entry->tokenLength + (size_t)entry->textLength + 1 >
+                (size_t)header.codeBytes ||
+            (i > 0 && entry->lineNumber <= entries[i - 1].lineNumber) ||
+            code[entry->codeOffset + entry->tokenLength + entry->textLength] != '\0' ||
+            !validImageTokens(code + entry->codeOffset, entry->tokenLength, header.symbolCount)) {
+            resetRuntime(state);
+            basic_set_error(state, ERR_BAD_IMAGE, "Image line table invalid");
+            return 0;
+        }
+
+        line->lineNumber = entry->lineNumber;
+        line->tokens = code + entry->codeOffset;
+        line->tokenLength = entry->tokenLength;
+        line->lineText = (const char *)line->tokens + entry->tokenLength;
+        line->textLength = entry->textLength;
+        line->capacity = entry->tokenLength + entry->textLength + 1;
+        line->removed = 0;
+        line->dataIndex = 0;
+        line->hits = 0;
+        line->ticks = 0;
+        line->next = i + 1 < header.lineCount ? &nodes[i + 1] : NULL;
+
+        state->lineIndex[i] = line;
+        state->programSize += entry->textLength;
+    }
+
+    state->lineCount = header.lineCount;
+    state->programLines = header.lineCount > 0 ? nodes : NULL;
+    state->sourceChecksum = header.sourceChecksum;
+
+    linkProgram(state);
+    return collectData(state);
+}
+
+/**
+ * Static analysis
+ *
+ * Lines are the nodes of the control flow graph. A line falls through
+ * to the next unless it ends with GOTO, END, STOP or RETURN outside an
+ * IF; each GOTO, GOSUB, THEN and ELSE target is another edge, and a
+ * FOR has one to its NEXT for loops that run zero times. FOR and NEXT
+ * are paired by nesting, as skipLoopBody pairs them when it runs.
+ */
+#define ANALYSIS_MAX_LOOPS 128
+#define ANALYSIS_MAX_DEPTH 32    // Expression stack entries followed
+
+#define LINE_FALLS_THROUGH 1
+#define LINE_KEEP 2              // Holds FOR, NEXT or DATA, which are found by scanning
+#define LINE_REM_ONLY 4
+#define LINE_REACHABLE 8
+
+// A paired FOR and NEXT; the body lies strictly between them
+typedef struct {
+    int forLine, forOffset;      // Line index and token offset of FOR
+    int nextLine, nextOffset;    // The same for its NEXT, -1 while open
+    int slot;
+    int opaque;                  // Calls a subroutine or jumps out
+    int minTarget, maxTarget;    // Line numbers jumped to from the body
+    unsigned char written[(MAX_VARIABLES + 7) / 8];
+} AnalysisLoop;
+
+typedef struct {
+    unsigned char *flags;        // LINE_* per line index
+    int *worklist;
+    AnalysisLoop loops[ANALYSIS_MAX_LOOPS];
+    int loopCount;
+    int loopsLost;               // More loops than the table holds
+    int open[MAX_FOR_DEPTH];     // Loop table entries of open FORs
+    int openCount;
+} AnalysisWork;
+
+// Expression stack entry: whether the value is loop invariant, and the
+// operators that computed it
+typedef struct {
+    int invariant;
+    int operations;
+} InvariantNode;
+
+static int lineIndexOf(BASICState *state, int lineNumber) {
+    int slot = findLineSlot(state, lineNumber);
+
+    return slot < state->lineCount && state->lineIndex[slot]->lineNumber == lineNumber ? slot : -1;
+}
+
+static int analysisError(BASICState *state, int lineNumber, int errorCode, const char *message) {
+    state->currentLineNumber = lineNumber;
+    basic_set_error(state, errorCode, message);
+    return 0;
+}
+
+/**
+ * Close the loops a NEXT ends: the innermost one, or the innermost over
+ * slot (and any opened inside it). A NEXT under IF may not run, so it
+ * leaves the loops open.
+ */
+static int pairNext(BASICState *state, AnalysisWork *work, int slot, int line, int offset, int conditional) {
+    int depth = work->openCount - 1;
+
+    while (slot >= 0 && depth >= 0 &&
+           (work->open[depth] < 0 || work->loops[work->open[depth]].slot != slot)) {
+        depth--;
+    }
+    if (depth < 0) {
+        return analysisError(state, state->lineIndex[line]->lineNumber, ERR_NEXT_WITHOUT_FOR, "NEXT without FOR");
+    }
+    if (conditional) {
+        return 1;
+    }
+
+    while (work->openCount > depth) {
+        int entry = work->open[--work->openCount];
+        if (entry >= 0) {
+            AnalysisLoop *loop = &work->loops[entry];
+            int forNumber = state->lineIndex[loop->forLine]->lineNumber;
+
+            loop->nextLine = line;
+            loop->nextOffset = offset;
+            if (loop->minTarget <= forNumber || loop->maxTarget > state->lineIndex[line]->lineNumber) {
+                loop->opaque = 1;
+            }
+        }
+    }
+    return 1;
+}
+
+/**
+ * First pass over one line: check its jump targets, pair its FOR and
+ * NEXT statements and record what the loops around it write
+ */
+static int scanAnalysisLine(BASICState *state, AnalysisWork *work, int index, BasicAnalysis *analysis) {
+    ProgramLine *line = state->lineIndex[index];
+    const unsigned char *code = line->tokens;
+    TokenType keyword = TOK_EOL;
+    int statementStart = 1;
+    int conditional = 0;
+    int terminated = 0;
+    int i;
+
+    if (*code == TOK_REM || *code == TOK_EOL) {
+        work->flags[index] |= LINE_REM_ONLY;
+    }
+
+    while (*code != TOK_EOL) {
+        TokenType token = (TokenType)*code;
+
+        if (statementStart && token != TOK_LINE_REF) {
+            keyword = token;
+            if (token == TOK_IF) {
+                conditional = 1;
+            } else if (!conditional && (token == TOK_GOTO || token == TOK_END ||
+                                        token == TOK_STOP || token == TOK_RETURN)) {
+                terminated = 1;
+            }
+
+            if (token == TOK_FOR || token == TOK_NEXT || token == TOK_DATA) {
+                work->flags[index] |= LINE_KEEP;
+            }
+            if (token == TOK_GOSUB) {
+                for (i = 0; i < work->openCount; i++) {
+                    if (work->open[i] >= 0) {
+                        work->loops[work->open[i]].opaque = 1;
+                    }
+                }
+            }
+
+            if (token == TOK_FOR) {
+                if (work->openCount >= MAX_FOR_DEPTH) {
+                    return analysisError(state, line->lineNumber, ERR_STACK_OVERFLOW, "FOR loops nested too deeply");
+                }
+                if (work->loopCount < ANALYSIS_MAX_LOOPS && code[1] == TOK_VARIABLE) {
+                    AnalysisLoop *loop = &work->loops[work->loopCount];
+
+                    memset(loop, 0, sizeof(AnalysisLoop));
+                    loop->forLine = index;
+                    loop->forOffset = (int)(code - line->tokens);
+                    loop->nextLine = -1;
+                    loop->slot = code[2] | (code[3] << 8);
+                    loop->minTarget = line->lineNumber + 1;
+                    loop->maxTarget = line->lineNumber;
+                    work->open[work->openCount++] = work->loopCount++;
+                } else {
+                    work->loopsLost = 1;
+                    work->open[work->openCount++] = -1;
+                }
+            } else if (token == TOK_NEXT) {
+                int slot = code[1] == TOK_VARIABLE ? (code[2] | (code[3] << 8)) : -1;
+
+                if (!pairNext(state, work, slot, index, (int)(code - line->tokens), conditional)) {
+                    return 0;
+                }
+            }
+        }
+        statementStart = token == TOK_COLON || token == TOK_THEN || token == TOK_ELSE;
+
+        if (token == TOK_LINE_REF) {
+            LineRef ref;
+
+            memcpy(&ref, code + 1, sizeof(LineRef));
+            analysis->jumps++;
+            if (lineIndexOf(state, ref.lineNumber) < 0) {
+                char message[64];
+
+                snprintf(message, sizeof(message), "Line %d not found", ref.lineNumber);
+                return analysisError(state, line->lineNumber, ERR_LINE_NOT_FOUND, message);
+            }
+            for (i = 0; keyword != TOK_RESTORE && i < work->openCount; i++) {
+                if (work->open[i] >= 0) {
+                    AnalysisLoop *loop = &work->loops[work->open[i]];
+
+                    if (ref.lineNumber < loop->minTarget) {
+                        loop->minTarget = ref.lineNumber;
+                    }
+                    if (ref.lineNumber > loop->maxTarget) {
+                        loop->maxTarget = ref.lineNumber;
+                    }
+                }
+            }
+        } else if (token == TOK_VARIABLE) {
+            // A name outside an expression is assigned, read into or
+            // dimensioned; expressions only ever read
+            int slot = code[1] | (code[2] << 8);
+
+            for (i = 0; i < work->openCount; i++) {
+                if (work->open[i] >= 0) {
+                    work->loops[work->open[i]].written[slot >> 3] |= (unsigned char)(1 << (slot & 7));
+                }
+            }
+        }
+
+        skipToken(&code);
+    }
+
+    if (!terminated) {
+        work->flags[index] |= LINE_FALLS_THROUGH;
+    }
+    return 1;
+}
+
+/**
+ * Mark every line reachable from the first one
+ */
+static void markReachable(BASICState *state, AnalysisWork *work, BasicAnalysis *analysis) {
+    int head = 0, tail = 0;
+    int i;
+
+    if (state->lineCount == 0) {
+        return;
+    }
+    work->flags[0] |= LINE_REACHABLE;
+    work->worklist[tail++] = 0;
+
+    while (head < tail) {
+        int index = work->worklist[head++];
+        const unsigned char *code = state->lineIndex[index]->tokens;
+        TokenType keyword = TOK_EOL;
+        int statementStart = 1;
+        int targets[MAX_LINE_LENGTH];
+        int count = 0;
+
+        if ((work->flags[index] & LINE_FALLS_THROUGH) && index + 1 < state->lineCount) {
+            targets[count++] = index + 1;
+        }
+        for (i = 0; i < work->loopCount; i++) {
+            if (work->loops[i].forLine == index && work->loops[i].nextLine >= 0 && count < MAX_LINE_LENGTH) {
+                targets[count++] = work->loops[i].nextLine;
+            }
+        }
+        while (*code != TOK_EOL) {
+            if (statementStart && *code != TOK_LINE_REF) {
+                keyword = (TokenType)*code;
+            }
+            statementStart = *code == TOK_COLON || *code == TOK_THEN || *code == TOK_ELSE;
+            if (*code == TOK_LINE_REF && keyword != TOK_RESTORE && count < MAX_LINE_LENGTH) {
+                LineRef ref;
+
+                memcpy(&ref, code + 1, sizeof(LineRef));
+                targets[count++] = lineIndexOf(state, ref.lineNumber);
+            }
+            skipToken(&code);
+        }
+
+        analysis->edges += count;
+        for (i = 0; i < count; i++) {
+            if (!(work->flags[targets[i]] & LINE_REACHABLE)) {
+                work->flags[targets[i]] |= LINE_REACHABLE;
+                work->worklist[tail++] = targets[i];
+            }
+        }
+    }
+}
+
+/**
+ * Record an invariant subexpression that is not already part of a
+ * larger invariant one
+ */
+static void noteInvariant(const InvariantNode *node, BasicAnalysis *analysis, int lineNumber, int loopLine) {
+    if (!node->invariant || node->operations == 0) {
+        return;
+    }
+    if (analysis->hoistCount < MAX_HOIST_CANDIDATES) {
+        HoistCandidate *candidate = &analysis->hoists[analysis->hoistCount];
+
+        candidate->lineNumber = lineNumber;
+        candidate->loopLine = loopLine;
+        candidate->operations = node->operations;
+    }
+    analysis->hoistCount++;
+}
+
+/**
+ * Pop count operands into one result computed by an operator. When the
+ * result varies, the operands that did not are what could be hoisted.
+ */
+static void combineOperands(InvariantNode *stack, int *depth, int count, int invariant,
+                            BasicAnalysis *analysis, int lineNumber, int loopLine) {
+    InvariantNode result;
+    int i;
+
+    result.invariant = invariant;
+    result.operations = 1;
+    for (i = *depth - count; i < *depth; i++) {
+        result.invariant = result.invariant && stack[i].invariant;
+        result.operations += stack[i].operations;
+    }
+    if (!result.invariant) {
+        for (i = *depth - count; i < *depth; i++) {
+            noteInvariant(&stack[i], analysis, lineNumber, loopLine);
+        }
+    }
+
+    *depth -= count;
+    stack[(*depth)++] = result;
+}
+
+/**
+ * Find the largest subexpressions of a compiled expression that read
+ * nothing the loop writes
+ */
+static void findInvariants(const unsigned char *block, const AnalysisLoop *loop, BasicAnalysis *analysis,
+                           int lineNumber, int loopLine) {
+    const unsigned char *pc = block + 3;
+    const unsigned char *end = pc + (block[1] | (block[2] << 8));
+    InvariantNode stack[ANALYSIS_MAX_DEPTH];
+    int depth = 0;
+    int slot, count;
+
+#define WRITTEN(s) ((loop->written[(s) >> 3] >> ((s) & 7)) & 1)
+#define PUSH_LEAF(inv) do { \
+        if (depth == ANALYSIS_MAX_DEPTH) return; \
+        stack[depth].invariant = (inv); \
+        stack[depth++].operations = 0; \
+    } while (0)
+
+    while (pc < end) {
+        ExprOp op = (ExprOp)*pc++;
+
+        switch (op) {
+            case OP_END:
+            case OP_END_INTEGER:
+            case OP_END_STRING:
+                if (depth == 1) {
+                    noteInvariant(&stack[0], analysis, lineNumber, loopLine);
+                }
+                return;
+
+            case OP_CONST:
+                pc += sizeof(double);
+                PUSH_LEAF(1);
+                break;
+            case OP_ICONST:
+                pc += sizeof(int);
+                PUSH_LEAF(1);
+                break;
+            case OP_STRING:
+                pc += 1 + pc[0];
+                PUSH_LEAF(1);
+                break;
+            case OP_VAR:
+            case OP_IVAR:
+            case OP_STRVAR:
+                slot = pc[0] | (pc[1] << 8);
+                pc += 2;
+                PUSH_LEAF(!WRITTEN(slot));
+                break;
+
+            case OP_ARRAY_SUM:
+                slot = pc[0] | (pc[1] << 8);
+                pc += 2;
+                PUSH_LEAF(!WRITTEN(slot));
+                stack[depth - 1].operations = 1;
+                break;
+            case OP_INDEX:
+                slot = pc[0] | (pc[1] << 8);
+                count = pc[2];
+                pc += 3;
+                if (count > depth) return;
+                combineOperands(stack, &depth, count, !WRITTEN(slot), analysis, lineNumber, loopLine);
+                break;
+            case OP_CALL:
+                count = pc[1] + pc[2];
+                if (count > depth || (count == 0 && depth == ANALYSIS_MAX_DEPTH)) return;
+                combineOperands(stack, &depth, count, pc[0] != FN_RND, analysis, lineNumber, loopLine);
+                pc += 3;
+                break;
+
+            case OP_ITOF:
+            case OP_ITOF2:
+            case OP_FTOI:
+                break;  // Conversions are not worth hoisting on their own
+            case OP_INEG:
+            case OP_NEG:
+            case OP_NOT:
+                if (depth < 1) return;
+                stack[depth - 1].operations++;
+                break;
+
+            case OP_ICMP:
+            case OP_STRCMP:
+                pc++;
+                /* fall through */
+            default:
+                if (depth < 2) return;
+                combineOperands(stack, &depth, 2, 1, analysis, lineNumber, loopLine);
+                break;
+        }
+    }
+
+#undef WRITTEN
+#undef PUSH_LEAF
+}
+
+/**
+ * Second pass: look for invariant expressions in the body of the
+ * innermost loop that holds them
+ */
+static void findLoopInvariants(BASICState *state, AnalysisWork *work, BasicAnalysis *analysis) {
+    int index, i;
+
+    for (index = 0; index < state->lineCount; index++) {
+        ProgramLine *line = state->lineIndex[index];
+        const unsigned char *code = line->tokens;
+        TokenType keyword = TOK_EOL;
+        int statementStart = 1;
+
+        while (*code != TOK_EOL) {
+            int offset = (int)(code - line->tokens);
+
+            if (statementStart && *code != TOK_LINE_REF) {
+                keyword = (TokenType)*code;
+            }
+            statementStart = *code == TOK_COLON || *code == TOK_THEN || *code == TOK_ELSE;
+
+            // FOR operands are evaluated once already
+            if (*code == TOK_EXPR && keyword != TOK_FOR) {
+                const AnalysisLoop *inner = NULL;
+
+                for (i = 0; i < work->loopCount; i++) {
+                    const AnalysisLoop *loop = &work->loops[i];
+
+                    if (loop->nextLine >= 0 &&
+                        (index > loop->forLine || (index == loop->forLine && offset > loop->forOffset)) &&
+                        (index < loop->nextLine || (index == loop->nextLine && offset < loop->nextOffset))) {
+                        inner = loop; // Later entries start later, so are nested deeper
+                    }
+                }
+                if (inner && !inner->opaque) {
+                    findInvariants(code, inner, analysis, line->lineNumber,
+                                   state->lineIndex[inner->forLine]->lineNumber);
+                }
+            }
+            skipToken(&code);
+        }
+    }
+}
+
+/**
+ * Undo the links made by basic_analyze_program, before the program is
+ * edited: every line falls through to the next again and every jump is
+ * resolved to its own line
+ */
+static void unlinkAnalysis(BASICState *state) {
+    int i;
+
+    if (!state->analyzed) {
+        return;
+    }
+
+    for (i = 0; i < state->lineCount; i++) {
+        state->lineIndex[i]->next = i + 1 < state->lineCount ? state->lineIndex[i + 1] : NULL;
+    }
+    state->programLines = state->lineCount > 0 ? state->lineIndex[0] : NULL;
+    linkProgram(state);
+    state->analyzed = 0;
+}
+
+/**
+ * Check and trim the loaded program before it runs
+ *
+ * Every GOTO, GOSUB, THEN, ELSE and RESTORE target must exist, and every
+ * NEXT must close a FOR; the first failure is returned as the error it
+ * would raise at run time, with currentLineNumber set to its line. Lines
+ * that are only a REM, and lines no path from the first line reaches,
+ * are then linked out of the run loop's line chain and jumps to them go
+ * to the next line kept. They stay in the line index, so listings,
+ * images and basic_handle_goto_line still see them. Subexpressions of
+ * loop bodies that read nothing the loop writes are listed in analysis
+ * as hoisting candidates. Editing a line undoes the trimming.
+ */
+int basic_analyze_program(BASICState *state, BasicAnalysis *analysis) {
+    AnalysisWork *work;
+    ProgramLine *kept = NULL;
+    int index;
+
+    if (!state || !analysis) {
+        return 0;
+    }
+    memset(analysis, 0, sizeof(BasicAnalysis));
+    unlinkAnalysis(state);
+
+    work = (AnalysisWork *)basic_malloc(sizeof(AnalysisWork));
+    if (work) {
+        work->flags = (unsigned char *)basic_calloc(state->lineCount + 1, 1);
+        work->worklist = (int *)basic_malloc((state->lineCount + 1) * (int)sizeof(int));
+    }
+    if (!work || !work->flags || !work->worklist) {
+        if (work) {
+            basic_free(work->flags);
+            basic_free(work->worklist);
+            basic_free(work);
+        }
+        basic_set_error(state, ERR_OUT_OF_MEMORY, "Cannot allocate analysis memory");
+        return 0;
+    }
+    work->loopCount = 0;
+    work->loopsLost = 0;
+    work->openCount = 0;
+
+    for (index = 0; index < state->lineCount; index++) {
+        if (!scanAnalysisLine(state, work, index, analysis)) {
+            basic_free(work->flags);
+            basic_free(work->worklist);
+            basic_free(work);
+            return 0;
+        }
+    }
+    analysis->lines = state->lineCount;
+    for (index = 0; index < work->loopCount; index++) {
+        if (work->loops[index].nextLine >= 0) {
+            analysis->loops++;
+        } else {
+            analysis->unclosedLoops++;
+        }
+    }
+
+    markReachable(state, work, analysis);
+    findLoopInvariants(state, work, analysis);
+
+    // Relink from the end, so each kept line points at the next kept one.
+    // Without a full loop table a zero-trip edge may be missing, so then
+    // only REM lines go.
+    for (index = state->lineCount - 1; index >= 0; index--) {
+        ProgramLine *line = state->lineIndex[index];
+        int flags = work->flags[index];
+
+        if (flags & LINE_REM_ONLY) {
+            analysis->remLines++;
+        } else if (!(flags & (LINE_REACHABLE | LINE_KEEP)) && !work->loopsLost) {
+            analysis->unreachableLines++;
+        } else {
+            line->next = kept;
+            kept = line;
+            continue;
+        }
+        work->flags[index] |= LINE_REM_ONLY;  // Dropped
+    }
+    // A program of nothing but REM keeps its last line, so it still runs
+    if (!kept && state->lineCount > 0) {
+        kept = state->lineIndex[state->lineCount - 1];
+        kept->next = NULL;
+        work->flags[state->lineCount - 1] &= ~LINE_REM_ONLY;
+        analysis->remLines--;
+    }
+    state->programLines = kept;
+
+    // Jumps to a dropped line go to the next line kept, when there is one
+    for (index = 0; index < state->lineCount; index++) {
+        unsigned char *code = state->lineIndex[index]->tokens;
+
+        while (*code != TOK_EOL) {
+            if (*code == TOK_LINE_REF) {
+                LineRef ref;
+                int target;
+
+                memcpy(&ref, code + 1, sizeof(LineRef));
+                target = lineIndexOf(state, ref.lineNumber);
+                ref.target = state->lineIndex[target];
+                while (target < state->lineCount && (work->flags[target] & LINE_REM_ONLY)) {
+                    target++;
+                }
+                if (target < state->lineCount) {
+                    ref.target = state->lineIndex[target];
+                }
+                memcpy(code + 1, &ref, sizeof(LineRef));
+            }
+            skipToken((const unsigned char **)&code);
+        }
+    }
+
+    basic_free(work->flags);
+    basic_free(work->worklist);
+    basic_free(work);
+
+    state->analyzed = 1;
+    state->programVersion++;
+    return 1;
+}
+
+/**
+ * Snapshots
+ *
+ * A snapshot keeps the variables of a loaded program so that it can be
+ * run again without loading it. Array blocks are not copied: the
+ * snapshot takes them over and the state shares them until it first
+ * writes to one (see writableElement), so restoring costs nothing for
+ * arrays a run only reads and one copy for each array it changed.
+ */
+
+/**
+ * Give an array sharing its block with a snapshot a private copy
+ */
+static int unshareArray(BASICState *state, ArrayValue *array) {
+    double *block = allocArray(state, array->count, 0);
+
+    if (!block) {
+        return 0;
+    }
+    // The shared block stays with the snapshot and is no longer charged
+    releaseMemory(state, MEM_ARRAYS, (long)array->count * (long)sizeof(double));
+    memcpy(block, array->numericArray, array->count * sizeof(double));
+    array->numericArray = block;
+    array->shared = 0;
+    return 1;
+}
+
+/**
+ * basic_array_element for a store
+ */
+static double *writableElement(BASICState *state, int slot, const int indices[], int count) {
+    double *element = basic_array_element(state, slot, indices, count);
+    ArrayValue *array;
+    int offset;
+
+    if (!element) {
+        return NULL;
+    }
+
+    array = &state->arrays[state->variables[slot].index];
+    if (array->shared) {
+        offset = (int)(element - array->numericArray);
+        if (!unshareArray(state, array)) {
+            return NULL;
+        }
+        element = array->numericArray + offset;
+    }
+    return element;
+}
+
+/**
+ * Capture the variables, arrays and RND state of the loaded program
+ *
+ * Usually taken straight after loading, or after a setup run, and put
+ * back with basic_restore_snapshot before each run. Release it with
+ * basic_release_snapshot.
+ */
+int basic_take_snapshot(BASICState *state, BasicSnapshot *snapshot) {
+    int count, total = 0;
+    int i;
+
+    if (!state || !snapshot) {
+        return 0;
+    }
+    count = state->variableCount;
+
+    for (i = 0; i < state->stringCount; i++) {
+        total += state->stringValues[i].length + 1;
+    }
+    snapshot->strings = NULL;
+    if (total > 0) {
+        snapshot->strings = (char *)basic_malloc(total);
+        state->profile.allocations++;
+        if (!snapshot->strings) {
+            basic_set_error(state, ERR_OUT_OF_MEMORY, "Cannot allocate snapshot");
+            return 0;
+        }
+    }
+
+    snapshot->owner = state;
+    snapshot->programVersion = state->programVersion;
+    snapshot->randomState = state->randomState;
+
+    snapshot->variableCount = count;
+    memcpy(snapshot->numericValues, state->numericValues, count * sizeof(double));
+    memcpy(snapshot->integerValues, state->integerValues, count * sizeof(int));
+    memcpy(snapshot->variableTypes, state->variableTypes, count);
+    for (i = 0; i < count; i++) {
+        snapshot->variableIndex[i] = state->variables[i].index;
+    }
+    memcpy(snapshot->symbolHash, state->symbolHash, sizeof(state->symbolHash));
+
+    total = 0;
+    snapshot->stringCount = state->stringCount;
+    for (i = 0; i < state->stringCount; i++) {
+        const StringValue *value = &state->stringValues[i];
+
+        snapshot->stringOffsets[i] = total;
+        snapshot->stringLengths[i] = value->length;
+        if (value->length > 0) {
+            memcpy(snapshot->strings + total, value->text, value->length);
+        }
+        snapshot->strings[total + value->length] = '\0';
+        total += value->length + 1;
+    }
+
+    // Take over the array blocks; one still shared with an earlier
+    // snapshot belongs to that snapshot, so it is copied instead
+    snapshot->arrayCount = state->arrayCount;
+    for (i = 0; i < state->arrayCount; i++) {
+        ArrayValue *array = &state->arrays[i];
+
+        if (array->shared && array->count > 0 && !unshareArray(state, array)) {
+            snapshot->arrayCount = i;
+            basic_release_snapshot(state, snapshot);
+            return 0;
+        }
+        array->shared = array->numericArray != NULL;
+        snapshot->arrays[i] = *array;
+    }
+
+    return 1;
+}
+
+/**
+ * Put the state back as it was when the snapshot was taken, ready to run
+ *
+ * The program itself is untouched. Stacks, the DATA cursor, the
+ * pending output and any suspended basic_step run are reset, and
+ * strings and arrays created since the snapshot are freed.
+ */
+int basic_restore_snapshot(BASICState *state, const BasicSnapshot *snapshot) {
+    long arrayBytes;
+    int count;
+    int i;
+
+    if (!state || !snapshot) {
+        return 0;
+    }
+    if (snapshot->owner != state || snapshot->programVersion != state->programVersion) {
+        basic_set_error(state, ERR_SYNTAX, "Snapshot does not match the loaded program");
+        return 0;
+    }
+
+    count = snapshot->variableCount;
+    memcpy(state->numericValues, snapshot->numericValues, count * sizeof(double));
+    memcpy(state->integerValues, snapshot->integerValues, count * sizeof(int));
+    memcpy(state->variableTypes, snapshot->variableTypes, count);
+    for (i = 0; i < count; i++) {
+        state->variables[i].index = snapshot->variableIndex[i];
+    }
+
+    // Names interned since (by immediate lines) are forgotten
+    state->variableCount = count;
+    memcpy(state->symbolHash, snapshot->symbolHash, sizeof(state->symbolHash));
+
+    for (i = 0; i < snapshot->stringCount; i++) {
+        StringValue *value = &state->stringValues[i];
+        int length = snapshot->stringLengths[i];
+
+        if (length > 0 && length + 1 > value->capacity) {
+            char *block = allocString(state, length + 1);
+            if (!block) {
+                return 0;
+            }
+            freeString(state, value->text);
+            value->text = block;
+            value->capacity = basic_pool_block_size(block);
+        }
+        if (value->text) {
+            memcpy(value->text, snapshot->strings + snapshot->stringOffsets[i], length + 1);
+        }
+        value->length = length;
+    }
+    for (; i < state->stringCount; i++) {
+        freeString(state, state->stringValues[i].text);
+    }
+    state->stringCount = snapshot->stringCount;
+
+    // Arrays still sharing the snapshot's block are unchanged. One the
+    // run wrote to keeps its private block when it has the same size,
+    // so the next run need not copy it again.
+    for (i = 0; i < snapshot->arrayCount; i++) {
+        ArrayValue *array = &state->arrays[i];
+        const ArrayValue *saved = &snapshot->arrays[i];
+
+        if (array->numericArray == saved->numericArray) {
+            continue;
+        }
+        if (!array->shared && array->numericArray && array->count == saved->count) {
+            double *block = array->numericArray;
+
+            memcpy(block, saved->numericArray, saved->count * sizeof(double));
+            *array = *saved;
+            array->numericArray = block;
+            array->shared = 0;
+        } else {
+            if (!array->shared) {
+                basic_free(array->numericArray);
+            }
+            *array = *saved;
+        }
+    }
+    for (; i < state->arrayCount; i++) {
+        if (!state->arrays[i].shared) {
+            basic_free(state->arrays[i].numericArray);
+        }
+    }
+    state->arrayCount = snapshot->arrayCount;
+
+    arrayBytes = 0;
+    for (i = 0; i < state->arrayCount; i++) {
+        arrayBytes += (long)state->arrays[i].count * (long)sizeof(double);
+    }
+    setMemoryUsed(state, MEM_ARRAYS, arrayBytes);
+    setMemoryUsed(state, MEM_VARIABLES, count * SLOT_BYTES);
+
+    state->randomState = snapshot->randomState;
+    state->running = 0;
+    state->currentLine = NULL;
+    state->jumpPending = 0;
+    state->forStackPtr = 0;
+    state->gosubStackPtr = 0;
+    state->dataCursor = 0;
+    state->inputIndex = 0;
+    state->stepping = 0;
+    state->suspended = 0;
+    state->waitingForInput = 0;
+    state->inputReady = 0;
+    state->outputLength = 0;
+    state->scratchUsed = 0;
+    basic_set_error(state, ERR_NONE, "No error");
+    return 1;
+}
+
+/**
+ * Free a snapshot. Arrays of state still sharing its blocks are given
+ * them, so the state may keep running; pass NULL once the state has
+ * been shut down.
+ */
+void basic_release_snapshot(BASICState *state, BasicSnapshot *snapshot) {
+    int i;
+
+    if (!snapshot) {
+        return;
+    }
+
+    for (i = 0; i < snapshot->arrayCount; i++) {
+        double *block = snapshot->arrays[i].numericArray;
+
+        if (state && state == snapshot->owner && i < state->arrayCount &&
+            state->arrays[i].shared && state->arrays[i].numericArray == block) {
+            state->arrays[i].shared = 0;
+        } else {
+            basic_free(block);
+        }
+    }
+
+    basic_free(snapshot->strings);
+    snapshot->strings = NULL;
+    snapshot->arrayCount = 0;
+    snapshot->owner = NULL;
+}
+
+/**
+ * Utility functions
+ */
+int basic_is_numeric(const char *str) {
+    if (!str || !*str) return 0;
+
+    while (*str) {
+        if (!isdigit(*str) && *str != '.') return 0;
+        str++;
+    }
+
+    return 1;
+}
+
+int basic_is_alpha(const char c) {
+    return (c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z');
+}
+
+int basic_is_alphanumeric(const char c) {
+    return basic_is_alpha(c) || isdigit(c);
+}
+
+void basic_str_toupper(char *str) {
+    while (*str) {
+        *str = toupper(*str);
+        str++;
+    }
+}
+
+int basic_parse_int(const char **linePtr) {
+    int value = 0;
+
+    while (isdigit(**linePtr)) {
+        value = value * 10 + (**linePtr - '0');
+        (*linePtr)++;
+    }
+
+    return value;
+}
+
+// Powers of ten that a double holds exactly
+static const double exactPowers[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+#define MAX_EXACT_POWER 22
+#define MAX_EXACT_MANTISSA 9007199254740992ULL  // 2^53
+
+/**
+ * Parse a decimal number: an optional sign, digits with an optional
+ * fraction, and an optional exponent (1.5E-3). The significant digits
+ * are gathered into a 64-bit integer first, so whole numbers are exact.
+ * While that integer and the power of ten both fit a double exactly,
+ * one multiplication or division gives the correctly rounded result;
+ * longer or more extreme literals are left to strtod, which rounds
+ * correctly as well.
+ */
+double basic_parse_float(const char **linePtr) {
+    const char *start = *linePtr;
+    const char *ptr = start;
+    unsigned long long mantissa = 0;
+    int digits = 0;      // Significant digits in mantissa
+    int exponent = 0;    // Power of ten mantissa is scaled by
+    int exact = 1;       // All digits fit in mantissa
+    int negative = 0;
+    double value;
+
+    if (*ptr == '-' || *ptr == '+') {
+        negative = *ptr == '-';
+        ptr++;
+    }
+
+    while (isdigit(*ptr)) {
+        if (digits < 19) {
+            mantissa = mantissa * 10 + (*ptr - '0');
+            digits += mantissa != 0;
+        } else {
+            exact = 0;
+        }
+        ptr++;
+    }
+
+    if (*ptr == '.') {
+        ptr++;
+        while (isdigit(*ptr)) {
+            if (digits < 19) {
+                mantissa = mantissa * 10 + (*ptr - '0');
+                digits += mantissa != 0;
+                exponent--;
+            } else {
+                exact = 0;
+            }
+            ptr++;
+        }
+    }
+
+    // An E only starts an exponent when digits follow it
+    if ((*ptr == 'E' || *ptr == 'e') &&
+        (isdigit(ptr[1]) || ((ptr[1] == '+' || ptr[1] == '-') && isdigit(ptr[2])))) {
+        int power = 0;
+        int sign = 1;
+
+        ptr++;
+        if (*ptr == '-' || *ptr == '+') {
+            sign = *ptr == '-' ? -1 : 1;
+            ptr++;
+        }
+        while (isdigit(*ptr)) {
+            if (power < 10000) {
+                power = power * 10 + (*ptr - '0');
+            }
+            ptr++;
+        }
+        exponent += sign * power;
+    }
+
+    *linePtr = ptr;
+
+    if (mantissa == 0 && exact) {
+        value = 0.0;
+    } else if (exact && mantissa <= MAX_EXACT_MANTISSA &&
+               exponent >= -MAX_EXACT_POWER && exponent <= MAX_EXACT_POWER) {
+        value = exponent < 0 ? (double)mantissa / exactPowers[-exponent]
+                             : (double)mantissa * exactPowers[exponent];
+    } else {
+        return strtod(start, NULL);
+    }
+
+    return negative ? -value : value;
+}
+
+void basic_skip_whitespace(const char **linePtr) {
+    while (**linePtr == ' ' || **linePtr == '\t') {
+        (*linePtr)++;
+    }
+}
+
+/**
+ * Memory management functions
+ */
+void *basic_malloc(int size) {
+    // Use standard library malloc
+    return malloc(size);
+}
+
+void basic_free(void *ptr) {
+    // Use standard library free
+    free(ptr);
+}
+
+void *basic_calloc(int count, int size) {
+    // Use standard library calloc
+    return calloc(count, size);
+}
+
+/**
+ * Arena allocator
+ */
+void basic_arena_init(BasicArena *arena) {
+    arena->chunks = NULL;
+    arena->current = NULL;
+    arena->bytesUsed = 0;
+    arena->bytesReserved = 0;
+    arena->highWater = 0;
+}
+
+void *basic_arena_alloc(BasicArena *arena, int size) {
+    ArenaChunk *chunk = arena->current;
+    void *result;
+
+    // Keep every block 8-byte aligned
+    size = (size + 7) & ~7;
+
+    // Move on to a chunk with room, reusing chunks kept by a reset
+    while (chunk && chunk->used + size > chunk->size) {
+        chunk = chunk->next;
+    }
+
+    if (!chunk) {
+        int chunkSize = size > ARENA_CHUNK_SIZE ? size : ARENA_CHUNK_SIZE;
+        ArenaChunk *last = arena->chunks;
+
+        chunk = (ArenaChunk *)basic_malloc(sizeof(ArenaChunk) + chunkSize);
+        if (!chunk) {
+            return NULL;
+        }
+        chunk->next = NULL;
+        chunk->size = chunkSize;
+        chunk->used = 0;
+
+        if (!last) {
+            arena->chunks = chunk;
+        } else {
+            while (last->next) {
+                last = last->next;
+            }
+            last->next = chunk;
+        }
+        arena->bytesReserved += chunkSize;
+    }
+
+    arena->current = chunk;
+    result = (char *)(chunk + 1) + chunk->used;
+    chunk->used += size;
+
+    arena->bytesUsed += size;
+    if (arena->bytesUsed > arena->highWater) {
+        arena->highWater = arena->bytesUsed;
+    }
+
+    return result;
+}
+
+void basic_arena_reset(BasicArena *arena) {
+    ArenaChunk *chunk;
+
+    for (chunk = arena->chunks; chunk; chunk = chunk->next) {
+        chunk->used = 0;
+    }
+    arena->current = arena->chunks;
+    arena->bytesUsed = 0;
+}
+
+void basic_arena_release(BasicArena *arena) {
+    ArenaChunk *chunk = arena->chunks;
+    int highWater = arena->highWater;
+
+    while (chunk) {
+        ArenaChunk *next = chunk->next;
+        basic_free(chunk);
+        chunk = next;
+    }
+
+    basic_arena_init(arena);
+    arena->highWater = highWater;
+}
+
+/**
+ * String pool
+ *
+ * Each block is preceded by an 8-byte header holding its size class, or
+ * -1 for oversized blocks that come straight from basic_malloc.
+ */
+#define POOL_HEADER_SIZE 8
+
+static int poolClassSize(int sizeClass) {
+    return STRING_POOL_MIN_SIZE << sizeClass;
+}
+
+void basic_pool_init(StringPool *pool) {
+    int i;
+
+    basic_arena_init(&pool->arena);
+    for (i = 0; i < STRING_POOL_CLASSES; i++) {
+        pool->freeLists[i] = NULL;
+    }
+    pool->blocksInUse = 0;
+    pool->bytesInUse = 0;
+    pool->highWater = 0;
+}
+
+char *basic_pool_alloc(StringPool *pool, int size) {
+    int sizeClass = 0;
+    char *block;
+
+    while (sizeClass < STRING_POOL_CLASSES && poolClassSize(sizeClass) < size) {
+        sizeClass++;
+    }
+
+    if (sizeClass == STRING_POOL_CLASSES) {
+        block = (char *)basic_malloc(POOL_HEADER_SIZE + size);
+        if (!block) {
+            return NULL;
+        }
+        sizeClass = -1;
+    } else if (pool->freeLists[sizeClass]) {
+        block = (char *)pool->freeLists[sizeClass];
+        pool->freeLists[sizeClass] = *(void **)(block + POOL_HEADER_SIZE);
+        size = poolClassSize(sizeClass);
+    } else {
+        size = poolClassSize(sizeClass);
+        block = (char *)basic_arena_alloc(&pool->arena, POOL_HEADER_SIZE + size);
+        if (!block) {
+            return NULL;
+        }
+    }
+
+    *(int *)block = sizeClass;
+    ((int *)block)[1] = size;
+
+    pool->blocksInUse++;
+    pool->bytesInUse += size;
+    if (pool->bytesInUse > pool->highWater) {
+        pool->highWater = pool->bytesInUse;
+    }
+
+    return block + POOL_HEADER_SIZE;
+}
+
+void basic_pool_free(StringPool *pool, char *block) {
+    int sizeClass;
+
+    if (!block) {
+        return;
+    }
+
+    block -= POOL_HEADER_SIZE;
+    sizeClass = *(int *)block;
+
+    pool->blocksInUse--;
+    pool->bytesInUse -= ((int *)block)[1];
+
+    if (sizeClass < 0) {
+        basic_free(block);
+        return;
+    }
+
+    *(void **)(block + POOL_HEADER_SIZE) = pool->freeLists[sizeClass];
+    pool->freeLists[sizeClass] = block;
+}
+
+int basic_pool_block_size(const char *block) {
+    return ((const int *)(block - POOL_HEADER_SIZE))[1];
+}
+
+/**
+ * Bytes a request for size bytes takes from the pool, header included
+ */
+int basic_pool_block_cost(int size) {
+    int sizeClass = 0;
+
+    while (sizeClass < STRING_POOL_CLASSES && poolClassSize(sizeClass) < size) {
+        sizeClass++;
+    }
+    return POOL_HEADER_SIZE + (sizeClass == STRING_POOL_CLASSES ? size : poolClassSize(sizeClass));
+}
+
+void basic_pool_reset(StringPool *pool) {
+    int i;
+
+    // Oversized blocks are not tracked, so callers free them explicitly;
+    // everything else goes back with the arena
+    basic_arena_reset(&pool->arena);
+    for (i = 0; i < STRING_POOL_CLASSES; i++) {
+        pool->freeLists[i] = NULL;
+    }
+    pool->blocksInUse = 0;
+    pool->bytesInUse = 0;
+}
+
+void basic_pool_release(StringPool *pool) {
+    int highWater = pool->highWater;
+
+    basic_pool_reset(pool);
+    basic_arena_release(&pool->arena);
+    pool->highWater = highWater;
+}
+
+/**
+ * Memory accounting
+ *
+ * Every allocation the interpreter makes for a program is charged to a
+ * category before it reaches the allocator, so a quota refuses it with
+ * ERR_OUT_OF_MEMORY while the system heap still has room.
+ */
+static const char *memoryCategoryNames[MEM_CATEGORIES] = {
+    "program", "tokens", "variables", "strings", "arrays", "stacks"
+};
+
+static void updateMemoryPeaks(BasicMemory *memory, MemoryCategory category) {
+    if (memory->used[category] > memory->peak[category]) {
+        memory->peak[category] = memory->used[category];
+    }
+    if (memory->total > memory->totalPeak) {
+        memory->totalPeak = memory->total;
+    }
+}
+
+/**
+ * Charge bytes to a category. Returns 0 with the error set if that
+ * would exceed its quota or the total quota.
+ */
+static int reserveMemory(BASICState *state, MemoryCategory category, long bytes) {
+    BasicMemory *memory = &state->memory;
+    char message[64];
+
+    if (memory->quota[category] && memory->used[category] + bytes > memory->quota[category]) {
+        memory->refused++;
+        snprintf(message, sizeof(message), "Memory quota exceeded (%s)", memoryCategoryNames[category]);
+        basic_set_error(state, ERR_OUT_OF_MEMORY, message);
+        return 0;
+    }
+    if (memory->totalQuota && memory->total + bytes > memory->totalQuota) {
+        memory->refused++;
+        basic_set_error(state, ERR_OUT_OF_MEMORY, "Memory quota exceeded");
+        return 0;
+    }
+
+    memory->used[category] += bytes;
+    memory->total += bytes;
+    updateMemoryPeaks(memory, category);
+    return 1;
+}
+
+static void releaseMemory(BASICState *state, MemoryCategory category, long bytes) {
+    state->memory.used[category] -= bytes;
+    state->memory.total -= bytes;
+}
+
+/**
+ * Set a category to a recounted figure, after state has been replaced
+ * wholesale rather than allocated piece by piece
+ */
+static void setMemoryUsed(BASICState *state, MemoryCategory category, long bytes) {
+    state->memory.total += bytes - state->memory.used[category];
+    state->memory.used[category] = bytes;
+    updateMemoryPeaks(&state->memory, category);
+}
+
+/**
+ * Allocate from the program arena, charging tokenBytes as tokens and
+ * textBytes, with the arena's alignment padding, as program. Returns
+ * NULL with the error set (failure as its message when the arena itself
+ * is out of memory).
+ */
+static void *programAlloc(BASICState *state, int tokenBytes, int textBytes, const char *failure) {
+    void *block;
+
+    textBytes += ((tokenBytes + textBytes + 7) & ~7) - (tokenBytes + textBytes);
+    if (!reserveMemory(state, MEM_TOKENS, tokenBytes)) {
+        return NULL;
+    }
+    if (!reserveMemory(state, MEM_PROGRAM, textBytes)) {
+        releaseMemory(state, MEM_TOKENS, tokenBytes);
+        return NULL;
+    }
+
+    block = basic_arena_alloc(&state->programArena, tokenBytes + textBytes);
+    if (!block) {
+        releaseMemory(state, MEM_TOKENS, tokenBytes);
+        releaseMemory(state, MEM_PROGRAM, textBytes);
+        basic_set_error(state, ERR_OUT_OF_MEMORY, failure);
+    }
+    return block;
+}
+
+/**
+ * Take a string block of at least size bytes from the state's pool
+ */
+static char *allocString(BASICState *state, int size) {
+    int cost = basic_pool_block_cost(size);
+    char *block;
+
+    if (!reserveMemory(state, MEM_STRINGS, cost)) {
+        return NULL;
+    }
+
+    block = basic_pool_alloc(&state->stringPool, size);
+    state->profile.allocations++;
+    if (!block) {
+        releaseMemory(state, MEM_STRINGS, cost);
+        basic_set_error(state, ERR_OUT_OF_MEMORY, "Out of string space");
+    }
+    return block;
+}
+
+static void freeString(BASICState *state, char *text) {
+    if (text) {
+        releaseMemory(state, MEM_STRINGS, basic_pool_block_cost(basic_pool_block_size(text)));
+        basic_pool_free(&state->stringPool, text);
+    }
+}
+
+/**
+ * Allocate an array element block of count doubles, zeroed if clear
+ */
+static double *allocArray(BASICState *state, int count, int clear) {
+    long bytes = (long)count * (long)sizeof(double);
+    double *block;
+
+    if (!reserveMemory(state, MEM_ARRAYS, bytes)) {
+        return NULL;
+    }
+
+    block = clear ? (double *)basic_calloc(count, sizeof(double))
+                  : (double *)basic_malloc(count * (int)sizeof(double));
+    state->profile.allocations++;
+    if (!block) {
+        releaseMemory(state, MEM_ARRAYS, bytes);
+        basic_set_error(state, ERR_OUT_OF_MEMORY, "Cannot allocate array memory");
+    }
+    return block;
+}
+
+static void freeArray(BASICState *state, double *block, int count) {
+    releaseMemory(state, MEM_ARRAYS, (long)count * (long)sizeof(double));
+    basic_free(block);
+}
+
+/**
+ * Limit one category to bytes (0 for no limit). Stack frames are
+ * bounded by their tables, so a stacks quota is ignored.
+ */
+void basic_set_memory_quota(BASICState *state, MemoryCategory category, long bytes) {
+    if (state && category >= 0 && category < MEM_CATEGORIES && category != MEM_STACKS) {
+        state->memory.quota[category] = bytes;
+    }
+}
+
+/**
+ * Limit the bytes charged to all categories together (0 for no limit)
+ */
+void basic_set_total_memory_quota(BASICState *state, long bytes) {
+    if (state) {
+        state->memory.totalQuota = bytes;
+    }
+}
+
+/**
+ * Current accounting, with the stack frames measured now
+ */
+const BasicMemory *basic_get_memory(BASICState *state) {
+    BasicMemory *memory = &state->memory;
+
+    memory->used[MEM_STACKS] = state->forStackPtr * (long)sizeof(ForFrame) +
+                               state->gosubStackPtr * (long)sizeof(ProgramPosition);
+    if (memory->used[MEM_STACKS] > memory->peak[MEM_STACKS]) {
+        memory->peak[MEM_STACKS] = memory->used[MEM_STACKS];
+    }
+    return memory;
+}
+
+/**
+ * I/O functions
+ */
+void basic_print_char(char c) {
+    putchar(c);
+}
+
+char basic_read_char() {
+    return getchar();
+}
+
+void basic_print_string(const char *str) {
+    printf("%s", str);
+}
+
+void basic_print_newline() {
+    putchar('\n');
+}
+
+/**
+ * Buffered console output
+ */
+void basic_flush_output(BASICState *state) {
+    if (state->outputLength > 0) {
+        state->profile.outputCalls++;
+        if (state->outputSink) {
+            state->outputSink(state->outputContext, state->outputBuffer, state->outputLength);
+        } else {
+            fwrite(state->outputBuffer, 1, state->outputLength, stdout);
+            fflush(stdout);
+        }
+        state->outputLength = 0;
+    }
+}
+
+void basic_set_output_sink(BASICState *state, BasicOutputSink sink, void *context) {
+    basic_flush_output(state);
+    state->outputSink = sink;
+    state->outputContext = context;
+}
+
+void basic_set_output_buffering(BASICState *state, int lineBuffered) {
+    basic_flush_output(state);
+    state->outputLineBuffered = lineBuffered;
+}
+
+void basic_output_char(BASICState *state, char c) {
+    if (state->outputLength == OUTPUT_BUFFER_SIZE) {
+        basic_flush_output(state);
+    }
+    state->outputBuffer[state->outputLength++] = c;
+    if (c == '\n' && state->outputLineBuffered) {
+        basic_flush_output(state);
+    }
+}
+
+void basic_output_text(BASICState *state, const char *text, int length) {
+    while (length > 0) {
+        int room = OUTPUT_BUFFER_SIZE - state->outputLength;
+        int chunk = length < room ? length : room;
+
+        memcpy(state->outputBuffer + state->outputLength, text, chunk);
+        state->outputLength += chunk;
+        text += chunk;
+        length -= chunk;
+
+        if (state->outputLength == OUTPUT_BUFFER_SIZE) {
+            basic_flush_output(state);
+        }
+    }
+}
+
+void basic_output_number(BASICState *state, double value) {
+    char digits[64];
+    basic_output_text(state, digits, basic_format_number(value, digits));
+}
+
+/**
+ * Format a number in its shortest form of at most FORMAT_DIGITS
+ * significant digits, without trailing zeros: 5, -2.5, 0.3 (for
+ * 0.1 + 0.2), 0.333333333333333. Whole numbers are written digit by
+ * digit; other values in the plain range are scaled to a FORMAT_DIGITS
+ * integer by one exact power of ten, so there is a single rounding.
+ * Very large and very small magnitudes use exponent form through
+ * snprintf. Buffers hold at least 64 bytes; returns the length written.
+ */
+int basic_format_number(double value, char *buffer) {
+    char digits[24];
+    unsigned long long number;
+    double scale, remainder;
+    int length = 0, count = 0, first = 0, exponent;
+
+    if (value == 0.0) {
+        buffer[0] = '0';
+        buffer[1] = '\0';
+        return 1;
+    }
+    if (!(value > -1e15 && value < 1e15) || (value > -1e-6 && value < 1e-6)) {
+        return snprintf(buffer, 64, "%.*G", FORMAT_DIGITS, value);
+    }
+
+    if (value < 0.0) {
+        buffer[length++] = '-';
+        value = -value;
+    }
+
+    // Whole numbers: every digit, no point
+    number = (unsigned long long)value;
+    if ((double)number == value) {
+        do {
+            digits[count++] = (char)('0' + number % 10);
+            number /= 10;
+        } while (number);
+        while (count > 0) {
+            buffer[length++] = digits[--count];
+        }
+        buffer[length] = '\0';
+        return length;
+    }
+
+    // Power of ten of the leading digit
+    exponent = 0;
+    if (value >= 1.0) {
+        while (exponent < FORMAT_DIGITS - 1 && value >= exactPowers[exponent + 1]) {
+            exponent++;
+        }
+    } else {
+        while (value * exactPowers[-exponent] < 1.0) {
+            exponent--;
+        }
+    }
+
+    // The product is rounded, so the digits are settled by the exact
+    // remainder fma leaves: round the true value, ties to even, as
+    // printf does
+    scale = exactPowers[FORMAT_DIGITS - 1 - exponent];
+    number = (unsigned long long)(value * scale);
+    remainder = fma(value, scale, -(double)number);
+    if (remainder < 0.0) {
+        number--;
+        remainder += 1.0;
+    }
+    if (remainder > 0.5 || (remainder == 0.5 && (number & 1))) {
+        number++;
+    }
+    if (number >= (unsigned long long)exactPowers[FORMAT_DIGITS]) {
+        number = (number + 5) / 10;
+        exponent++;
+    }
+
+    // Digits least significant first; trailing zeros are dropped
+    do {
+        digits[count++] = (char)('0' + number % 10);
+        number /= 10;
+    } while (number);
+    while (first < count - 1 && digits[first] == '0') {
+        first++;
+    }
+
+    if (exponent < 0) {
+        buffer[length++] = '0';
+        buffer[length++] = '.';
+        while (++exponent < 0) {
+            buffer[length++] = '0';
+        }
+    } else {
+        // Rounding may leave fewer digits than the whole part needs
+        while (exponent-- >= 0) {
+            buffer[length++] = count > first ? digits[--count] : '0';
+        }
+        if (count > first) {
+            buffer[length++] = '.';
+        }
+    }
+    while (count > first) {
+        buffer[length++] = digits[--count];
+    }
 
-        if (**linePtr == ';') {
-            // No newline
+    buffer[length] = '\0';
+    return length;
+}
+
+void basic_input_string(char *buffer, int maxLength) {
+    if (fgets(buffer, maxLength, stdin)) {
+        // Remove trailing newline
+        char *newline = strchr(buffer, '\n');
+        if (newline) {
+            *newline = '\0';
+        }
+    }
+}
+
+/**
+ * Error handling
+ */
+const char *basic_get_error_message(int errorCode) {
+    switch (errorCode) {
+        case ERR_NONE: return "No error";
+        case ERR_SYNTAX: return "Syntax error";
+        case ERR_OUT_OF_MEMORY: return "Out of memory";
+        case ERR_UNDEFINED_VARIABLE: return "Undefined variable";
+        case ERR_TYPE_MISMATCH: return "Type mismatch";
+        case ERR_DIVISION_BY_ZERO: return "Division by zero";
+        case ERR_ARRAY_BOUNDS: return "Array bounds error";
+        case ERR_STACK_OVERFLOW: return "Stack overflow";
+        case ERR_PROGRAM_TOO_LARGE: return "Program too large";
+        case ERR_LINE_NOT_FOUND: return "Line not found";
+        case ERR_NEXT_WITHOUT_FOR: return "NEXT without FOR";
+        case ERR_BAD_IMAGE: return "Invalid program image";
+        case ERR_OUT_OF_DATA: return "Out of DATA";
+        case ERR_OVERFLOW: return "Overflow";
+        default: return "Unknown error";
+    }
+}
+
+/**
+ * Statement handlers
+ */
+
+/**
+ * Read a jump target operand (GOTO, GOSUB, THEN, ELSE) and return the
+ * target line. The cached pointer is refreshed only if lines were added
+ * or removed since it was resolved.
+ */
+static ProgramLine *readLineRef(BASICState *state, const unsigned char **codePtr) {
+    LineRef ref;
+    unsigned char *payload;
+
+    if (**codePtr != TOK_LINE_REF) {
+        basic_set_error(state, ERR_SYNTAX, "Expected line number");
+        return NULL;
+    }
+
+    // Line storage is writable; only the cursor is const
+    payload = (unsigned char *)(*codePtr + 1);
+    *codePtr += 1 + sizeof(LineRef);
+
+    memcpy(&ref, payload, sizeof(LineRef));
+    if (!ref.target || ref.target->removed) {
+        ref.target = findLine(state, ref.lineNumber);
+        memcpy(payload, &ref, sizeof(LineRef));
+    }
+
+    if (!ref.target) {
+        basic_set_error(state, ERR_LINE_NOT_FOUND, "Line not found");
+    }
+
+    return ref.target;
+}
+
+/**
+ * Handle PRINT statement
+ */
+int basic_handle_print(BASICState *state, const unsigned char **codePtr) {
+    int newline = 1; // Default to newline after PRINT
+
+    while (!isStatementEnd(*codePtr)) {
+        if (**codePtr == TOK_COMMA) {
+            // Tab to next zone
+            basic_output_text(state, "     ", 5);
+            (*codePtr)++;
+            continue;
+        }
+
+        if (**codePtr == TOK_SEMICOLON) {
+            // No newline unless more items follow
             newline = 0;
-            (*linePtr)++;
+            (*codePtr)++;
             continue;
         }
 
+        newline = 1;
+
         // Print expression or string
-        if (**linePtr == '"') {
-            // String literal
-            (*linePtr)++; // Skip opening quote
-            while (**linePtr && **linePtr != '"') {
-                basic_print_char(**linePtr);
-                (*linePtr)++;
-            }
-            if (**linePtr == '"') {
-                (*linePtr)++; // Skip closing quote
-            }
+        if (**codePtr == TOK_STRING) {
+            // String literal, copied as one block
+            int length;
+
+            (*codePtr)++;
+            length = *(*codePtr)++;
+            basic_output_text(state, (const char *)*codePtr, length);
+            *codePtr += length;
         } else {
             // Expression
-            double value = basic_evaluate_expression(state, linePtr);
-            if (state->errorCode != ERR_NONE) {
+            BasicValue value;
+            if (!basic_evaluate_value(state, codePtr, &value)) {
                 return 0;
             }
 
-            printf("%.6f", value);
+            if (value.type == VALUE_STRING) {
+                basic_output_text(state, value.string.text, value.string.length);
+            } else if (value.type == VALUE_INTEGER) {
+                basic_output_number(state, value.integer);
+            } else {
+                basic_output_number(state, value.number);
+            }
         }
     }
 
     if (newline) {
-        basic_print_newline();
+        basic_output_char(state, '\n');
     }
 
     return 1;
@@ -1031,129 +5137,254 @@ int basic_handle_print(BASICState *state, const char **linePtr) {
 /**
  * Handle INPUT statement
  */
-int basic_handle_input(BASICState *state, const char **linePtr) {
+int basic_handle_input(BASICState *state, const unsigned char **codePtr) {
+    const unsigned char *statement = *codePtr - 1;
     char inputBuffer[256];
-    char varName[MAX_VAR_NAME_LENGTH];
-    int i = 0;
+    const char *line;
+    int variable = 0;
 
-    // Parse variable list
-    while (1) {
-        basic_skip_whitespace(linePtr);
-
-        if (!**linePtr || **linePtr == '\n' || **linePtr == ':') {
-            break;
-        }
+    // A resumed INPUT has already shown the prompts up to the waiting
+    // variable and assigned the variables before it
+    int resumeVariable = state->inputReady ? state->inputVariable : -1;
 
-        if (**linePtr == '"') {
+    // Parse variable list
+    while (!isStatementEnd(*codePtr)) {
+        if (**codePtr == TOK_STRING) {
             // Input prompt
-            (*linePtr)++;
-            while (**linePtr && **linePtr != '"') {
-                basic_print_char(**linePtr);
-                (*linePtr)++;
+            int length;
+
+            (*codePtr)++;
+            length = *(*codePtr)++;
+            if (variable > resumeVariable) {
+                basic_output_text(state, (const char *)*codePtr, length);
             }
-            if (**linePtr == '"') {
-                (*linePtr)++;
+            *codePtr += length;
+        } else if (**codePtr == TOK_VARIABLE) {
+            // Variable slot
+            (*codePtr)++;
+            int slot = readSymbol(codePtr);
+
+            if (variable < resumeVariable) {
+                variable++;
+                continue;
+            }
+
+            if (variable == resumeVariable) {
+                line = state->inputBuffer;
+                state->inputReady = 0;
+            } else {
+                // Get input; the prompt must be visible before reading
+                basic_output_text(state, "? ", 2);
+                basic_flush_output(state);
+                state->profile.inputCalls++;
+
+                // Under basic_step the statement is suspended instead;
+                // the jump keeps the run loop from looking past it
+                if (state->stepping) {
+                    state->suspended = 1;
+                    state->waitingForInput = 1;
+                    state->inputVariable = variable;
+                    state->resumeAt.line = state->currentLine;
+                    state->resumeAt.code = statement;
+                    state->running = 0;
+                    basic_jump_to_position(state, state->resumeAt);
+                    return 1;
+                }
+
+                inputBuffer[0] = '\0';
+                basic_input_string(inputBuffer, sizeof(inputBuffer));
+                line = inputBuffer;
             }
-            basic_print_string("? ");
-        } else if (basic_is_alpha(**linePtr)) {
-            // Variable name
-            while (basic_is_alphanumeric(**linePtr)) {
-                if (i < MAX_VAR_NAME_LENGTH - 1) {
-                    varName[i++] = toupper(**linePtr);
+
+            // String variables keep the text; others take its value
+            if (slotType(state, slot) == VALUE_STRING) {
+                StringRef text;
+                text.text = line;
+                text.length = strlen(line);
+                if (!assignString(state, slot, text)) {
+                    return 0;
                 }
-                (*linePtr)++;
+            } else {
+                basic_set_slot_value(state, slot, basic_val(line));
             }
-            varName[i] = '\0';
+            variable++;
+        } else if (**codePtr == TOK_COMMA || **codePtr == TOK_SEMICOLON) {
+            // Skip separator
+            (*codePtr)++;
+        } else {
+            basic_set_error(state, ERR_SYNTAX, "Expected variable name");
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+/**
+ * Assign a string variable slot, defining it on first use. The block is
+ * reused while the value fits and otherwise swapped for one from the
+ * string pool, so repeated assignments never reach malloc.
+ */
+static int assignString(BASICState *state, int slot, StringRef value) {
+    StringValue *target;
 
-            // Get input
-            basic_print_string("? ");
-            basic_input_string(inputBuffer, sizeof(inputBuffer));
+    if (value.length > MAX_STRING_LENGTH) {
+        basic_set_error(state, ERR_OUT_OF_MEMORY, "String too long");
+        return 0;
+    }
 
-            // Convert to number and store
-            double value = basic_val(inputBuffer);
-            basic_set_variable_value(state, varName, value);
+    if (state->variableTypes[slot] != VAR_STRING &&
+        !basic_create_variable(state, state->variables[slot].name, VAR_STRING)) {
+        return 0;
+    }
+    target = &state->stringValues[state->variables[slot].index];
 
-            i = 0; // Reset for next variable
+    if (value.length + 1 > target->capacity) {
+        // Copy before freeing: the value may be a slice of the old block
+        char *block = allocString(state, value.length + 1);
+        if (!block) {
+            return 0;
         }
+        memcpy(block, value.text, value.length);
+        freeString(state, target->text);
+        target->text = block;
+        target->capacity = basic_pool_block_size(block);
+    } else {
+        memmove(target->text, value.text, value.length);
+    }
 
-        // Skip comma
-        if (**linePtr == ',') {
-            (*linePtr)++;
+    target->text[value.length] = '\0';
+    target->length = value.length;
+    return 1;
+}
+
+/**
+ * Read an assignment target: a variable slot and, for an array element,
+ * its evaluated subscripts (count is 0 for a plain variable)
+ */
+static int readTarget(BASICState *state, const unsigned char **codePtr, int *slot, int indices[], int *count) {
+    *count = 0;
+
+    if (**codePtr != TOK_VARIABLE) {
+        basic_set_error(state, ERR_SYNTAX, "Expected variable name");
+        return 0;
+    }
+    (*codePtr)++;
+    *slot = readSymbol(codePtr);
+
+    if (**codePtr != TOK_LPAREN) {
+        return 1;
+    }
+
+    (*codePtr)++;
+    while (1) {
+        if (*count >= MAX_ARRAY_DIMENSIONS) {
+            basic_set_error(state, ERR_SYNTAX, "Too many subscripts");
+            return 0;
         }
+        indices[(*count)++] = basic_evaluate_integer(state, codePtr);
+        if (state->errorCode != ERR_NONE) {
+            return 0;
+        }
+        if (**codePtr != TOK_COMMA) {
+            break;
+        }
+        (*codePtr)++;
+    }
+
+    if (**codePtr != TOK_RPAREN) {
+        basic_set_error(state, ERR_SYNTAX, "Expected closing parenthesis");
+        return 0;
     }
-
+    (*codePtr)++;
     return 1;
 }
 
 /**
  * Handle LET statement
  */
-int basic_handle_let(BASICState *state, const char **linePtr) {
-    char varName[MAX_VAR_NAME_LENGTH];
-    int i = 0;
-
-    basic_skip_whitespace(linePtr);
+int basic_handle_let(BASICState *state, const unsigned char **codePtr) {
+    int slot;
+    int indices[MAX_ARRAY_DIMENSIONS];
+    int count;
 
-    // Parse variable name
-    if (!basic_is_alpha(**linePtr)) {
-        basic_set_error(state, ERR_SYNTAX, "Expected variable name");
+    // Parse variable name and any subscripts
+    if (!readTarget(state, codePtr, &slot, indices, &count)) {
         return 0;
     }
 
-    while (basic_is_alphanumeric(**linePtr)) {
-        if (i < MAX_VAR_NAME_LENGTH - 1) {
-            varName[i++] = toupper(**linePtr);
-        }
-        (*linePtr)++;
-    }
-    varName[i] = '\0';
-
     // Skip equals sign
-    basic_skip_whitespace(linePtr);
-    if (**linePtr != '=') {
+    if (**codePtr != TOK_EQUALS) {
         basic_set_error(state, ERR_SYNTAX, "Expected equals sign");
         return 0;
     }
-    (*linePtr)++;
+    (*codePtr)++;
 
-    // Evaluate expression
-    double value = basic_evaluate_expression(state, linePtr);
-    if (state->errorCode != ERR_NONE) {
+    // Evaluate expression; its type was matched to the target when compiled
+    BasicValue value;
+    if (!basic_evaluate_value(state, codePtr, &value)) {
         return 0;
     }
 
     // Set variable value
-    basic_set_variable_value(state, varName, value);
+    if (value.type == VALUE_STRING) {
+        return assignString(state, slot, value.string);
+    } else if (value.type == VALUE_INTEGER) {
+        return setIntegerSlot(state, slot, value.integer);
+    } else if (count > 0) {
+        double *element = writableElement(state, slot, indices, count);
+        if (!element) {
+            return 0;
+        }
+        *element = value.number;
+    } else {
+        basic_set_slot_value(state, slot, value.number);
+    }
 
-    return 1;
+    return state->errorCode == ERR_NONE;
+}
+
+/**
+ * Execute the statement after THEN or ELSE; a bare number is a GOTO
+ */
+static int executeBranch(BASICState *state, const unsigned char **codePtr) {
+    if (**codePtr == TOK_LINE_REF) {
+        return basic_jump_to_line(state, readLineRef(state, codePtr));
+    }
+
+    return executeStatement(state, codePtr);
 }
 
 /**
  * Handle IF statement
  */
-int basic_handle_if(BASICState *state, const char **linePtr) {
+int basic_handle_if(BASICState *state, const unsigned char **codePtr) {
     // Evaluate condition
-    double condition = basic_evaluate_expression(state, linePtr);
+    double condition = basic_evaluate_expression(state, codePtr);
     if (state->errorCode != ERR_NONE) {
         return 0;
     }
 
     // Skip THEN
-    basic_skip_whitespace(linePtr);
-    if (!**linePtr) {
+    if (**codePtr != TOK_THEN) {
         basic_set_error(state, ERR_SYNTAX, "Expected THEN");
         return 0;
     }
+    (*codePtr)++;
 
-    Token *token = basic_get_token(linePtr);
-    if (token->type != TOK_THEN) {
-        basic_set_error(state, ERR_SYNTAX, "Expected THEN");
-        return 0;
+    // If condition is true (non-zero), execute the THEN branch
+    if (condition != 0.0) {
+        return executeBranch(state, codePtr);
     }
 
-    // If condition is true (non-zero), execute the rest of the line
-    if (condition != 0.0) {
-        return executeStatement(state, linePtr);
+    // Otherwise look for an ELSE branch on the same line
+    while (**codePtr != TOK_EOL && **codePtr != TOK_ELSE) {
+        skipToken(codePtr);
+    }
+
+    if (**codePtr == TOK_ELSE) {
+        (*codePtr)++;
+        return executeBranch(state, codePtr);
     }
 
     return 1;
@@ -1162,110 +5393,244 @@ int basic_handle_if(BASICState *state, const char **linePtr) {
 /**
  * Handle FOR statement
  */
-int basic_handle_for(BASICState *state, const char **linePtr) {
-    char varName[MAX_VAR_NAME_LENGTH];
+int basic_handle_for(BASICState *state, const unsigned char **codePtr) {
+    int slot;
     double initial, final, step;
-    int i = 0;
+    BasicValue start;
 
     // Parse variable name
-    basic_skip_whitespace(linePtr);
-    if (!basic_is_alpha(**linePtr)) {
+    if (**codePtr != TOK_VARIABLE) {
         basic_set_error(state, ERR_SYNTAX, "Expected variable name");
         return 0;
     }
-
-    while (basic_is_alphanumeric(**linePtr)) {
-        if (i < MAX_VAR_NAME_LENGTH - 1) {
-            varName[i++] = toupper(**linePtr);
-        }
-        (*linePtr)++;
-    }
-    varName[i] = '\0';
+    (*codePtr)++;
+    slot = readSymbol(codePtr);
 
     // Skip equals sign
-    basic_skip_whitespace(linePtr);
-    if (**linePtr != '=') {
+    if (**codePtr != TOK_EQUALS) {
         basic_set_error(state, ERR_SYNTAX, "Expected equals sign");
         return 0;
     }
-    (*linePtr)++;
+    (*codePtr)++;
 
-    // Parse initial value
-    initial = basic_evaluate_expression(state, linePtr);
-    if (state->errorCode != ERR_NONE) {
+    // Parse initial value; an integer one means the loop was compiled
+    // for an integer variable
+    if (!basic_evaluate_value(state, codePtr, &start)) {
         return 0;
     }
+    if (start.type == VALUE_INTEGER) {
+        return forInteger(state, codePtr, slot, start.integer);
+    }
+    initial = start.number;
 
     // Skip TO
-    basic_skip_whitespace(linePtr);
-    Token *token = basic_get_token(linePtr);
-    if (token->type != TOK_TO) {
+    if (**codePtr != TOK_TO) {
         basic_set_error(state, ERR_SYNTAX, "Expected TO");
         return 0;
     }
+    (*codePtr)++;
 
     // Parse final value
-    final = basic_evaluate_expression(state, linePtr);
+    final = basic_evaluate_expression(state, codePtr);
     if (state->errorCode != ERR_NONE) {
         return 0;
     }
 
     // Parse optional STEP
     step = 1.0; // Default step
-    basic_skip_whitespace(linePtr);
-    if (basic_is_alpha(**linePtr)) {
-        token = basic_get_token(linePtr);
-        if (token->type == TOK_STEP) {
-            step = basic_evaluate_expression(state, linePtr);
-            if (state->errorCode != ERR_NONE) {
-                return 0;
-            }
+    if (**codePtr == TOK_STEP) {
+        (*codePtr)++;
+        step = basic_evaluate_expression(state, codePtr);
+        if (state->errorCode != ERR_NONE) {
+            return 0;
         }
     }
 
     // Set variable to initial value
-    basic_set_variable_value(state, varName, initial);
+    basic_set_slot_value(state, slot, initial);
+    if (state->errorCode != ERR_NONE) {
+        return 0;
+    }
+
+    // Re-entering a loop discards it and any loops nested inside it
+    int i;
+    for (i = 0; i < state->forStackPtr; i++) {
+        if (state->forStack[i].slot == slot) {
+            state->forStackPtr = i;
+            break;
+        }
+    }
+
+    ProgramPosition body = positionAfter(state->currentLine, *codePtr);
+
+    // A loop whose range is already exhausted runs zero times
+    if (step >= 0 ? initial > final : initial < final) {
+        return skipLoopBody(state, body);
+    }
 
     // Check for stack overflow
-    if (state->forStackPtr >= 32) {
+    if (state->forStackPtr >= MAX_FOR_DEPTH) {
         basic_set_error(state, ERR_STACK_OVERFLOW, "FOR loop stack overflow");
         return 0;
     }
 
     // Push FOR loop info onto stack
-    state->forStack[state->forStackPtr++] = state->currentLineNumber;
+    ForFrame *frame = &state->forStack[state->forStackPtr++];
+    frame->slot = slot;
+    frame->integer = 0;
+    frame->limit = final;
+    frame->step = step;
+    frame->body = body;
 
     return 1;
 }
 
 /**
- * Handle NEXT statement
+ * Rest of a FOR statement over an integer variable: the bounds, the
+ * counter and the test in NEXT all stay in integers
  */
-int basic_handle_next(BASICState *state, const char **linePtr) {
-    char varName[MAX_VAR_NAME_LENGTH];
-    int i = 0;
+static int forInteger(BASICState *state, const unsigned char **codePtr, int slot, int initial) {
+    int final, step = 1;
+    int i;
 
-    basic_skip_whitespace(linePtr);
+    if (**codePtr != TOK_TO) {
+        basic_set_error(state, ERR_SYNTAX, "Expected TO");
+        return 0;
+    }
+    (*codePtr)++;
 
-    // Parse optional variable name
-    if (basic_is_alpha(**linePtr)) {
-        while (basic_is_alphanumeric(**linePtr)) {
-            if (i < MAX_VAR_NAME_LENGTH - 1) {
-                varName[i++] = toupper(**linePtr);
+    final = basic_evaluate_integer(state, codePtr);
+    if (state->errorCode != ERR_NONE) {
+        return 0;
+    }
+
+    if (**codePtr == TOK_STEP) {
+        (*codePtr)++;
+        step = basic_evaluate_integer(state, codePtr);
+        if (state->errorCode != ERR_NONE) {
+            return 0;
+        }
+    }
+
+    if (!setIntegerSlot(state, slot, initial)) {
+        return 0;
+    }
+
+    for (i = 0; i < state->forStackPtr; i++) {
+        if (state->forStack[i].slot == slot) {
+            state->forStackPtr = i;
+            break;
+        }
+    }
+
+    ProgramPosition body = positionAfter(state->currentLine, *codePtr);
+
+    if (step >= 0 ? initial > final : initial < final) {
+        return skipLoopBody(state, body);
+    }
+
+    if (state->forStackPtr >= MAX_FOR_DEPTH) {
+        basic_set_error(state, ERR_STACK_OVERFLOW, "FOR loop stack overflow");
+        return 0;
+    }
+
+    ForFrame *frame = &state->forStack[state->forStackPtr++];
+    frame->slot = slot;
+    frame->integer = 1;
+    frame->integerLimit = final;
+    frame->integerStep = step;
+    frame->body = body;
+
+    return 1;
+}
+
+/**
+ * Continue after the NEXT that matches a FOR whose body must not run
+ */
+static int skipLoopBody(BASICState *state, ProgramPosition body) {
+    ProgramLine *line = body.line;
+    const unsigned char *codePtr = body.code;
+    int depth = 0;
+
+    while (codePtr) {
+        if (*codePtr == TOK_EOL) {
+            line = line ? line->next : NULL;
+            codePtr = line ? line->tokens : NULL;
+            continue;
+        }
+
+        if (*codePtr == TOK_FOR) {
+            depth++;
+        } else if (*codePtr == TOK_NEXT) {
+            if (depth == 0) {
+                skipToken(&codePtr);
+                if (*codePtr == TOK_VARIABLE) {
+                    skipToken(&codePtr);
+                }
+                basic_jump_to_position(state, positionAfter(line, codePtr));
+                return 1;
             }
-            (*linePtr)++;
+            depth--;
+        }
+
+        skipToken(&codePtr);
+    }
+
+    // No matching NEXT: the program simply runs off the end
+    body.line = NULL;
+    body.code = NULL;
+    basic_jump_to_position(state, body);
+    return 1;
+}
+
+/**
+ * Handle NEXT statement
+ */
+int basic_handle_next(BASICState *state, const unsigned char **codePtr) {
+    int index = state->forStackPtr - 1;
+
+    // Parse optional variable name
+    if (**codePtr == TOK_VARIABLE) {
+        (*codePtr)++;
+        int slot = readSymbol(codePtr);
+        while (index >= 0 && state->forStack[index].slot != slot) {
+            index--;
         }
-        varName[i] = '\0';
     }
 
     // Check for stack underflow
-    if (state->forStackPtr <= 0) {
+    if (index < 0) {
         basic_set_error(state, ERR_NEXT_WITHOUT_FOR, "NEXT without FOR");
         return 0;
     }
 
-    // For now, just pop the stack (simplified implementation)
-    state->forStackPtr--;
+    // Naming an outer loop closes the inner ones
+    ForFrame *frame = &state->forStack[index];
+    state->forStackPtr = index + 1;
+
+    // Step, compare and jump back to the body, or fall out of the loop
+    int more;
+    if (frame->integer) {
+        // Stepped in 64 bits so a counter near the integer range ends the
+        // loop instead of wrapping
+        long long value = (long long)state->integerValues[frame->slot] + frame->integerStep;
+        more = frame->integerStep >= 0 ? value <= frame->integerLimit : value >= frame->integerLimit;
+        if (value >= -2147483647LL - 1 && value <= 2147483647LL) {
+            state->integerValues[frame->slot] = (int)value;
+        }
+    } else {
+        double value = (state->numericValues[frame->slot] += frame->step);
+        more = frame->step >= 0 ? value <= frame->limit : value >= frame->limit;
+    }
+
+    if (more) {
+        if (frame->integer && state->loopHook && state->loopHook(state->loopHookContext, state, index)) {
+            return state->errorCode == ERR_NONE;
+        }
+        basic_jump_to_position(state, frame->body);
+    } else {
+        state->forStackPtr = index;
+    }
 
     return 1;
 }
@@ -1273,194 +5638,463 @@ int basic_handle_next(BASICState *state, const char **linePtr) {
 /**
  * Handle GOSUB statement
  */
-int basic_handle_gosub(BASICState *state, const char **linePtr) {
-    int lineNumber;
+int basic_handle_gosub(BASICState *state, const unsigned char **codePtr) {
+    ProgramLine *target;
 
-    // Parse line number
-    lineNumber = basic_parse_int(linePtr);
-    if (state->errorCode != ERR_NONE) {
+    // Resolve target line
+    target = readLineRef(state, codePtr);
+    if (!target) {
         return 0;
     }
 
     // Check for stack overflow
-    if (state->gosubStackPtr >= 32) {
+    if (state->gosubStackPtr >= MAX_GOSUB_DEPTH) {
         basic_set_error(state, ERR_STACK_OVERFLOW, "GOSUB stack overflow");
         return 0;
     }
 
-    // Push current line onto stack
-    state->gosubStack[state->gosubStackPtr++] = state->currentLineNumber;
+    // Push the statement after GOSUB onto stack
+    state->gosubStack[state->gosubStackPtr++] = positionAfter(state->currentLine, *codePtr);
 
     // Jump to target line
-    return basic_handle_goto_line(state, lineNumber);
+    return basic_jump_to_line(state, target);
 }
 
 /**
  * Handle RETURN statement
  */
-int basic_handle_return(BASICState *state, const char **linePtr) {
+int basic_handle_return(BASICState *state, const unsigned char **codePtr) {
     // Check for stack underflow
     if (state->gosubStackPtr <= 0) {
         basic_set_error(state, ERR_SYNTAX, "RETURN without GOSUB");
         return 0;
     }
 
-    // Pop return address from stack
-    int returnLine = state->gosubStack[--state->gosubStackPtr];
-
-    // Jump to return address
-    return basic_handle_goto_line(state, returnLine);
+    // Pop return position from stack and continue there
+    basic_jump_to_position(state, state->gosubStack[--state->gosubStackPtr]);
+    return 1;
 }
 
 /**
  * Handle GOTO statement
  */
-int basic_handle_goto(BASICState *state, const char **linePtr) {
-    int lineNumber;
-
-    // Parse line number
-    lineNumber = basic_parse_int(linePtr);
-    if (state->errorCode != ERR_NONE) {
-        return 0;
-    }
-
+int basic_handle_goto(BASICState *state, const unsigned char **codePtr) {
     // Jump to target line
-    return basic_handle_goto_line(state, lineNumber);
+    return basic_jump_to_line(state, readLineRef(state, codePtr));
 }
 
 /**
  * Handle READ statement
  */
-int basic_handle_read(BASICState *state, const char **linePtr) {
-    char varName[MAX_VAR_NAME_LENGTH];
-    int i = 0;
+int basic_handle_read(BASICState *state, const unsigned char **codePtr) {
+    int slot;
+    int indices[MAX_ARRAY_DIMENSIONS];
+    int count;
 
     // Parse variable list
-    while (1) {
-        basic_skip_whitespace(linePtr);
+    while (!isStatementEnd(*codePtr)) {
+        if (**codePtr == TOK_COMMA) {
+            // Skip comma
+            (*codePtr)++;
+            continue;
+        }
 
-        if (!**linePtr || **linePtr == '\n' || **linePtr == ':') {
-            break;
+        if (!readTarget(state, codePtr, &slot, indices, &count)) {
+            return 0;
         }
 
-        if (basic_is_alpha(**linePtr)) {
-            // Variable name
-            while (basic_is_alphanumeric(**linePtr)) {
-                if (i < MAX_VAR_NAME_LENGTH - 1) {
-                    varName[i++] = toupper(**linePtr);
-                }
-                (*linePtr)++;
+        if (state->dataCursor >= state->dataCount) {
+            basic_set_error(state, ERR_OUT_OF_DATA, "Out of DATA");
+            return 0;
+        }
+        DataItem *item = &state->dataPool[state->dataCursor++];
+
+        // String variables take string items; everything else is numeric
+        if (count == 0 && slotType(state, slot) == VALUE_STRING) {
+            StringRef text;
+
+            if (!item->isString) {
+                basic_set_error(state, ERR_TYPE_MISMATCH, "DATA item is not a string");
+                return 0;
+            }
+            text.text = item->text;
+            text.length = item->length;
+            if (!assignString(state, slot, text)) {
+                return 0;
             }
-            varName[i] = '\0';
+        } else if (item->isString) {
+            basic_set_error(state, ERR_TYPE_MISMATCH, "DATA item is not a number");
+            return 0;
+        } else if (count > 0) {
+            double *element = writableElement(state, slot, indices, count);
+            if (!element) {
+                return 0;
+            }
+            *element = item->number;
+        } else {
+            basic_set_slot_value(state, slot, item->number);
+        }
+
+        if (state->errorCode != ERR_NONE) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+/**
+ * Handle DATA statement
+ */
+int basic_handle_data(BASICState *state, const unsigned char **codePtr) {
+    // Items were collected into the DATA pool at load time
+    while (!isStatementEnd(*codePtr)) {
+        skipToken(codePtr);
+    }
+    return 1;
+}
+
+/**
+ * Handle RESTORE statement: rewind READ to the first DATA item, or to
+ * the first one at or after the given line
+ */
+int basic_handle_restore(BASICState *state, const unsigned char **codePtr) {
+    if (**codePtr == TOK_LINE_REF) {
+        ProgramLine *target = readLineRef(state, codePtr);
+        if (!target) {
+            return 0;
+        }
+        state->dataCursor = target->dataIndex;
+    } else {
+        state->dataCursor = 0;
+    }
+    return 1;
+}
+
+/**
+ * Handle DIM statement
+ */
+int basic_handle_dim(BASICState *state, const unsigned char **codePtr) {
+    const char *varName;
+    int dimensions[MAX_ARRAY_DIMENSIONS];
+    int dimCount = 0;
+
+    // Parse array declarations
+    while (!isStatementEnd(*codePtr)) {
+        if (**codePtr == TOK_COMMA) {
+            // Skip comma
+            (*codePtr)++;
+            continue;
+        }
+
+        // Array name
+        if (**codePtr != TOK_VARIABLE) {
+            basic_set_error(state, ERR_SYNTAX, "Expected array name");
+            return 0;
+        }
+        (*codePtr)++;
+        varName = state->variables[readSymbol(codePtr)].name;
 
-            // Read next DATA value
-            double value = basic_read_data_value(state);
-            if (state->errorCode != ERR_NONE) {
+        // Skip opening parenthesis
+        if (**codePtr != TOK_LPAREN) {
+            basic_set_error(state, ERR_SYNTAX, "Expected opening parenthesis");
+            return 0;
+        }
+        (*codePtr)++;
+
+        // Parse dimensions
+        dimCount = 0;
+        while (**codePtr == TOK_NUMBER) {
+            if (dimCount >= MAX_ARRAY_DIMENSIONS) {
+                basic_set_error(state, ERR_SYNTAX, "Too many dimensions");
                 return 0;
             }
 
-            // Set variable value
-            basic_set_variable_value(state, varName, value);
+            (*codePtr)++;
+            dimensions[dimCount++] = (int)readNumber(codePtr);
+
+            if (**codePtr == TOK_COMMA) {
+                (*codePtr)++;
+            }
+        }
+
+        if (**codePtr != TOK_RPAREN) {
+            basic_set_error(state, ERR_SYNTAX, "Expected closing parenthesis");
+            return 0;
+        }
+        (*codePtr)++;
+
+        // Create array
+        if (!basic_create_array(state, varName, dimensions, dimCount)) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+/**
+ * Whole-array statements
+ *
+ * MAT treats a numeric array as one row-major block of doubles. The
+ * operands' shapes are checked once per statement; after that every
+ * operation is a plain loop over contiguous elements with no subscript
+ * checks, simple enough for the host compiler to vectorize. The target
+ * must already be dimensioned to the shape of the result, as MAT never
+ * redimensions. Elementwise forms may name the target as an operand;
+ * a matrix product into one of its own operands goes through a
+ * temporary block.
+ */
+
+// One MAT operand: an array, or a scalar written in parentheses
+typedef struct {
+    ArrayValue *array;  // NULL for a scalar
+    double scalar;
+} MatOperand;
+
+/**
+ * The array behind a slot, or NULL with the error set
+ */
+static ArrayValue *matArray(BASICState *state, int slot) {
+    if (state->variableTypes[slot] != VAR_ARRAY_NUMERIC) {
+        basic_set_error(state, ERR_UNDEFINED_VARIABLE, "Array not dimensioned");
+        return NULL;
+    }
+    return &state->arrays[state->variables[slot].index];
+}
+
+/**
+ * Check that two arrays have the same dimensions and bounds
+ */
+static int matSameShape(BASICState *state, const ArrayValue *a, const ArrayValue *b) {
+    int i;
+
+    if (a->size != b->size) {
+        basic_set_error(state, ERR_ARRAY_BOUNDS, "Array shapes do not match");
+        return 0;
+    }
+    for (i = 0; i < a->size; i++) {
+        if (a->dimensions[i] != b->dimensions[i]) {
+            basic_set_error(state, ERR_ARRAY_BOUNDS, "Array shapes do not match");
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/**
+ * Read an array name or a parenthesized scalar
+ */
+static int readMatOperand(BASICState *state, const unsigned char **codePtr, MatOperand *operand) {
+    if (**codePtr == TOK_LPAREN) {
+        (*codePtr)++;
+        operand->array = NULL;
+        operand->scalar = basic_evaluate_expression(state, codePtr);
+        if (state->errorCode != ERR_NONE) {
+            return 0;
+        }
+        if (**codePtr != TOK_RPAREN) {
+            basic_set_error(state, ERR_SYNTAX, "Expected closing parenthesis");
+            return 0;
+        }
+        (*codePtr)++;
+        return 1;
+    }
+
+    if (**codePtr != TOK_VARIABLE) {
+        basic_set_error(state, ERR_SYNTAX, "Expected array name");
+        return 0;
+    }
+    (*codePtr)++;
+    operand->array = matArray(state, readSymbol(codePtr));
+    return operand->array != NULL;
+}
+
+/**
+ * Sum every element. Four running sums break the dependency between
+ * additions so the loop can use vector registers; the result may
+ * differ from a left-to-right sum in the last bits.
+ */
+static double arraySum(const ArrayValue *array) {
+    const double *element = array->numericArray;
+    double s0 = 0.0, s1 = 0.0, s2 = 0.0, s3 = 0.0;
+    int count = array->count;
+    int i;
+
+    for (i = 0; i + 4 <= count; i += 4) {
+        s0 += element[i];
+        s1 += element[i + 1];
+        s2 += element[i + 2];
+        s3 += element[i + 3];
+    }
+    for (; i < count; i++) {
+        s0 += element[i];
+    }
+    return (s0 + s1) + (s2 + s3);
+}
+
+/**
+ * Matrix product of two two-dimensional arrays. Rows run over the
+ * first subscript and columns over the second, both from 0.
+ */
+static int matMultiply(BASICState *state, ArrayValue *target, const ArrayValue *left, const ArrayValue *right) {
+    int rows, inner, columns, i, j, k;
+    double *result;
+
+    if (target->size != 2 || left->size != 2 || right->size != 2) {
+        basic_set_error(state, ERR_ARRAY_BOUNDS, "MAT multiply needs two-dimensional arrays");
+        return 0;
+    }
+
+    rows = left->dimensions[0] + 1;
+    inner = left->dimensions[1] + 1;
+    columns = right->dimensions[1] + 1;
+    if (right->dimensions[0] + 1 != inner ||
+        target->dimensions[0] + 1 != rows || target->dimensions[1] + 1 != columns) {
+        basic_set_error(state, ERR_ARRAY_BOUNDS, "Array shapes do not match");
+        return 0;
+    }
+
+    result = target->numericArray;
+    if (target == left || target == right) {
+        result = allocArray(state, target->count, 0);
+        if (!result) {
+            return 0;
+        }
+    }
+
+    // Row by row, so the innermost loop walks both blocks in order
+    for (i = 0; i < rows; i++) {
+        double *row = result + i * columns;
 
-            i = 0; // Reset for next variable
+        for (j = 0; j < columns; j++) {
+            row[j] = 0.0;
         }
+        for (k = 0; k < inner; k++) {
+            const double factor = left->numericArray[i * inner + k];
+            const double *other = right->numericArray + k * columns;
 
-        // Skip comma
-        if (**linePtr == ',') {
-            (*linePtr)++;
+            for (j = 0; j < columns; j++) {
+                row[j] += factor * other[j];
+            }
         }
     }
 
+    if (result != target->numericArray) {
+        memcpy(target->numericArray, result, target->count * sizeof(double));
+        freeArray(state, result, target->count);
+    }
     return 1;
 }
 
 /**
- * Handle DATA statement
- */
-int basic_handle_data(BASICState *state, const char **linePtr) {
-    // For now, just skip the DATA values
-    // In a full implementation, we'd store these for READ statements
-    return 1;
-}
-
-/**
- * Handle DIM statement
+ * Handle MAT statement
+ *
+ *   MAT A = B          copy
+ *   MAT A = (X)        fill every element with X
+ *   MAT A = B + C      elementwise sum (or difference with -)
+ *   MAT A = (X) * B    scale, also written B * (X)
+ *   MAT A = B * C      matrix product
  */
-int basic_handle_dim(BASICState *state, const char **linePtr) {
-    char varName[MAX_VAR_NAME_LENGTH];
-    int dimensions[MAX_ARRAY_DIMENSIONS];
-    int i = 0, dimCount = 0;
+int basic_handle_mat(BASICState *state, const unsigned char **codePtr) {
+    MatOperand left, right;
+    ArrayValue *target;
+    const ArrayValue *source;
+    TokenType op = TOK_EOL;
+    double *result;
+    double factor;
+    int count, i;
+
+    if (**codePtr != TOK_VARIABLE) {
+        basic_set_error(state, ERR_SYNTAX, "Expected array name");
+        return 0;
+    }
+    (*codePtr)++;
+    target = matArray(state, readSymbol(codePtr));
+    if (!target) {
+        return 0;
+    }
 
-    // Parse array declarations
-    while (1) {
-        basic_skip_whitespace(linePtr);
+    if (**codePtr != TOK_EQUALS) {
+        basic_set_error(state, ERR_SYNTAX, "Expected equals sign");
+        return 0;
+    }
+    (*codePtr)++;
 
-        if (!**linePtr || **linePtr == '\n' || **linePtr == ':') {
-            break;
+    if (!readMatOperand(state, codePtr, &left)) {
+        return 0;
+    }
+    if (**codePtr == TOK_PLUS || **codePtr == TOK_MINUS || **codePtr == TOK_MULTIPLY) {
+        op = (TokenType)*(*codePtr)++;
+        if (!readMatOperand(state, codePtr, &right)) {
+            return 0;
         }
+    }
 
-        if (basic_is_alpha(**linePtr)) {
-            // Array name
-            while (basic_is_alphanumeric(**linePtr)) {
-                if (i < MAX_VAR_NAME_LENGTH - 1) {
-                    varName[i++] = toupper(**linePtr);
-                }
-                (*linePtr)++;
-            }
-            varName[i] = '\0';
-
-            // Skip opening parenthesis
-            basic_skip_whitespace(linePtr);
-            if (**linePtr != '(') {
-                basic_set_error(state, ERR_SYNTAX, "Expected opening parenthesis");
-                return 0;
-            }
-            (*linePtr)++;
-
-            // Parse dimensions
-            dimCount = 0;
-            while (**linePtr && **linePtr != ')') {
-                dimensions[dimCount++] = basic_parse_int(linePtr);
-                if (state->errorCode != ERR_NONE) {
-                    return 0;
-                }
-
-                if (dimCount >= MAX_ARRAY_DIMENSIONS) {
-                    basic_set_error(state, ERR_SYNTAX, "Too many dimensions");
-                    return 0;
-                }
-
-                basic_skip_whitespace(linePtr);
-                if (**linePtr == ',') {
-                    (*linePtr)++;
-                }
-            }
+    if (target->shared && !unshareArray(state, target)) {
+        return 0;
+    }
+    result = target->numericArray;
+    count = target->count;
 
-            if (**linePtr == ')') {
-                (*linePtr)++;
+    if (op == TOK_EOL) {
+        if (!left.array) {
+            for (i = 0; i < count; i++) {
+                result[i] = left.scalar;
             }
+            return 1;
+        }
+        if (!matSameShape(state, target, left.array)) {
+            return 0;
+        }
+        memmove(result, left.array->numericArray, count * sizeof(double));
+        return 1;
+    }
 
-            // Create array
-            if (!basic_create_array(state, varName, dimensions, dimCount)) {
-                return 0;
-            }
+    if (op == TOK_MULTIPLY && left.array && right.array) {
+        return matMultiply(state, target, left.array, right.array);
+    }
 
-            i = 0; // Reset for next array
+    if (op == TOK_MULTIPLY) {
+        if (!left.array && !right.array) {
+            basic_set_error(state, ERR_TYPE_MISMATCH, "Expected array operand");
+            return 0;
         }
-
-        // Skip comma
-        if (**linePtr == ',') {
-            (*linePtr)++;
+        source = left.array ? left.array : right.array;
+        factor = left.array ? right.scalar : left.scalar;
+        if (!matSameShape(state, target, source)) {
+            return 0;
         }
+        for (i = 0; i < count; i++) {
+            result[i] = source->numericArray[i] * factor;
+        }
+        return 1;
     }
 
+    // Sum or difference of two arrays of the target's shape
+    if (!left.array || !right.array) {
+        basic_set_error(state, ERR_TYPE_MISMATCH, "Expected array operand");
+        return 0;
+    }
+    if (!matSameShape(state, target, left.array) || !matSameShape(state, target, right.array)) {
+        return 0;
+    }
+    if (op == TOK_PLUS) {
+        for (i = 0; i < count; i++) {
+            result[i] = left.array->numericArray[i] + right.array->numericArray[i];
+        }
+    } else {
+        for (i = 0; i < count; i++) {
+            result[i] = left.array->numericArray[i] - right.array->numericArray[i];
+        }
+    }
     return 1;
 }
 
 /**
  * Handle END statement
  */
-int basic_handle_end(BASICState *state, const char **linePtr) {
+int basic_handle_end(BASICState *state, const unsigned char **codePtr) {
     state->running = 0;
     return 1;
 }
@@ -1468,7 +6102,7 @@ int basic_handle_end(BASICState *state, const char **linePtr) {
 /**
  * Handle STOP statement
  */
-int basic_handle_stop(BASICState *state, const char **linePtr) {
+int basic_handle_stop(BASICState *state, const unsigned char **codePtr) {
     state->running = 0;
     return 1;
 }
@@ -1476,8 +6110,8 @@ int basic_handle_stop(BASICState *state, const char **linePtr) {
 /**
  * Handle REM statement
  */
-int basic_handle_rem(BASICState *state, const char **linePtr) {
-    // Just skip the rest of the line
+int basic_handle_rem(BASICState *state, const unsigned char **codePtr) {
+    // The tokenizer already dropped the rest of the line
     return 1;
 }
 
@@ -1492,45 +6126,106 @@ int basic_handle_goto_line(BASICState *state, int lineNumber) {
         return 0;
     }
 
-    // In a full implementation, we'd need to modify the execution flow
-    // For now, just return success
+    return basic_jump_to_line(state, targetLine);
+}
+
+/**
+ * Jump to an already resolved line
+ */
+int basic_jump_to_line(BASICState *state, ProgramLine *targetLine) {
+    if (!targetLine) {
+        if (state->errorCode == ERR_NONE) {
+            basic_set_error(state, ERR_LINE_NOT_FOUND, "Line not found");
+        }
+        return 0;
+    }
+
+    ProgramPosition position;
+    position.line = targetLine;
+    position.code = targetLine->tokens;
+    basic_jump_to_position(state, position);
     return 1;
 }
 
+/**
+ * Redirect the run loop; takes effect when the current statement returns
+ */
+void basic_jump_to_position(BASICState *state, ProgramPosition position) {
+    state->jumpTarget = position;
+    state->jumpPending = 1;
+}
+
 /**
  * Read next DATA value
  */
 double basic_read_data_value(BASICState *state) {
-    // Simplified implementation - return 0 for now
-    // In a full implementation, we'd parse DATA statements
-    return 0.0;
+    DataItem *item;
+
+    if (state->dataCursor >= state->dataCount) {
+        basic_set_error(state, ERR_OUT_OF_DATA, "Out of DATA");
+        return 0.0;
+    }
+
+    item = &state->dataPool[state->dataCursor++];
+    if (item->isString) {
+        basic_set_error(state, ERR_TYPE_MISMATCH, "DATA item is not a number");
+        return 0.0;
+    }
+    return item->number;
 }
 
 /**
  * Create an array
  */
 int basic_create_array(BASICState *state, const char *name, int dimensions[], int dimCount) {
-    if (state->variableCount >= MAX_VARIABLES) {
-        basic_set_error(state, ERR_OUT_OF_MEMORY, "Too many variables");
+    int slot = basic_intern_symbol(state, name);
+    if (slot < 0) {
         return 0;
     }
 
-    Variable *var = &state->variables[state->variableCount++];
-    strncpy(var->name, name, MAX_VAR_NAME_LENGTH - 1);
-    var->name[MAX_VAR_NAME_LENGTH - 1] = '\0';
-    var->type = VAR_ARRAY_NUMERIC;
+    Variable *var = &state->variables[slot];
+    ArrayValue *array;
 
-    // Copy dimensions
-    int i;
-    for (i = 0; i < dimCount && i < MAX_ARRAY_DIMENSIONS; i++) {
-        var->dimensions[i] = dimensions[i];
+    // Redimensioning reuses the side table entry
+    if (state->variableTypes[slot] == VAR_ARRAY_NUMERIC) {
+        array = &state->arrays[var->index];
+        if (array->shared) {
+            releaseMemory(state, MEM_ARRAYS, (long)array->count * (long)sizeof(double));
+        } else {
+            freeArray(state, array->numericArray, array->count);
+        }
+    } else {
+        if (state->arrayCount >= MAX_ARRAYS) {
+            basic_set_error(state, ERR_OUT_OF_MEMORY, "Too many arrays");
+            return 0;
+        }
+        var->index = state->arrayCount++;
+        array = &state->arrays[var->index];
+    }
+    state->variableTypes[slot] = VAR_ARRAY_NUMERIC;
+    array->shared = 0;
+
+    // Row-major strides and the exact element count
+    int i, count = 1;
+    for (i = dimCount - 1; i >= 0; i--) {
+        if (dimensions[i] < 0 || count * (dimensions[i] + 1) > MAX_ARRAY_SIZE) {
+            array->numericArray = NULL;
+            array->size = 0;
+            array->count = 0;
+            basic_set_error(state, ERR_ARRAY_BOUNDS, "Invalid array size");
+            return 0;
+        }
+        array->dimensions[i] = dimensions[i];
+        array->strides[i] = count;
+        count *= dimensions[i] + 1;
     }
-    var->size = dimCount;
+    array->size = dimCount;
+    array->count = count;
 
-    // Allocate array memory (simplified)
-    var->value.numericArray = (double *)basic_calloc(1000, sizeof(double));
-    if (!var->value.numericArray) {
-        basic_set_error(state, ERR_OUT_OF_MEMORY, "Cannot allocate array memory");
+    array->numericArray = allocArray(state, count, 1);
+    if (!array->numericArray) {
+        array->size = 0;
+        array->count = 0;
         return 0;
     }
 
@@ -1538,56 +6233,177 @@ int basic_create_array(BASICState *state, const char *name, int dimensions[], in
 }
 
 /**
- * Evaluate function calls
+ * Locate an array element, checking each subscript against its bound.
+ * Returns NULL with the error set if the slot is not an array or a
+ * subscript is out of range.
  */
-double basic_evaluate_function(BASICState *state, const char *functionName, const char **linePtr) {
-    // Skip opening parenthesis
-    basic_skip_whitespace(linePtr);
-    if (**linePtr != '(') {
-        basic_set_error(state, ERR_SYNTAX, "Expected opening parenthesis");
-        return 0.0;
+double *basic_array_element(BASICState *state, int slot, const int indices[], int count) {
+    ArrayValue *array;
+    int offset = 0;
+    int i;
+
+    if (state->variableTypes[slot] != VAR_ARRAY_NUMERIC) {
+        basic_set_error(state, ERR_UNDEFINED_VARIABLE, "Array not dimensioned");
+        return NULL;
     }
-    (*linePtr)++;
 
-    // Evaluate argument
-    double argument = basic_evaluate_expression(state, linePtr);
-    if (state->errorCode != ERR_NONE) {
-        return 0.0;
+    array = &state->arrays[state->variables[slot].index];
+    if (count != array->size) {
+        basic_set_error(state, ERR_ARRAY_BOUNDS, "Wrong number of subscripts");
+        return NULL;
     }
 
-    // Skip closing parenthesis
-    basic_skip_whitespace(linePtr);
-    if (**linePtr != ')') {
-        basic_set_error(state, ERR_SYNTAX, "Expected closing parenthesis");
+    // A negative subscript wraps to a large unsigned value, so one
+    // comparison per dimension covers both ends of the range
+    for (i = 0; i < count; i++) {
+        if ((unsigned int)indices[i] > (unsigned int)array->dimensions[i]) {
+            basic_set_error(state, ERR_ARRAY_BOUNDS, "Subscript out of range");
+            return NULL;
+        }
+        offset += indices[i] * array->strides[i];
+    }
+
+    return array->numericArray + offset;
+}
+
+/**
+ * Get an array element by name
+ */
+double basic_get_array_element(BASICState *state, const char *name, int indices[]) {
+    int slot = lookupSlot(state, name);
+    double *element;
+
+    if (slot < 0 || state->variableTypes[slot] != VAR_ARRAY_NUMERIC) {
+        basic_set_error(state, ERR_UNDEFINED_VARIABLE, "Array not dimensioned");
         return 0.0;
     }
-    (*linePtr)++;
-
-    // Call appropriate function
-    if (strcmp(functionName, "ABS") == 0) {
-        return basic_abs(argument);
-    } else if (strcmp(functionName, "RND") == 0) {
-        return basic_rnd(argument);
-    } else if (strcmp(functionName, "SQR") == 0) {
-        return basic_sqr(argument);
-    } else if (strcmp(functionName, "SIN") == 0) {
-        return basic_sin(argument);
-    } else if (strcmp(functionName, "COS") == 0) {
-        return basic_cos(argument);
-    } else if (strcmp(functionName, "TAN") == 0) {
-        return basic_tan(argument);
-    } else if (strcmp(functionName, "LOG") == 0) {
-        return basic_log(argument);
-    } else if (strcmp(functionName, "EXP") == 0) {
-        return basic_exp(argument);
-    } else if (strcmp(functionName, "INT") == 0) {
-        return basic_int(argument);
-    } else if (strcmp(functionName, "SGN") == 0) {
-        return basic_sgn(argument);
-    } else {
+
+    element = basic_array_element(state, slot, indices, state->arrays[state->variables[slot].index].size);
+    return element ? *element : 0.0;
+}
+
+/**
+ * Set an array element by name
+ */
+void basic_set_array_element(BASICState *state, const char *name, int indices[], double value) {
+    int slot = lookupSlot(state, name);
+    double *element;
+
+    if (slot < 0 || state->variableTypes[slot] != VAR_ARRAY_NUMERIC) {
+        basic_set_error(state, ERR_UNDEFINED_VARIABLE, "Array not dimensioned");
+        return;
+    }
+
+    element = writableElement(state, slot, indices, state->arrays[state->variables[slot].index].size);
+    if (element) {
+        *element = value;
+    }
+}
+
+/**
+ * Call a numeric function of one number by name
+ */
+double basic_evaluate_function(BASICState *state, const char *functionName, double argument) {
+    int id = basic_lookup_function(functionName);
+    NumericSlot slot;
+
+    if (id < 0 || builtinFunctions[id].resultType != VALUE_NUMBER ||
+        strcmp(builtinFunctions[id].signature, "N") != 0) {
         basic_set_error(state, ERR_SYNTAX, "Unknown function");
         return 0.0;
     }
+
+    if (builtinFunctions[id].math) {
+        return builtinFunctions[id].math(argument);
+    }
+    slot.number = argument;
+    builtinFunctions[id].handler(state, &slot, NULL, 1);
+    return slot.number;
+}
+
+/**
+ * Clamp a character count to a string's length
+ */
+static int clampLength(double count, int length) {
+    if (count < 0.0) {
+        return 0;
+    }
+    return count < length ? (int)count : length;
+}
+
+/**
+ * Function table handlers. Slicing functions return a view of their
+ * argument; the others build their result on the temporary stack.
+ */
+static int callRnd(BASICState *state, NumericSlot *numbers, StringRef *strings, int argumentCount) {
+    numbers[0].number = basic_rnd(state, numbers[0].number);
+    return 1;
+}
+
+static int callLen(BASICState *state, NumericSlot *numbers, StringRef *strings, int argumentCount) {
+    numbers[0].number = strings[0].length;
+    return 1;
+}
+
+static int callVal(BASICState *state, NumericSlot *numbers, StringRef *strings, int argumentCount) {
+    char text[MAX_LINE_LENGTH];
+    int length = strings[0].length < MAX_LINE_LENGTH - 1 ? strings[0].length : MAX_LINE_LENGTH - 1;
+
+    memcpy(text, strings[0].text, length);
+    text[length] = '\0';
+    numbers[0].number = basic_val(text);
+    return 1;
+}
+
+static int callAsc(BASICState *state, NumericSlot *numbers, StringRef *strings, int argumentCount) {
+    numbers[0].number = strings[0].length ? (unsigned char)strings[0].text[0] : 0;
+    return 1;
+}
+
+static int callLeft(BASICState *state, NumericSlot *numbers, StringRef *strings, int argumentCount) {
+    strings[0].length = clampLength(numbers[0].number, strings[0].length);
+    return 1;
+}
+
+static int callRight(BASICState *state, NumericSlot *numbers, StringRef *strings, int argumentCount) {
+    int length = clampLength(numbers[0].number, strings[0].length);
+
+    strings[0].text += strings[0].length - length;
+    strings[0].length = length;
+    return 1;
+}
+
+static int callMid(BASICState *state, NumericSlot *numbers, StringRef *strings, int argumentCount) {
+    // Start is 1-based; without a length the rest of the string is taken
+    int start = clampLength(numbers[0].number - 1.0, strings[0].length);
+    int rest = strings[0].length - start;
+
+    strings[0].text += start;
+    strings[0].length = argumentCount > 2 ? clampLength(numbers[1].number, rest) : rest;
+    return 1;
+}
+
+static int callStr(BASICState *state, NumericSlot *numbers, StringRef *strings, int argumentCount) {
+    char *text = allocScratch(state, 64);
+
+    if (!text) {
+        return 0;
+    }
+    strings[0].text = text;
+    strings[0].length = basic_format_number(numbers[0].number, text);
+    return 1;
+}
+
+static int callChr(BASICState *state, NumericSlot *numbers, StringRef *strings, int argumentCount) {
+    char *text = allocScratch(state, 1);
+
+    if (!text) {
+        return 0;
+    }
+    text[0] = (char)(int)numbers[0].number;
+    strings[0].text = text;
+    strings[0].length = 1;
+    return 1;
 }
 
 /**
@@ -1597,8 +6413,14 @@ double basic_abs(double x) {
     return fabs(x);
 }
 
-double basic_rnd(double x) {
-    return (double)rand() / (double)RAND_MAX * x;
+double basic_rnd(BASICState *state, double x) {
+    // Per-state xorshift generator, so interpreters never share a sequence
+    unsigned int r = state->randomState;
+    r ^= r << 13;
+    r ^= r >> 17;
+    r ^= r << 5;
+    state->randomState = r;
+    return (double)r / 4294967296.0 * x;
 }
 
 double basic_sqr(double x) {
@@ -1638,44 +6460,41 @@ double basic_sgn(double x) {
 /**
  * String functions
  */
-char *basic_left(const char *str, int length) {
-    static char result[256];
+char *basic_left(const char *str, int length, char *result) {
     strncpy(result, str, length);
     result[length] = '\0';
     return result;
 }
 
-char *basic_right(const char *str, int length) {
-    static char result[256];
+char *basic_right(const char *str, int length, char *result) {
     int start = strlen(str) - length;
     if (start < 0) start = 0;
     strcpy(result, str + start);
     return result;
 }
 
-char *basic_mid(const char *str, int start, int length) {
-    static char result[256];
+char *basic_mid(const char *str, int start, int length, char *result) {
     strncpy(result, str + start - 1, length);
     result[length] = '\0';
     return result;
 }
 
-char *basic_str(double value) {
-    static char result[32];
-    sprintf(result, "%.6f", value);
+char *basic_str(double value, char *result) {
+    basic_format_number(value, result);
     return result;
 }
 
 double basic_val(const char *str) {
-    return atof(str);
+    // Leading blanks are skipped; anything after the number is ignored
+    basic_skip_whitespace(&str);
+    return basic_parse_float(&str);
 }
 
 int basic_len(const char *str) {
     return strlen(str);
 }
 
-char *basic_chr(int asciiCode) {
-    static char result[2];
+char *basic_chr(int asciiCode, char *result) {
     result[0] = (char)asciiCode;
     result[1] = '\0';
     return result;
@@ -1685,23 +6504,230 @@ int basic_asc(const char *str) {
     return (int)str[0];
 }
 
+/**
+ * Profiling
+ */
+static unsigned long readProfileClock(BASICState *state) {
+    if (state->profile.clock) {
+        return state->profile.clock(state->profile.clockContext);
+    }
+    return (unsigned long)clock();
+}
+
+/**
+ * Charge the time since the previous statement ended to the one that
+ * just ran on line, and hand it to the statement hook
+ */
+static void instrumentStatement(BASICState *state, ProgramLine *line, const unsigned char *statement,
+                                unsigned long *lastTick) {
+    unsigned long now = readProfileClock(state);
+
+    if (state->profile.enabled) {
+        if (line) {
+            line->hits++;
+            line->ticks += now - *lastTick;
+        }
+        state->profile.statements++;
+        state->profile.ticks += now - *lastTick;
+    }
+    if (state->statementHook) {
+        state->statementHook(state->statementHookContext, state, line ? line->lineNumber : 0,
+                             statement, now - *lastTick);
+    }
+    *lastTick = now;
+}
+
+/**
+ * Install the hook that integer FOR loops offer their iterations to
+ */
+void basic_set_loop_hook(BASICState *state, BasicLoopHook hook, void *context) {
+    state->loopHook = hook;
+    state->loopHookContext = context;
+}
+
+/**
+ * Install the hook called after every statement. Like profiling, it
+ * takes effect from the next run.
+ */
+void basic_set_statement_hook(BASICState *state, BasicStatementHook hook, void *context) {
+    state->statementHook = hook;
+    state->statementHookContext = context;
+}
+
+/**
+ * Turn profiling on or off; turning it on clears the counters
+ */
+void basic_set_profiling(BASICState *state, int enabled) {
+    if (enabled && !state->profile.enabled) {
+        basic_reset_profile(state);
+    }
+    state->profile.enabled = enabled;
+}
+
+/**
+ * Use another time source, such as the emulator's cycle counter
+ */
+void basic_set_profile_clock(BASICState *state, BasicProfileClock clock, void *context) {
+    state->profile.clock = clock;
+    state->profile.clockContext = context;
+}
+
+void basic_reset_profile(BASICState *state) {
+    int i;
+
+    state->profile.statements = 0;
+    state->profile.ticks = 0;
+    state->profile.variableLookups = 0;
+    state->profile.allocations = 0;
+    state->profile.outputCalls = 0;
+    state->profile.inputCalls = 0;
+
+    for (i = 0; i < state->lineCount; i++) {
+        state->lineIndex[i]->hits = 0;
+        state->lineIndex[i]->ticks = 0;
+    }
+}
+
+/**
+ * Order lines by time spent, then by hits, then by line number
+ */
+static int compareHotLines(const void *a, const void *b) {
+    const ProgramLine *left = *(ProgramLine *const *)a;
+    const ProgramLine *right = *(ProgramLine *const *)b;
+
+    if (left->ticks != right->ticks) {
+        return left->ticks < right->ticks ? 1 : -1;
+    }
+    if (left->hits != right->hits) {
+        return left->hits < right->hits ? 1 : -1;
+    }
+    return left->lineNumber - right->lineNumber;
+}
+
+/**
+ * Print the hottest lines of the last profiled run, at most maxLines
+ */
+void basic_dump_profile(BASICState *state, int maxLines) {
+    ProgramLine *lines[MAX_LINES];
+    BasicProfile *profile = &state->profile;
+    int count = 0, i;
+
+    for (i = 0; i < state->lineCount; i++) {
+        if (state->lineIndex[i]->hits) {
+            lines[count++] = state->lineIndex[i];
+        }
+    }
+    qsort(lines, count, sizeof(ProgramLine *), compareHotLines);
+
+    printf("BASIC Profile:\n");
+    printf("  Statements: %lu\n", profile->statements);
+    printf("  Ticks: %lu\n", profile->ticks);
+    printf("  Variable Lookups: %lu\n", profile->variableLookups);
+    printf("  Allocations: %lu\n", profile->allocations);
+    printf("  Output Calls: %lu\n", profile->outputCalls);
+    printf("  Input Calls: %lu\n", profile->inputCalls);
+    printf("  Hot Lines:\n");
+    printf("    %6s %12s %12s %6s\n", "Line", "Hits", "Ticks", "Time");
+
+    for (i = 0; i < count && i < maxLines; i++) {
+        double share = profile->ticks ? 100.0 * lines[i]->ticks / profile->ticks : 0.0;
+        printf("    %6d %12lu %12lu %5.1f%%\n",
+               lines[i]->lineNumber, lines[i]->hits, lines[i]->ticks, share);
+    }
+}
+
+/**
+ * Write the last profiled run as JSON. Returns the length written, or
+ * 0 with ERR_OUT_OF_MEMORY when it does not fit.
+ */
+int basic_export_profile(BASICState *state, char *buffer, int capacity) {
+    BasicProfile *profile = &state->profile;
+    int length, i, first = 1;
+
+    length = snprintf(buffer, capacity,
+                      "{\"statements\":%lu,\"ticks\":%lu,\"variableLookups\":%lu,"
+                      "\"allocations\":%lu,\"outputCalls\":%lu,\"inputCalls\":%lu,\"lines\":[",
+                      profile->statements, profile->ticks, profile->variableLookups,
+                      profile->allocations, profile->outputCalls, profile->inputCalls);
+
+    for (i = 0; i < state->lineCount && length < capacity; i++) {
+        ProgramLine *line = state->lineIndex[i];
+        if (!line->hits) {
+            continue;
+        }
+        length += snprintf(buffer + length, capacity - length,
+                           "%s{\"line\":%d,\"hits\":%lu,\"ticks\":%lu}",
+                           first ? "" : ",", line->lineNumber, line->hits, line->ticks);
+        first = 0;
+    }
+
+    if (length < capacity) {
+        length += snprintf(buffer + length, capacity - length, "]}");
+    }
+
+    if (length >= capacity) {
+        basic_set_error(state, ERR_OUT_OF_MEMORY, "Profile buffer too small");
+        return 0;
+    }
+    return length;
+}
+
 /**
  * Debug functions
  */
+void basic_dump_memory(BASICState *state) {
+    const BasicMemory *memory = basic_get_memory(state);
+    int i;
+
+    printf("BASIC Memory:\n");
+    printf("  Program Arena: %d bytes used, %d reserved, %d peak\n",
+           state->programArena.bytesUsed, state->programArena.bytesReserved,
+           state->programArena.highWater);
+    printf("  String Pool: %d blocks, %d bytes in use, %d peak\n",
+           state->stringPool.blocksInUse, state->stringPool.bytesInUse,
+           state->stringPool.highWater);
+
+    printf("  %-10s %10s %10s %10s\n", "Category", "In use", "Peak", "Quota");
+    for (i = 0; i < MEM_CATEGORIES; i++) {
+        printf("  %-10s %10ld %10ld ", memoryCategoryNames[i], memory->used[i], memory->peak[i]);
+        if (memory->quota[i]) {
+            printf("%10ld\n", memory->quota[i]);
+        } else {
+            printf("%10s\n", "-");
+        }
+    }
+    printf("  %-10s %10ld %10ld ", "total", memory->total, memory->totalPeak);
+    if (memory->totalQuota) {
+        printf("%10ld\n", memory->totalQuota);
+    } else {
+        printf("%10s\n", "-");
+    }
+    if (memory->refused) {
+        printf("  Refused by quota: %lu\n", memory->refused);
+    }
+}
+
 void basic_dump_variables(BASICState *state) {
     int i;
 
     printf("BASIC Variables:\n");
     for (i = 0; i < state->variableCount; i++) {
         Variable *var = &state->variables[i];
+        VariableType type = (VariableType)state->variableTypes[i];
+        if (type == VAR_UNDEFINED) {
+            continue;
+        }
         printf("  %s = ", var->name);
 
-        if (var->type == VAR_NUMERIC) {
-            printf("%.6f", var->value.numericValue);
-        } else if (var->type == VAR_STRING) {
-            printf("\"%s\"", var->value.stringValue ? var->value.stringValue : "");
+        if (type == VAR_NUMERIC) {
+            printf("%.6f", state->numericValues[i]);
+        } else if (type == VAR_INTEGER) {
+            printf("%d", state->integerValues[i]);
+        } else if (type == VAR_STRING) {
+            const char *value = state->stringValues[var->index].text;
+            printf("\"%s\"", value ? value : "");
         } else {
-            printf("[Array]");
+            printf("[Array of %d]", state->arrays[var->index].count);
         }
 
         printf("\n");
@@ -1709,12 +6735,12 @@ void basic_dump_variables(BASICState *state) {
 }
 
 void basic_dump_program(BASICState *state) {
-    ProgramLine *current = state->programLines;
+    int i;
 
     printf("BASIC Program:\n");
-    while (current) {
-        printf("%d %s\n", current->lineNumber, current->lineText);
-        current = current->next;
+    for (i = 0; i < state->lineCount; i++) {
+        ProgramLine *current = state->lineIndex[i];
+        printf("%d %.*s\n", current->lineNumber, current->textLength, current->lineText);
     }
 }
 
@@ -1727,4 +6753,9 @@ void basic_dump_state(BASICState *state) {
     printf("  Program Size: %d bytes\n", state->programSize);
     printf("  FOR Stack: %d\n", state->forStackPtr);
     printf("  GOSUB Stack: %d\n", state->gosubStackPtr);
+    basic_dump_memory(state);
+
+    if (state->profile.statements) {
+        basic_dump_profile(state, 10);
+    }
 }
\ No newline at end of file
@@ -4,9 +4,15 @@
  *
  * This header file defines the interface for the BASIC interpreter
  * that will be compiled using the Phase 3 C compiler.
+ *
+ * All interpreter state lives in a caller-owned BASICState; there are
+ * no globals, so separate states can run concurrently.
  */
 
-// Maximum program size in bytes
+#ifndef BASIC_INTERPRETER_H
+#define BASIC_INTERPRETER_H
+
+// Maximum program source size in bytes
 #define MAX_PROGRAM_SIZE 16384
 
 // Maximum number of variables
@@ -15,16 +21,60 @@
 // Maximum number of program lines
 #define MAX_LINES 1000
 
+// Highest line number, for program lines and jump targets alike
+#define MAX_LINE_NUMBER 65535
+
 // Maximum line length
 #define MAX_LINE_LENGTH 256
 
+// Maximum size of one tokenized line
+#define MAX_TOKENIZED_LENGTH 1024
+
 // Variable name length
 #define MAX_VAR_NAME_LENGTH 32
 
+// Symbol hash table size (power of two, at least twice MAX_VARIABLES)
+#define SYMBOL_HASH_SIZE 512
+
+// Control flow stack depths
+#define MAX_FOR_DEPTH 32
+#define MAX_GOSUB_DEPTH 32
+
+// Side table sizes for string variables and arrays
+#define MAX_STRING_VARIABLES 64
+#define MAX_ARRAYS 32
+
+// Longest string value
+#define MAX_STRING_LENGTH 255
+
 // Array dimensions
 #define MAX_ARRAY_DIMENSIONS 3
 #define MAX_ARRAY_SIZE 1000
 
+// Significant digits PRINT and STR$ show; 15 keeps every literal of up
+// to 15 digits unchanged and hides the last-bit noise of arithmetic
+#define FORMAT_DIGITS 15
+
+// Console output buffer size
+#ifndef OUTPUT_BUFFER_SIZE
+#define OUTPUT_BUFFER_SIZE 256
+#endif
+
+// Statement dispatch: 1 jumps between statement handlers through a
+// computed-goto table (GCC and Clang only), 0 uses the portable switch
+#ifndef BASIC_THREADED_DISPATCH
+#if defined(__GNUC__)
+#define BASIC_THREADED_DISPATCH 1
+#else
+#define BASIC_THREADED_DISPATCH 0
+#endif
+#endif
+
+// Arena chunk size and string pool size classes (16, 32, ... 256 bytes)
+#define ARENA_CHUNK_SIZE 4096
+#define STRING_POOL_CLASSES 5
+#define STRING_POOL_MIN_SIZE 16
+
 // Error codes
 #define ERR_NONE 0
 #define ERR_SYNTAX 1
@@ -37,6 +87,9 @@
 #define ERR_PROGRAM_TOO_LARGE 8
 #define ERR_LINE_NOT_FOUND 9
 #define ERR_NEXT_WITHOUT_FOR 10
+#define ERR_BAD_IMAGE 11
+#define ERR_OUT_OF_DATA 12
+#define ERR_OVERFLOW 13
 
 // Token types for lexical analysis
 typedef enum {
@@ -59,6 +112,7 @@ typedef enum {
     TOK_GOTO,          // GOTO keyword
     TOK_READ,          // READ keyword
     TOK_DATA,          // DATA keyword
+    TOK_RESTORE,       // RESTORE keyword
     TOK_DIM,           // DIM keyword
     TOK_END,           // END keyword
     TOK_STOP,          // STOP keyword
@@ -81,114 +135,584 @@ typedef enum {
     TOK_AND,           // AND operator
     TOK_OR,            // OR operator
     TOK_NOT,           // NOT operator
-    TOK_FUNCTION       // Function call
+    TOK_FUNCTION,      // Function call
+    TOK_LINE_REF,      // Jump target line number (after GOTO, GOSUB, THEN, ELSE)
+    TOK_EXPR,          // Compiled expression block
+    TOK_MAT            // MAT keyword (whole-array statement)
 } TokenType;
 
+// Expression opcodes. Expressions are compiled once, when the line is
+// tokenized, into postfix code run by basic_evaluate_expression. Types
+// are known when compiling, so numbers and strings use separate stacks.
+// Integer values share the numeric stack; the I-prefixed opcodes work on
+// them without touching floating point.
+typedef enum {
+    OP_END,            // End of numeric expression, result on top of stack
+    OP_END_INTEGER,    // End of integer expression, result on top of stack
+    OP_END_STRING,     // End of string expression, result on top of string stack
+    OP_CONST,          // Push constant (8-byte double payload)
+    OP_ICONST,         // Push integer constant (4-byte int payload)
+    OP_VAR,            // Push variable (2-byte slot payload)
+    OP_IVAR,           // Push integer variable (2-byte slot payload)
+    OP_INDEX,          // Pop integer subscripts, push array element (2-byte slot, 1-byte count)
+    OP_ITOF,           // Convert the integer on top to a number
+    OP_ITOF2,          // Convert the integer below the top to a number
+    OP_FTOI,           // Convert the number on top to an integer, dropping the fraction
+    OP_IADD,           // Integer operators trap on overflow
+    OP_ISUB,
+    OP_IMUL,
+    OP_INEG,
+    OP_ICMP,           // Compare integers, push 1 or 0 (1-byte relational ExprOp)
+    OP_STRING,         // Push string literal (1-byte length, then the body)
+    OP_STRVAR,         // Push string variable (2-byte slot payload)
+    OP_CALL,           // Call built-in (1-byte FunctionId, numeric and string argument counts)
+    OP_CONCAT,         // Pop two strings, push their concatenation
+    OP_STRCMP,         // Pop two strings, push a comparison (1-byte relational ExprOp)
+    OP_NEG,            // Unary minus
+    OP_NOT,            // Logical NOT
+    OP_ADD,            // Binary operators pop two values and push one
+    OP_SUB,
+    OP_MUL,
+    OP_DIV,
+    OP_EQ,
+    OP_NE,
+    OP_LT,
+    OP_LE,
+    OP_GT,
+    OP_GE,
+    OP_AND,
+    OP_OR,
+    OP_ARRAY_SUM       // Push the sum of a numeric array's elements (2-byte slot)
+} ExprOp;
+
+// Evaluation stack depth; deeper expressions are rejected when compiled
+#define EXPR_STACK_SIZE 32
+
+// Temporary string stack for string expression results, reset before
+// every statement
+#define STRING_SCRATCH_SIZE 1024
+
+// Built-in functions, resolved to an ID when a line is tokenized. Arity
+// and argument types live in the function table in basic-interpreter.c.
+typedef enum {
+    FN_ABS,
+    FN_RND,
+    FN_SQR,
+    FN_SIN,
+    FN_COS,
+    FN_TAN,
+    FN_LOG,
+    FN_EXP,
+    FN_INT,
+    FN_SGN,
+    FN_LEN,
+    FN_VAL,
+    FN_ASC,
+    FN_LEFT,
+    FN_RIGHT,
+    FN_MID,
+    FN_STR,
+    FN_CHR,
+    FN_SUM,            // Takes an array name, compiled to OP_ARRAY_SUM
+    FN_COUNT
+} FunctionId;
+
+// Expression value types
+typedef enum {
+    VALUE_NUMBER,
+    VALUE_STRING,
+    VALUE_INTEGER
+} ValueType;
+
+// String operand: a slice of a literal, a variable or the temporary
+// string stack. It is not NUL-terminated and is only valid until the
+// next statement.
+typedef struct {
+    const char *text;
+    int length;
+} StringRef;
+
+// Result of evaluating an expression
+typedef struct {
+    ValueType type;
+    double number;
+    int integer;
+    StringRef string;
+} BasicValue;
+
 // Token structure
 typedef struct {
     TokenType type;
     char stringValue[MAX_VAR_NAME_LENGTH];
     int intValue;
     double floatValue;
+    const char *text;  // Start of the token in the source line
+    int length;        // Length of the token text (string body for TOK_STRING)
 } Token;
 
 // Variable types
 typedef enum {
+    VAR_UNDEFINED,     // Slot interned but never assigned
     VAR_NUMERIC,
     VAR_STRING,
     VAR_ARRAY_NUMERIC,
-    VAR_ARRAY_STRING
+    VAR_ARRAY_STRING,
+    VAR_INTEGER        // Name ends in '%'
 } VariableType;
 
-// Variable structure
+// Variable structure (cold metadata)
+//
+// Every identifier the tokenizer sees is given a fixed slot when first
+// interned; the slot stays VAR_UNDEFINED until the program assigns or
+// dimensions it. Values are not stored here: numbers live in the hot
+// BASICState.numericValues array indexed by slot (integers in
+// integerValues), strings and arrays in typed side tables indexed by
+// Variable.index.
 typedef struct {
     char name[MAX_VAR_NAME_LENGTH];
-    VariableType type;
-    int dimensions[MAX_ARRAY_DIMENSIONS];
-    int size;
-    union {
-        double numericValue;
-        char *stringValue;
-        double *numericArray;
-        char **stringArray;
-    } value;
+    int index;  // Entry in stringValues or arrays, -1 if none
 } Variable;
 
+// String variable side table entry. text is a block from the state's
+// string pool, NUL-terminated, or NULL until the first assignment;
+// capacity is the block size, so shorter values reuse it in place.
+typedef struct {
+    char *text;
+    int length;
+    int capacity;
+} StringValue;
+
+// Array side table entry
+//
+// Elements are stored row-major in one block of exactly `count` doubles.
+// DIM bounds are inclusive, so DIM A(5) holds A(0) through A(5); the
+// element at (i, j, k) is numericArray[i*strides[0] + j*strides[1] + k].
+typedef struct {
+    int dimensions[MAX_ARRAY_DIMENSIONS];  // Highest valid subscript
+    int strides[MAX_ARRAY_DIMENSIONS];     // Elements per step of each subscript
+    int size;   // Number of dimensions
+    int count;  // Number of elements
+    double *numericArray;
+    int shared; // numericArray belongs to a snapshot; copy before writing
+} ArrayValue;
+
 // Program line structure
+//
+// Lines are tokenized once when they are added. The token stream is a
+// sequence of TokenType bytes, some followed by an inline payload:
+//   TOK_NUMBER   8-byte double
+//   TOK_STRING   1-byte length, then the string body
+//   TOK_VARIABLE 2-byte variable slot (little endian)
+//   TOK_FUNCTION 2-byte FunctionId (little endian)
+//   TOK_LINE_REF LineRef record, copied byte-wise (may be unaligned)
+//   TOK_EXPR     2-byte code length, then ExprOp code ending in OP_END or OP_END_STRING
+// Every expression position (LET and FOR operands, IF conditions, PRINT
+// items, MAT scalars) holds a TOK_EXPR block rather than the raw
+// expression tokens.
+// REM drops the rest of the line and every stream ends with TOK_EOL.
+struct ProgramLine;
+
+// Resolved jump target. Line nodes keep their address for the life of
+// the program, even when the line is retyped, so the cached pointer only
+// needs resolving again when it is NULL or its line has been deleted.
 typedef struct {
     int lineNumber;
-    char *lineText;
+    struct ProgramLine *target;
+} LineRef;
+
+typedef struct ProgramLine {
+    int lineNumber;
+    const char *lineText;     // Source, kept for listings. May point into a
+    int textLength;           // buffer loaded in place, so not NUL-terminated
+    unsigned char *tokens;    // Tokenized form executed by the run loop
+    int tokenLength;
+    int capacity;             // Bytes available at tokens for a retyped line
+    int removed;              // Deleted; kept so stale LineRefs can tell
+    int dataIndex;            // First DATA pool item at or after this line
+    unsigned long hits;       // Statements run on this line while profiling
+    unsigned long ticks;      // Profile clock ticks spent in them
     struct ProgramLine *next;
 } ProgramLine;
 
-// BASIC interpreter state
+// One DATA item, collected from the whole program before it runs.
+// Numbers are parsed at tokenize time; string items point at their
+// body in the line's code, which lives as long as the program.
+typedef struct {
+    int isString;
+    double number;
+    const char *text;
+    int length;
+} DataItem;
+
+// Region allocator. Memory is bump-allocated from chunks obtained through
+// basic_malloc and released all at once by basic_arena_reset; chunks are
+// kept for reuse until basic_arena_release.
+typedef struct ArenaChunk {
+    struct ArenaChunk *next;
+    int size;
+    int used;
+} ArenaChunk;
+
+typedef struct {
+    ArenaChunk *chunks;    // All chunks, in allocation order
+    ArenaChunk *current;   // Chunk being filled
+    int bytesUsed;
+    int bytesReserved;
+    int highWater;         // Largest bytesUsed since the arena was created
+} BasicArena;
+
+// Size-class pool for string values. Blocks are carved from an arena and
+// recycled through per-class free lists.
+typedef struct {
+    BasicArena arena;
+    void *freeLists[STRING_POOL_CLASSES];
+    int blocksInUse;
+    int bytesInUse;
+    int highWater;
+} StringPool;
+
+// Profile time source: a count that only increases, such as host clock
+// ticks or, on the emulator, elapsed CPU cycles
+typedef unsigned long (*BasicProfileClock)(void *context);
+
+// Profiling mode and the counters of the current run. Per-line hits and
+// ticks are kept on the ProgramLine nodes. Time is attributed by reading
+// the clock once between statements, so a coarse clock still sums to
+// the run's total and spreads over lines in proportion to their cost.
+typedef struct {
+    int enabled;
+    BasicProfileClock clock;   // NULL for clock()
+    void *clockContext;
+    unsigned long statements;
+    unsigned long ticks;
+    unsigned long variableLookups;  // Symbol lookups by name
+    unsigned long allocations;      // String pool and array allocations
+    unsigned long outputCalls;      // Buffer flushes to the console or sink
+    unsigned long inputCalls;
+} BasicProfile;
+
+// Memory accounting categories
+typedef enum {
+    MEM_PROGRAM,    // Copied source text, line nodes and the DATA table
+    MEM_TOKENS,     // Tokenized code
+    MEM_VARIABLES,  // Value and name tables of the slots in use
+    MEM_STRINGS,    // String pool blocks, headers included
+    MEM_ARRAYS,     // Array element blocks
+    MEM_STACKS,     // FOR and GOSUB frames in use
+    MEM_CATEGORIES
+} MemoryCategory;
+
+// Bytes an interpreter uses, charged where it allocates them. Program
+// arena memory is only reclaimed by the next load, so retyped and
+// deleted lines stay charged until then. Stack frames live in fixed
+// tables bounded by MAX_FOR_DEPTH and MAX_GOSUB_DEPTH; they are measured
+// when read and never refused. A quota of 0 is no limit.
+typedef struct {
+    long used[MEM_CATEGORIES];
+    long peak[MEM_CATEGORIES];
+    long quota[MEM_CATEGORIES];
+    long total;                 // Charged bytes, stacks excluded
+    long totalPeak;
+    long totalQuota;
+    unsigned long refused;      // Allocations failed by a quota
+} BasicMemory;
+
+// Receives flushed console output (see basic_set_output_sink)
+typedef void (*BasicOutputSink)(void *context, const char *text, int length);
+
+// Precompiled program image
+//
+// An image is the loaded form of a program written out as one block:
+//   BasicImageHeader
+//   BasicImageLine[lineCount]   sorted by line number
+//   symbol names                symbolCount NUL-terminated names, in slot order
+//   code                        per line: tokens, then source text and a NUL
+// LineRef targets are stored as NULL and linked after loading. Values are
+// in host byte order; the layout field rejects images built for another
+// pointer size. checksum covers everything after the header, and
+// sourceChecksum is basic_checksum of the program text it was built from.
+#define BASIC_IMAGE_MAGIC "OBIM"
+#define BASIC_IMAGE_VERSION 4
+
+typedef struct {
+    char magic[4];
+    unsigned short version;
+    unsigned short layout;      // sizeof(LineRef) << 8 | sizeof(double)
+    unsigned int checksum;
+    unsigned int sourceChecksum;
+    int lineCount;
+    int symbolCount;
+    int symbolBytes;
+    int codeBytes;
+} BasicImageHeader;
+
+typedef struct {
+    int lineNumber;
+    int codeOffset;             // Offset of the line's tokens in the code block
+    int tokenLength;
+    int textLength;             // Text follows the tokens, NUL-terminated
+} BasicImageLine;
+
+// Execution position: a line and the statement within it to run next.
+// line is NULL for the immediate-mode line; code is NULL past the end.
+typedef struct {
+    ProgramLine *line;
+    const unsigned char *code;
+} ProgramPosition;
+
+// Active FOR loop. NEXT updates the variable and jumps straight back to
+// the body without looking at the FOR statement again. Loops over an
+// integer variable count in integerLimit and integerStep instead.
 typedef struct {
+    int slot;
+    int integer;
+    double limit;
+    double step;
+    int integerLimit;
+    int integerStep;
+    ProgramPosition body;
+} ForFrame;
+
+// Result of basic_step
+typedef enum {
+    BASIC_STEP_RUNNING,    // Budget used up; call basic_step again
+    BASIC_STEP_WAITING,    // INPUT is waiting for basic_provide_input
+    BASIC_STEP_FINISHED    // Ended, stopped or failed; errorCode tells which
+} BasicStepResult;
+
+struct BASICState;
+
+// Called by NEXT of an integer FOR loop before it jumps back to the
+// body of the loop at forStack[frameIndex]. Returning 1 means the hook
+// ran the loop further itself and set the position to continue at.
+typedef int (*BasicLoopHook)(void *context, struct BASICState *state, int frameIndex);
+
+// Called after every statement while installed, with its line (0 in
+// immediate mode), its first token and the profile clock ticks it took
+typedef void (*BasicStatementHook)(void *context, struct BASICState *state, int lineNumber,
+                                   const unsigned char *statement, unsigned long ticks);
+
+// BASIC interpreter state
+typedef struct BASICState {
     // Program storage
     ProgramLine *programLines;
     int currentLineNumber;
     int programSize;
+    BasicArena programArena;   // Line nodes, source text and tokens
+
+    // Line index sorted by line number, kept in step with programLines
+    // except that basic_analyze_program links lines it drops out of the
+    // chain; they stay in the index
+    ProgramLine *lineIndex[MAX_LINES];
+    int lineCount;
+    int analyzed;                 // The chain skips dropped lines
+    unsigned int sourceChecksum;  // basic_checksum of the loaded program text
+
+    // Variable storage, indexed by slot. The hot tables are all the run
+    // loop touches for numeric reads and writes.
+    double numericValues[MAX_VARIABLES];
+    int integerValues[MAX_VARIABLES];
+    unsigned char variableTypes[MAX_VARIABLES]; // VariableType per slot
 
-    // Variable storage
+    // Cold variable metadata and the symbol hash
     Variable variables[MAX_VARIABLES];
-    int variableCount;
+    int variableCount;                   // Slots in use
+    short symbolHash[SYMBOL_HASH_SIZE];  // Name hash -> slot + 1, 0 if empty
+
+    // Typed side tables
+    StringValue stringValues[MAX_STRING_VARIABLES];
+    int stringCount;
+    StringPool stringPool;
+    ArrayValue arrays[MAX_ARRAYS];
+    int arrayCount;
+
+    // Bumped whenever the program changes, so caches keyed on its code
+    // can tell they are stale
+    unsigned int programVersion;
 
     // Runtime state
     int running;
+    ProgramLine *currentLine;
+    ProgramPosition jumpTarget; // Where to continue when jumpPending is set
+    int jumpPending;
     int errorCode;
     char errorMessage[256];
 
     // Control flow
-    int forStack[32];  // FOR loop stack
+    ForFrame forStack[MAX_FOR_DEPTH];           // FOR loop stack
     int forStackPtr;
-    int gosubStack[32]; // GOSUB stack
+    ProgramPosition gosubStack[MAX_GOSUB_DEPTH]; // GOSUB return positions
     int gosubStackPtr;
 
-    // DATA statement handling
-    char *dataPointer;
+    // DATA pool and READ cursor; the pool is rebuilt before RUN when
+    // lines have changed since it was collected
+    DataItem *dataPool;
     int dataCount;
+    int dataCursor;
+    int dataStale;
 
     // I/O state
-    char inputBuffer[256];
+    char inputBuffer[256];     // Line supplied by basic_provide_input
     int inputIndex;
+
+    // Resumable execution (basic_step). A suspended program continues
+    // at resumeAt; one waiting at INPUT goes on once the host has put a
+    // line in inputBuffer, and then skips the prompts and variables of
+    // that statement it has already handled.
+    int stepping;               // INPUT suspends instead of reading stdin
+    int suspended;
+    int waitingForInput;
+    int inputReady;             // inputBuffer holds the supplied line
+    int inputVariable;          // Index of the waiting variable in its INPUT
+    ProgramPosition resumeAt;
+    unsigned int resumeVersion; // programVersion when suspended
+    unsigned long budgetLeft;   // Statements left of the last run's budget
+
+    // Console output is collected here and written in one call when a
+    // line ends (if outputLineBuffered), when the buffer fills, before
+    // INPUT reads, and when execution stops
+    char outputBuffer[OUTPUT_BUFFER_SIZE];
+    int outputLength;
+    int outputLineBuffered;
+    BasicOutputSink outputSink;  // NULL writes to stdout
+    void *outputContext;
+
+    // Profiling
+    BasicProfile profile;
+
+    // Memory accounting and quotas
+    BasicMemory memory;
+
+    // Loop tiering (see basic-native.h); NULL interprets every iteration
+    BasicLoopHook loopHook;
+    void *loopHookContext;
+
+    // Tracing (see basic-trace.h); NULL runs without it
+    BasicStatementHook statementHook;
+    void *statementHookContext;
+
+    // RND generator state
+    unsigned int randomState;
+
+    // Temporary string stack
+    char stringScratch[STRING_SCRATCH_SIZE];
+    int scratchUsed;
 } BASICState;
 
+// Variables of a loaded program saved by basic_take_snapshot, so that
+// basic_restore_snapshot can rerun the program without loading it again.
+// The array blocks are owned here and shared with the state until it
+// writes to them.
+typedef struct {
+    const BASICState *owner;
+    unsigned int programVersion;
+    unsigned int randomState;
+
+    int variableCount;
+    double numericValues[MAX_VARIABLES];
+    int integerValues[MAX_VARIABLES];
+    unsigned char variableTypes[MAX_VARIABLES];
+    int variableIndex[MAX_VARIABLES];
+    short symbolHash[SYMBOL_HASH_SIZE];
+
+    // String values back to back, each NUL-terminated
+    char *strings;
+    int stringOffsets[MAX_STRING_VARIABLES];
+    int stringLengths[MAX_STRING_VARIABLES];
+    int stringCount;
+
+    ArrayValue arrays[MAX_ARRAYS];
+    int arrayCount;
+} BasicSnapshot;
+
+#define MAX_HOIST_CANDIDATES 32
+
+// A subexpression in a loop body that reads nothing the loop writes
+typedef struct {
+    int lineNumber;              // Line holding the expression
+    int loopLine;                // Line of the FOR of the innermost loop around it
+    int operations;              // Operators it evaluates on every iteration
+} HoistCandidate;
+
+// Report of basic_analyze_program
+typedef struct {
+    int lines;
+    int edges;                   // Control flow edges between lines
+    int jumps;                   // Line references checked
+    int loops;                   // FOR statements paired with a NEXT
+    int unclosedLoops;           // FOR statements no NEXT closes lexically
+    int remLines;                // Dropped because they only hold a REM
+    int unreachableLines;        // Dropped because no path reaches them
+    HoistCandidate hoists[MAX_HOIST_CANDIDATES];
+    int hoistCount;              // May exceed MAX_HOIST_CANDIDATES
+} BasicAnalysis;
+
 // Function declarations
 
 // Core interpreter functions
 void basic_init(BASICState *state);
+void basic_shutdown(BASICState *state);
 int basic_load_program(BASICState *state, const char *programText);
+int basic_load_program_in_place(BASICState *state, const char *programText, int length);
+int basic_image_size(BASICState *state);
+int basic_save_image(BASICState *state, unsigned char *buffer, int capacity);
+int basic_load_image(BASICState *state, const unsigned char *image, int size,
+                     const char *programText, int length);
+unsigned int basic_checksum(const void *data, int length);
 int basic_run_program(BASICState *state);
+int basic_start_program(BASICState *state);
+BasicStepResult basic_step(BASICState *state, unsigned long budget);
+int basic_provide_input(BASICState *state, const char *text, int length);
+int basic_take_snapshot(BASICState *state, BasicSnapshot *snapshot);
+int basic_restore_snapshot(BASICState *state, const BasicSnapshot *snapshot);
+void basic_release_snapshot(BASICState *state, BasicSnapshot *snapshot);
+int basic_analyze_program(BASICState *state, BasicAnalysis *analysis);
 int basic_execute_line(BASICState *state, const char *lineText);
 void basic_set_error(BASICState *state, int errorCode, const char *message);
 
 // Lexical analysis
-Token *basic_get_token(const char **linePtr);
+int basic_get_token(BASICState *state, const char **linePtr, Token *token);
 int basic_is_keyword(const char *word);
 TokenType basic_get_keyword_type(const char *word);
+int basic_is_function(const char *word);
+int basic_lookup_function(const char *name);
+int basic_tokenize_line(BASICState *state, const char *lineText, unsigned char *buffer, int bufferSize);
+int basic_intern_symbol(BASICState *state, const char *name);
 
-// Expression evaluation
-double basic_evaluate_expression(BASICState *state, const char **linePtr);
-double basic_evaluate_term(BASICState *state, const char **linePtr);
-double basic_evaluate_factor(BASICState *state, const char **linePtr);
+// Expression evaluation (over compiled TOK_EXPR blocks)
+double basic_evaluate_expression(BASICState *state, const unsigned char **codePtr);
+int basic_evaluate_integer(BASICState *state, const unsigned char **codePtr);
+int basic_evaluate_value(BASICState *state, const unsigned char **codePtr, BasicValue *result);
+double basic_evaluate_function(BASICState *state, const char *functionName, double argument);
 double basic_get_variable_value(BASICState *state, const char *varName);
 void basic_set_variable_value(BASICState *state, const char *varName, double value);
+const char *basic_get_string_value(BASICState *state, const char *varName);
+int basic_set_string_value(BASICState *state, const char *varName, const char *value);
+double basic_get_slot_value(BASICState *state, int slot);
+void basic_set_slot_value(BASICState *state, int slot, double value);
 
-// Statement handlers
-int basic_handle_print(BASICState *state, const char **linePtr);
-int basic_handle_input(BASICState *state, const char **linePtr);
-int basic_handle_let(BASICState *state, const char **linePtr);
-int basic_handle_if(BASICState *state, const char **linePtr);
-int basic_handle_for(BASICState *state, const char **linePtr);
-int basic_handle_next(BASICState *state, const char **linePtr);
-int basic_handle_gosub(BASICState *state, const char **linePtr);
-int basic_handle_return(BASICState *state, const char **linePtr);
-int basic_handle_goto(BASICState *state, const char **linePtr);
-int basic_handle_read(BASICState *state, const char **linePtr);
-int basic_handle_data(BASICState *state, const char **linePtr);
-int basic_handle_dim(BASICState *state, const char **linePtr);
-int basic_handle_end(BASICState *state, const char **linePtr);
-int basic_handle_stop(BASICState *state, const char **linePtr);
-int basic_handle_rem(BASICState *state, const char **linePtr);
+// Statement handlers (over tokenized code)
+int basic_handle_print(BASICState *state, const unsigned char **codePtr);
+int basic_handle_input(BASICState *state, const unsigned char **codePtr);
+int basic_handle_let(BASICState *state, const unsigned char **codePtr);
+int basic_handle_if(BASICState *state, const unsigned char **codePtr);
+int basic_handle_for(BASICState *state, const unsigned char **codePtr);
+int basic_handle_next(BASICState *state, const unsigned char **codePtr);
+int basic_handle_gosub(BASICState *state, const unsigned char **codePtr);
+int basic_handle_return(BASICState *state, const unsigned char **codePtr);
+int basic_handle_goto(BASICState *state, const unsigned char **codePtr);
+int basic_handle_read(BASICState *state, const unsigned char **codePtr);
+int basic_handle_data(BASICState *state, const unsigned char **codePtr);
+int basic_handle_restore(BASICState *state, const unsigned char **codePtr);
+int basic_handle_dim(BASICState *state, const unsigned char **codePtr);
+int basic_handle_mat(BASICState *state, const unsigned char **codePtr);
+int basic_handle_end(BASICState *state, const unsigned char **codePtr);
+int basic_handle_stop(BASICState *state, const unsigned char **codePtr);
+int basic_handle_rem(BASICState *state, const unsigned char **codePtr);
+int basic_handle_goto_line(BASICState *state, int lineNumber);
+int basic_jump_to_line(BASICState *state, ProgramLine *targetLine);
+void basic_jump_to_position(BASICState *state, ProgramPosition position);
+double basic_read_data_value(BASICState *state);
 
 // Variable and array management
 Variable *basic_find_variable(BASICState *state, const char *name);
@@ -196,6 +720,7 @@ Variable *basic_create_variable(BASICState *state, const char *name, VariableTyp
 int basic_create_array(BASICState *state, const char *name, int dimensions[], int size);
 double basic_get_array_element(BASICState *state, const char *name, int indices[]);
 void basic_set_array_element(BASICState *state, const char *name, int indices[], double value);
+double *basic_array_element(BASICState *state, int slot, const int indices[], int count);
 
 // Utility functions
 int basic_is_numeric(const char *str);
@@ -208,7 +733,7 @@ void basic_skip_whitespace(const char **linePtr);
 
 // Built-in functions
 double basic_abs(double x);
-double basic_rnd(double x);
+double basic_rnd(BASICState *state, double x);
 double basic_sqr(double x);
 double basic_sin(double x);
 double basic_cos(double x);
@@ -219,19 +744,34 @@ double basic_int(double x);
 double basic_sgn(double x);
 
 // String functions
-char *basic_left(const char *str, int length);
-char *basic_right(const char *str, int length);
-char *basic_mid(const char *str, int start, int length);
-char *basic_str(double value);
+// String results are written to a caller buffer of MAX_LINE_LENGTH bytes
+char *basic_left(const char *str, int length, char *result);
+char *basic_right(const char *str, int length, char *result);
+char *basic_mid(const char *str, int start, int length, char *result);
+char *basic_str(double value, char *result);
 double basic_val(const char *str);
 int basic_len(const char *str);
-char *basic_chr(int asciiCode);
+char *basic_chr(int asciiCode, char *result);
 int basic_asc(const char *str);
 
 // Memory management
 void *basic_malloc(int size);
 void basic_free(void *ptr);
 void *basic_calloc(int count, int size);
+void basic_arena_init(BasicArena *arena);
+void *basic_arena_alloc(BasicArena *arena, int size);
+void basic_arena_reset(BasicArena *arena);
+void basic_arena_release(BasicArena *arena);
+void basic_pool_init(StringPool *pool);
+char *basic_pool_alloc(StringPool *pool, int size);
+void basic_pool_free(StringPool *pool, char *block);
+int basic_pool_block_size(const char *block);
+int basic_pool_block_cost(int size);
+void basic_pool_reset(StringPool *pool);
+void basic_pool_release(StringPool *pool);
+void basic_set_memory_quota(BASICState *state, MemoryCategory category, long bytes);
+void basic_set_total_memory_quota(BASICState *state, long bytes);
+const BasicMemory *basic_get_memory(BASICState *state);
 
 // I/O functions
 void basic_print_char(char c);
@@ -239,11 +779,30 @@ char basic_read_char();
 void basic_print_string(const char *str);
 void basic_print_newline();
 void basic_input_string(char *buffer, int maxLength);
+void basic_output_char(BASICState *state, char c);
+void basic_output_text(BASICState *state, const char *text, int length);
+void basic_output_number(BASICState *state, double value);
+void basic_flush_output(BASICState *state);
+void basic_set_output_buffering(BASICState *state, int lineBuffered);
+void basic_set_output_sink(BASICState *state, BasicOutputSink sink, void *context);
+int basic_format_number(double value, char *buffer);
 
 // Error handling
 const char *basic_get_error_message(int errorCode);
 
+// Profiling
+void basic_set_profiling(BASICState *state, int enabled);
+void basic_set_profile_clock(BASICState *state, BasicProfileClock clock, void *context);
+void basic_set_loop_hook(BASICState *state, BasicLoopHook hook, void *context);
+void basic_set_statement_hook(BASICState *state, BasicStatementHook hook, void *context);
+void basic_reset_profile(BASICState *state);
+void basic_dump_profile(BASICState *state, int maxLines);
+int basic_export_profile(BASICState *state, char *buffer, int capacity);
+
 // Debug functions
+void basic_dump_memory(BASICState *state);
 void basic_dump_variables(BASICState *state);
 void basic_dump_program(BASICState *state);
-void basic_dump_state(BASICState *state);
\ No newline at end of file
+void basic_dump_state(BASICState *state);
+
+#endif // BASIC_INTERPRETER_H
@@ -0,0 +1,221 @@
+/**
+ * OrionRisc-128 BASIC Job Runner - Implementation
+ *
+ * Workers take the next unclaimed job from a shared counter, so long and
+ * short programs balance across threads without any up-front partition.
+ * Nothing is shared between workers besides that counter: every job runs
+ * in its worker's own BASICState and writes only to its own BasicJob.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "basic-job-runner.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// Work shared by all workers of one run
+typedef struct {
+    BasicJob *jobs;
+    int jobCount;
+    int nextJob;
+    pthread_mutex_t lock;
+} JobQueue;
+
+static double nowSeconds(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/**
+ * Output sink: append flushed console output to the job's buffer
+ */
+static void collectOutput(void *context, const char *text, int length) {
+    BasicJob *job = (BasicJob *)context;
+
+    if (job->outputLength + length + 1 > job->outputCapacity) {
+        int capacity = job->outputCapacity ? job->outputCapacity : 256;
+        char *grown;
+
+        while (job->outputLength + length + 1 > capacity) {
+            capacity *= 2;
+        }
+        grown = (char *)realloc(job->output, capacity);
+        if (!grown) {
+            return; // Output is dropped; the program keeps running
+        }
+        job->output = grown;
+        job->outputCapacity = capacity;
+    }
+
+    memcpy(job->output + job->outputLength, text, length);
+    job->outputLength += length;
+    job->output[job->outputLength] = '\0';
+}
+
+/**
+ * Claim the next job, or NULL when the queue is drained
+ */
+static BasicJob *takeJob(JobQueue *queue) {
+    BasicJob *job = NULL;
+
+    pthread_mutex_lock(&queue->lock);
+    if (queue->nextJob < queue->jobCount) {
+        job = &queue->jobs[queue->nextJob++];
+    }
+    pthread_mutex_unlock(&queue->lock);
+
+    return job;
+}
+
+static void runJob(BASICState *state, BasicJob *job) {
+    double start = nowSeconds();
+
+    basic_set_output_sink(state, collectOutput, job);
+
+    job->success = basic_load_program(state, job->programText) &&
+                   basic_run_program(state);
+    job->errorCode = state->errorCode;
+    job->errorLine = state->currentLineNumber;
+    strncpy(job->errorMessage, state->errorMessage, sizeof(job->errorMessage) - 1);
+    job->errorMessage[sizeof(job->errorMessage) - 1] = '\0';
+
+    // Anything still buffered belongs to this job
+    basic_set_output_sink(state, NULL, NULL);
+
+    job->seconds = nowSeconds() - start;
+}
+
+static void *workerMain(void *argument) {
+    JobQueue *queue = (JobQueue *)argument;
+    BASICState *state;
+    BasicJob *job;
+
+    // A BASICState is too large for a thread stack
+    state = (BASICState *)malloc(sizeof(BASICState));
+    if (!state) {
+        return NULL; // Other workers drain the queue
+    }
+    basic_init(state);
+
+    while ((job = takeJob(queue)) != NULL) {
+        runJob(state, job);
+    }
+
+    basic_shutdown(state);
+    free(state);
+    return NULL;
+}
+
+/**
+ * Run all jobs on a pool of worker threads
+ */
+int basic_run_jobs(BasicJob *jobs, int jobCount, int workerCount, BasicRunStats *stats) {
+    pthread_t workers[MAX_JOB_WORKERS];
+    JobQueue queue;
+    double start;
+    int started = 0;
+    int i;
+
+    if (workerCount <= 0) {
+        workerCount = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    if (workerCount > MAX_JOB_WORKERS) {
+        workerCount = MAX_JOB_WORKERS;
+    }
+    if (workerCount > jobCount) {
+        workerCount = jobCount;
+    }
+    if (workerCount < 1) {
+        workerCount = 1;
+    }
+
+    for (i = 0; i < jobCount; i++) {
+        jobs[i].success = 0;
+        jobs[i].errorCode = ERR_NONE;
+        jobs[i].errorLine = 0;
+        strcpy(jobs[i].errorMessage, "Not run");
+        jobs[i].output = NULL;
+        jobs[i].outputLength = 0;
+        jobs[i].outputCapacity = 0;
+        jobs[i].seconds = 0.0;
+    }
+
+    queue.jobs = jobs;
+    queue.jobCount = jobCount;
+    queue.nextJob = 0;
+    pthread_mutex_init(&queue.lock, NULL);
+
+    start = nowSeconds();
+    for (i = 0; i < workerCount; i++) {
+        if (pthread_create(&workers[started], NULL, workerMain, &queue) == 0) {
+            started++;
+        }
+    }
+
+    // Without any thread the jobs still run, on the caller's
+    if (started == 0) {
+        workerMain(&queue);
+    }
+
+    for (i = 0; i < started; i++) {
+        pthread_join(workers[i], NULL);
+    }
+    pthread_mutex_destroy(&queue.lock);
+
+    if (stats) {
+        stats->jobCount = jobCount;
+        stats->succeeded = 0;
+        stats->failed = 0;
+        stats->workerCount = started ? started : 1;
+        stats->outputBytes = 0;
+        stats->wallSeconds = nowSeconds() - start;
+
+        for (i = 0; i < jobCount; i++) {
+            if (jobs[i].success) {
+                stats->succeeded++;
+            } else {
+                stats->failed++;
+            }
+            stats->outputBytes += jobs[i].outputLength;
+        }
+
+        stats->jobsPerSecond = stats->wallSeconds > 0.0 ? jobCount / stats->wallSeconds : 0.0;
+    }
+
+    for (i = 0; i < jobCount; i++) {
+        if (!jobs[i].success) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/**
+ * Free the output buffers of finished jobs
+ */
+void basic_release_jobs(BasicJob *jobs, int jobCount) {
+    int i;
+
+    for (i = 0; i < jobCount; i++) {
+        free(jobs[i].output);
+        jobs[i].output = NULL;
+        jobs[i].outputLength = 0;
+        jobs[i].outputCapacity = 0;
+    }
+}
+
+void basic_print_run_stats(const BasicRunStats *stats) {
+    printf("BASIC Job Run:\n");
+    printf("  Jobs: %d (%d succeeded, %d failed)\n",
+           stats->jobCount, stats->succeeded, stats->failed);
+    printf("  Workers: %d\n", stats->workerCount);
+    printf("  Wall Time: %.3f s\n", stats->wallSeconds);
+    printf("  Throughput: %.1f jobs/s\n", stats->jobsPerSecond);
+    printf("  Output: %ld bytes\n", stats->outputBytes);
+}
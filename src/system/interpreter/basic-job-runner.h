@@ -0,0 +1,52 @@
+/**
+ * OrionRisc-128 BASIC Job Runner - Header File
+ *
+ * Runs many independent BASIC programs in parallel on a pool of worker
+ * threads. Each worker owns one BASICState, reused from job to job, and
+ * each job's output is collected into its own buffer through the state's
+ * output sink. This is a host-side tool built against POSIX threads; the
+ * interpreter itself does not depend on it.
+ */
+
+#ifndef BASIC_JOB_RUNNER_H
+#define BASIC_JOB_RUNNER_H
+
+#include "basic-interpreter.h"
+
+// Upper bound on worker threads
+#define MAX_JOB_WORKERS 64
+
+// One program to run, and its result once the runner has finished
+typedef struct {
+    const char *name;          // Label used in reports
+    const char *programText;   // BASIC source, not modified
+
+    // Results
+    int success;
+    int errorCode;
+    int errorLine;
+    char errorMessage[256];
+    char *output;              // NUL-terminated; released by basic_release_jobs
+    int outputLength;
+    int outputCapacity;
+    double seconds;            // Load and run time on its worker
+} BasicJob;
+
+// Aggregate results of one basic_run_jobs call
+typedef struct {
+    int jobCount;
+    int succeeded;
+    int failed;
+    int workerCount;
+    long outputBytes;
+    double wallSeconds;
+    double jobsPerSecond;
+} BasicRunStats;
+
+// Run all jobs on workerCount threads (0 = one per online CPU).
+// Returns 1 if every job succeeded.
+int basic_run_jobs(BasicJob *jobs, int jobCount, int workerCount, BasicRunStats *stats);
+void basic_release_jobs(BasicJob *jobs, int jobCount);
+void basic_print_run_stats(const BasicRunStats *stats);
+
+#endif // BASIC_JOB_RUNNER_H
@@ -0,0 +1,768 @@
+/**
+ * OrionRisc-128 BASIC Native Loop Tier - Implementation
+ *
+ * Code shape for a loop whose body has statements 0..n-1:
+ *
+ *   prologue  R15 = 0; load variables, limit and step into registers
+ *   head      statement 0 ... statement n-1
+ *             counter += step, then back to head while inside the limit
+ *   exits     one stub per statement, plus one for the finished loop,
+ *             each loading its number into R0
+ *   epilogue  store the variables and R0, HALT
+ *
+ * R15 stays zero, so it serves as the base of every absolute LOAD and
+ * STORE, as the zero operand of sign tests and as a shift count of zero.
+ * Variables get R1 upwards, then the limit and the step; the remaining
+ * registers up to R14 are expression temporaries.
+ *
+ * RiscProcessor keeps registers as JavaScript numbers: LOAD yields an
+ * unsigned word, while ALU results are signed. Every LOAD is therefore
+ * followed by OR r, r so comparisons see signed values, and every STORE
+ * is preceded by SHIFT_RIGHT r, R15, which makes the word unsigned again.
+ */
+
+#include "basic-native.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#define REG_EXIT 0
+#define REG_ZERO 15
+#define REG_FIRST 1
+#define REG_LAST 14
+
+#define STACK_DEPTH 32
+
+#define INT_MIN_VALUE (-2147483647LL - 1)
+#define INT_MAX_VALUE 2147483647LL
+
+// Expression operand: a constant not yet loaded, or a register
+typedef struct {
+    int isConstant;
+    int value;
+    int reg;
+    int temporary;              // reg is a temporary owned by the operand
+} Operand;
+
+// Jump whose target is an exit stub, patched when the stubs are placed
+typedef struct {
+    int word;
+    int exitNumber;
+} Fixup;
+
+typedef struct {
+    NativeLoop *loop;
+    unsigned int codeOrigin;
+    unsigned int dataOrigin;
+    unsigned int freeTemporaries;   // Bit per register
+    int limitRegister;
+    int stepRegister;
+    Fixup fixups[NATIVE_MAX_CODE];
+    int fixupCount;
+    int failed;
+} Compiler;
+
+static int nativeLoopHook(void *context, BASICState *state, int frameIndex);
+
+/**
+ * Set up a tier with no loops seen yet. executor may be NULL, which
+ * leaves every loop to the interpreter.
+ */
+void basic_native_init(BasicNativeTier *tier, BasicNativeExecutor executor, void *context) {
+    memset(tier, 0, sizeof(*tier));
+    tier->executor = executor;
+    tier->executorContext = context;
+    tier->codeOrigin = NATIVE_CODE_ORIGIN;
+    tier->dataOrigin = NATIVE_DATA_ORIGIN;
+    tier->hotIterations = NATIVE_HOT_ITERATIONS;
+}
+
+/**
+ * Start compiling the loops of state. Loops cached from an earlier
+ * attach are dropped: basic_init restarts programVersion, so a new
+ * program can match an old one's version and code address.
+ */
+void basic_native_attach(BASICState *state, BasicNativeTier *tier) {
+    tier->state = state;
+    tier->programVersion = state->programVersion;
+    tier->loopCount = 0;
+    basic_set_loop_hook(state, nativeLoopHook, tier);
+}
+
+void basic_native_detach(BASICState *state) {
+    basic_set_loop_hook(state, NULL, NULL);
+}
+
+static void emit(Compiler *compiler, int op, int reg1, int reg2, unsigned int immediate) {
+    NativeLoop *loop = compiler->loop;
+
+    if (loop->codeWords >= NATIVE_MAX_CODE) {
+        compiler->failed = 1;
+        return;
+    }
+    loop->code[loop->codeWords++] = ORION_ENCODE(op, reg1, reg2, immediate);
+}
+
+static unsigned int codeAddress(Compiler *compiler, int word) {
+    return compiler->codeOrigin + 4 * word;
+}
+
+/**
+ * Immediate of a jump to word. RiscProcessor.step() adds 4 to the
+ * program counter after a taken jump too, so jumps name the word before
+ * their target.
+ */
+static unsigned int jumpAddress(Compiler *compiler, int word) {
+    return codeAddress(compiler, word) - 4;
+}
+
+static unsigned int dataAddress(Compiler *compiler, int word) {
+    return compiler->dataOrigin + 4 * word;
+}
+
+/**
+ * Conditional jump to an exit stub, placed later
+ */
+static void emitExitJump(Compiler *compiler, int op, int reg1, int reg2, int exitNumber) {
+    if (compiler->fixupCount >= NATIVE_MAX_CODE) {
+        compiler->failed = 1;
+        return;
+    }
+    compiler->fixups[compiler->fixupCount].word = compiler->loop->codeWords;
+    compiler->fixups[compiler->fixupCount].exitNumber = exitNumber;
+    compiler->fixupCount++;
+    emit(compiler, op, reg1, reg2, 0);
+}
+
+/**
+ * Data word holding a constant, shared by equal constants
+ */
+static int constantWord(Compiler *compiler, int value) {
+    NativeLoop *loop = compiler->loop;
+    int first = loop->exitWord + 1;
+    int i;
+
+    for (i = first; i < loop->dataWords; i++) {
+        if (loop->data[i] == (unsigned int)value) {
+            return i;
+        }
+    }
+
+    if (loop->dataWords >= NATIVE_MAX_DATA) {
+        compiler->failed = 1;
+        return first;
+    }
+    loop->data[loop->dataWords] = (unsigned int)value;
+    return loop->dataWords++;
+}
+
+static int allocTemporary(Compiler *compiler) {
+    int reg;
+
+    for (reg = REG_FIRST; reg <= REG_LAST; reg++) {
+        if (compiler->freeTemporaries & (1u << reg)) {
+            compiler->freeTemporaries &= ~(1u << reg);
+            return reg;
+        }
+    }
+
+    compiler->failed = 1;
+    return REG_LAST;
+}
+
+static void freeTemporary(Compiler *compiler, int reg) {
+    compiler->freeTemporaries |= 1u << reg;
+}
+
+static void releaseOperand(Compiler *compiler, Operand *operand) {
+    if (!operand->isConstant && operand->temporary) {
+        freeTemporary(compiler, operand->reg);
+    }
+}
+
+/**
+ * LOAD a data word, made signed like every other register value
+ */
+static void emitLoad(Compiler *compiler, int reg, int word) {
+    emit(compiler, ORION_LOAD, reg, REG_ZERO, dataAddress(compiler, word));
+    emit(compiler, ORION_OR, reg, reg, 0);
+}
+
+static void emitMove(Compiler *compiler, int target, int source) {
+    emit(compiler, ORION_XOR, target, target, 0);
+    emit(compiler, ORION_OR, target, source, 0);
+}
+
+static int loadConstant(Compiler *compiler, int value) {
+    int reg = allocTemporary(compiler);
+    emitLoad(compiler, reg, constantWord(compiler, value));
+    return reg;
+}
+
+/**
+ * Register holding the operand's value; constants are loaded first
+ */
+static int operandRegister(Compiler *compiler, Operand *operand) {
+    if (operand->isConstant) {
+        operand->reg = loadConstant(compiler, operand->value);
+        operand->temporary = 1;
+        operand->isConstant = 0;
+    }
+    return operand->reg;
+}
+
+static int copyToTemporary(Compiler *compiler, int source) {
+    int reg = allocTemporary(compiler);
+    emitMove(compiler, reg, source);
+    return reg;
+}
+
+/**
+ * Exit to stub exitNumber when the sign bits of x ^ left and x ^ right are
+ * both set: the overflow test for x = left + right
+ */
+static void emitAddOverflowCheck(Compiler *compiler, int sum, int left, int right, int exitNumber) {
+    int a = copyToTemporary(compiler, sum);
+    int b = copyToTemporary(compiler, sum);
+
+    emit(compiler, ORION_XOR, a, left, 0);
+    emit(compiler, ORION_XOR, b, right, 0);
+    emit(compiler, ORION_AND, a, b, 0);
+    emitExitJump(compiler, ORION_JUMP_LT, a, REG_ZERO, exitNumber);
+
+    freeTemporary(compiler, a);
+    freeTemporary(compiler, b);
+}
+
+static long long floorDivide(long long a, long long b) {
+    long long quotient = a / b;
+    return (a % b != 0 && ((a < 0) != (b < 0))) ? quotient - 1 : quotient;
+}
+
+static long long ceilDivide(long long a, long long b) {
+    long long quotient = a / b;
+    return (a % b != 0 && ((a < 0) == (b < 0))) ? quotient + 1 : quotient;
+}
+
+/**
+ * value * factor for a constant factor. The product of two arbitrary
+ * registers cannot be checked for overflow with this instruction set,
+ * so the value is range-checked against the factor first.
+ */
+static int emitMultiply(Compiler *compiler, int value, int factor, int exitNumber) {
+    long long low = INT_MIN_VALUE, high = INT_MAX_VALUE;
+    int bound, product, reg;
+
+    if (factor > 0) {
+        low = ceilDivide(INT_MIN_VALUE, factor);
+        high = floorDivide(INT_MAX_VALUE, factor);
+    } else if (factor < 0) {
+        low = ceilDivide(INT_MAX_VALUE, factor);
+        high = floorDivide(INT_MIN_VALUE, factor);
+    }
+
+    if (low > INT_MIN_VALUE) {
+        bound = loadConstant(compiler, (int)low);
+        emitExitJump(compiler, ORION_JUMP_LT, value, bound, exitNumber);
+        freeTemporary(compiler, bound);
+    }
+    if (high < INT_MAX_VALUE) {
+        bound = loadConstant(compiler, (int)high);
+        emitExitJump(compiler, ORION_JUMP_GT, value, bound, exitNumber);
+        freeTemporary(compiler, bound);
+    }
+
+    product = copyToTemporary(compiler, value);
+    reg = loadConstant(compiler, factor);
+    emit(compiler, ORION_MUL, product, reg, 0);
+    freeTemporary(compiler, reg);
+    return product;
+}
+
+/**
+ * Slot's variable register, or 0 if the slot is not held in one
+ */
+static int variableRegister(NativeLoop *loop, int slot) {
+    int i;
+
+    for (i = 0; i < loop->slotCount; i++) {
+        if (loop->slots[i] == slot) {
+            return REG_FIRST + i;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Translate the expression of statement exitNumber; the result is in a
+ * register named by the returned operand
+ */
+static int compileExpression(Compiler *compiler, const unsigned char *pc, Operand *result, int exitNumber) {
+    Operand stack[STACK_DEPTH];
+    int top = -1;
+    int slot, reg;
+
+    while (!compiler->failed) {
+        switch ((ExprOp)*pc++) {
+            case OP_END_INTEGER:
+                if (top != 0) {
+                    return 0;
+                }
+                *result = stack[0];
+                return 1;
+
+            case OP_ICONST:
+                if (top + 1 >= STACK_DEPTH) {
+                    return 0;
+                }
+                top++;
+                memcpy(&stack[top].value, pc, sizeof(int));
+                pc += sizeof(int);
+                stack[top].isConstant = 1;
+                stack[top].temporary = 0;
+                break;
+
+            case OP_IVAR:
+                if (top + 1 >= STACK_DEPTH) {
+                    return 0;
+                }
+                slot = pc[0] | (pc[1] << 8);
+                pc += 2;
+                top++;
+                stack[top].isConstant = 0;
+                stack[top].reg = variableRegister(compiler->loop, slot);
+                stack[top].temporary = 0;
+                break;
+
+            case OP_IADD:
+            case OP_ISUB: {
+                Operand *left = &stack[top - 1];
+                Operand *right = &stack[top];
+                int a = operandRegister(compiler, left);
+                int b = operandRegister(compiler, right);
+
+                reg = copyToTemporary(compiler, a);
+                if (pc[-1] == OP_IADD) {
+                    emit(compiler, ORION_ADD, reg, b, 0);
+                    emitAddOverflowCheck(compiler, reg, a, b, exitNumber);
+                } else {
+                    // a - b overflows when a and b differ in sign and
+                    // the result's sign differs from a's
+                    int x = copyToTemporary(compiler, a);
+                    int y = copyToTemporary(compiler, a);
+                    emit(compiler, ORION_SUB, reg, b, 0);
+                    emit(compiler, ORION_XOR, x, b, 0);
+                    emit(compiler, ORION_XOR, y, reg, 0);
+                    emit(compiler, ORION_AND, x, y, 0);
+                    emitExitJump(compiler, ORION_JUMP_LT, x, REG_ZERO, exitNumber);
+                    freeTemporary(compiler, x);
+                    freeTemporary(compiler, y);
+                }
+
+                releaseOperand(compiler, left);
+                releaseOperand(compiler, right);
+                top--;
+                left->isConstant = 0;
+                left->reg = reg;
+                left->temporary = 1;
+                break;
+            }
+
+            case OP_IMUL: {
+                Operand *left = &stack[top - 1];
+                Operand *right = &stack[top];
+                Operand *value = right->isConstant ? left : right;
+                Operand *factor = right->isConstant ? right : left;
+
+                if (!factor->isConstant) {
+                    return 0;
+                }
+
+                reg = emitMultiply(compiler, operandRegister(compiler, value), factor->value, exitNumber);
+                releaseOperand(compiler, value);
+                top--;
+                left->isConstant = 0;
+                left->reg = reg;
+                left->temporary = 1;
+                break;
+            }
+
+            case OP_INEG: {
+                Operand *operand = &stack[top];
+                int a = operandRegister(compiler, operand);
+                int x = copyToTemporary(compiler, a);
+
+                // 0 - a overflows only for the smallest integer, which
+                // is the one value that stays negative when negated
+                reg = allocTemporary(compiler);
+                emit(compiler, ORION_XOR, reg, reg, 0);
+                emit(compiler, ORION_SUB, reg, a, 0);
+                emit(compiler, ORION_AND, x, reg, 0);
+                emitExitJump(compiler, ORION_JUMP_LT, x, REG_ZERO, exitNumber);
+                freeTemporary(compiler, x);
+
+                releaseOperand(compiler, operand);
+                operand->reg = reg;
+                operand->temporary = 1;
+                break;
+            }
+
+            default:
+                // Anything else involves floating point, strings or calls
+                return 0;
+        }
+    }
+
+    return 0;
+}
+
+static int addSlot(NativeLoop *loop, int slot) {
+    if (variableRegister(loop, slot)) {
+        return 1;
+    }
+    if (loop->slotCount >= NATIVE_MAX_VARIABLES) {
+        return 0;
+    }
+    loop->slots[loop->slotCount++] = slot;
+    return 1;
+}
+
+/**
+ * Collect the variables of an expression, checking that it uses only
+ * integer operations the translator handles
+ */
+static int scanExpression(NativeLoop *loop, const unsigned char *pc) {
+    while (1) {
+        switch ((ExprOp)*pc++) {
+            case OP_END_INTEGER:
+                return 1;
+            case OP_ICONST:
+                pc += sizeof(int);
+                break;
+            case OP_IVAR:
+                if (!addSlot(loop, pc[0] | (pc[1] << 8))) {
+                    return 0;
+                }
+                pc += 2;
+                break;
+            case OP_IADD:
+            case OP_ISUB:
+            case OP_IMUL:
+            case OP_INEG:
+                break;
+            default:
+                return 0;
+        }
+    }
+}
+
+/**
+ * Find the statements of the body up to the NEXT of loopSlot, and the
+ * variables they use. Only assignments to integer variables, REM and
+ * empty statements may appear.
+ */
+static int scanBody(NativeLoop *loop, ProgramPosition body, int loopSlot) {
+    ProgramLine *line = body.line;
+    const unsigned char *code = body.code;
+    int slot;
+
+    loop->statementCount = 0;
+    loop->slotCount = 0;
+    addSlot(loop, loopSlot);
+
+    while (1) {
+        if (*code == TOK_EOL) {
+            line = line ? line->next : NULL;
+            if (!line) {
+                return 0;
+            }
+            code = line->tokens;
+            continue;
+        }
+        if (*code == TOK_COLON) {
+            code++;
+            continue;
+        }
+        if (*code == TOK_REM) {
+            code++;
+            continue;
+        }
+
+        if (*code == TOK_NEXT) {
+            code++;
+            if (*code == TOK_VARIABLE) {
+                slot = code[1] | (code[2] << 8);
+                if (slot != loopSlot) {
+                    return 0;
+                }
+                code += 3;
+            }
+            if (*code == TOK_COLON) {
+                loop->after.line = line;
+                loop->after.code = code + 1;
+            } else if (*code == TOK_EOL) {
+                loop->after.line = line ? line->next : NULL;
+                loop->after.code = loop->after.line ? loop->after.line->tokens : NULL;
+            } else {
+                return 0;
+            }
+            return loop->statementCount > 0;
+        }
+
+        if (loop->statementCount >= NATIVE_MAX_STATEMENTS) {
+            return 0;
+        }
+        loop->statements[loop->statementCount].line = line;
+        loop->statements[loop->statementCount].code = code;
+
+        if (*code == TOK_LET) {
+            code++;
+        }
+        if (code[0] != TOK_VARIABLE || code[3] != TOK_EQUALS || code[4] != TOK_EXPR) {
+            return 0;
+        }
+        if (!addSlot(loop, code[1] | (code[2] << 8)) || !scanExpression(loop, code + 7)) {
+            return 0;
+        }
+        code += 7 + (code[5] | (code[6] << 8));
+
+        if (*code != TOK_EOL && *code != TOK_COLON) {
+            return 0;
+        }
+        loop->statementCount++;
+    }
+}
+
+/**
+ * Translate the loop body at body, counting in loopSlot, for a step of
+ * the given sign, to run at the tier's load addresses. Returns 0 when
+ * the body uses anything the tier does not translate.
+ */
+int basic_native_compile(const BasicNativeTier *tier, ProgramPosition body, int loopSlot, int stepNegative,
+                         NativeLoop *loop) {
+    Compiler compiler;
+    int head, stubs, epilogue, i, k;
+
+    memset(&compiler, 0, sizeof(compiler));
+    compiler.loop = loop;
+    compiler.codeOrigin = tier->codeOrigin;
+    compiler.dataOrigin = tier->dataOrigin;
+
+    loop->codeWords = 0;
+    loop->stepNegative = stepNegative;
+    if (!scanBody(loop, body, loopSlot)) {
+        return 0;
+    }
+
+    // Data: variables, limit, step, exit number, then constants
+    loop->limitWord = loop->slotCount;
+    loop->stepWord = loop->slotCount + 1;
+    loop->exitWord = loop->slotCount + 2;
+    loop->dataWords = loop->exitWord + 1;
+    memset(loop->data, 0, sizeof(loop->data));
+
+    compiler.limitRegister = REG_FIRST + loop->slotCount;
+    compiler.stepRegister = compiler.limitRegister + 1;
+    for (i = compiler.stepRegister + 1; i <= REG_LAST; i++) {
+        compiler.freeTemporaries |= 1u << i;
+    }
+
+    if (compiler.dataOrigin + 4 * NATIVE_MAX_DATA > 0x10000 ||
+        compiler.codeOrigin + 4 * NATIVE_MAX_CODE > 0x10000) {
+        return 0;
+    }
+
+    // Prologue
+    emit(&compiler, ORION_XOR, REG_ZERO, REG_ZERO, 0);
+    for (i = 0; i < loop->slotCount; i++) {
+        emitLoad(&compiler, REG_FIRST + i, i);
+    }
+    emitLoad(&compiler, compiler.limitRegister, loop->limitWord);
+    emitLoad(&compiler, compiler.stepRegister, loop->stepWord);
+
+    // Body
+    head = loop->codeWords;
+    for (k = 0; k < loop->statementCount && !compiler.failed; k++) {
+        const unsigned char *code = loop->statements[k].code;
+        Operand value;
+        int target;
+
+        if (*code == TOK_LET) {
+            code++;
+        }
+        target = variableRegister(loop, code[1] | (code[2] << 8));
+        if (!compileExpression(&compiler, code + 7, &value, k)) {
+            return 0;
+        }
+
+        if (value.isConstant) {
+            emitLoad(&compiler, target, constantWord(&compiler, value.value));
+        } else if (value.reg != target) {
+            emitMove(&compiler, target, value.reg);
+        }
+        releaseOperand(&compiler, &value);
+    }
+
+    // NEXT: a step past the integer range ends the loop, as in the
+    // interpreter, without changing the counter
+    {
+        int counter = variableRegister(loop, loopSlot);
+        int next = copyToTemporary(&compiler, counter);
+
+        emit(&compiler, ORION_ADD, next, compiler.stepRegister, 0);
+        emitAddOverflowCheck(&compiler, next, counter, compiler.stepRegister, loop->statementCount);
+        emitMove(&compiler, counter, next);
+        freeTemporary(&compiler, next);
+        emit(&compiler, stepNegative ? ORION_JUMP_GE : ORION_JUMP_LE,
+             counter, compiler.limitRegister, jumpAddress(&compiler, head));
+    }
+
+    // Exit stubs: the finished loop falls into the first one
+    stubs = loop->codeWords;
+    epilogue = stubs + 2 * (loop->statementCount + 1);
+    for (k = loop->statementCount; k >= 0; k--) {
+        emit(&compiler, ORION_LOAD, REG_EXIT, REG_ZERO, dataAddress(&compiler, constantWord(&compiler, k)));
+        emit(&compiler, ORION_JUMP, 0, 0, jumpAddress(&compiler, epilogue));
+    }
+
+    // Epilogue
+    for (i = 0; i < loop->slotCount; i++) {
+        emit(&compiler, ORION_SHIFT_RIGHT, REG_FIRST + i, REG_ZERO, 0);
+        emit(&compiler, ORION_STORE, REG_FIRST + i, REG_ZERO, dataAddress(&compiler, i));
+    }
+    emit(&compiler, ORION_STORE, REG_EXIT, REG_ZERO, dataAddress(&compiler, loop->exitWord));
+    emit(&compiler, ORION_HALT, 0, 0, 0);
+
+    if (compiler.failed) {
+        return 0;
+    }
+
+    // Point each exit jump at its stub
+    for (i = 0; i < compiler.fixupCount; i++) {
+        int stub = stubs + 2 * (loop->statementCount - compiler.fixups[i].exitNumber);
+        loop->code[compiler.fixups[i].word] |= jumpAddress(&compiler, stub) & 0xFFFF;
+    }
+
+    return 1;
+}
+
+static NativeLoop *findLoop(BasicNativeTier *tier, const unsigned char *body) {
+    int i;
+
+    for (i = 0; i < tier->loopCount; i++) {
+        if (tier->loops[i].body == body) {
+            return &tier->loops[i];
+        }
+    }
+
+    if (tier->loopCount >= NATIVE_MAX_LOOPS) {
+        return NULL;
+    }
+
+    tier->loops[tier->loopCount].body = body;
+    tier->loops[tier->loopCount].iterations = 0;
+    tier->loops[tier->loopCount].status = NATIVE_COUNTING;
+    return &tier->loops[tier->loopCount++];
+}
+
+/**
+ * Loop hook: count the back edge and, once the loop is hot and
+ * translated, run the rest of it natively
+ */
+static int nativeLoopHook(void *context, BASICState *state, int frameIndex) {
+    BasicNativeTier *tier = (BasicNativeTier *)context;
+    ForFrame *frame = &state->forStack[frameIndex];
+    NativeLoop *loop;
+    int i, exitNumber;
+
+    // A native run cannot stop partway, so it would overrun the
+    // statement budget of a basic_step slice
+    if (!tier->executor || frame->integerStep == 0 || state->stepping) {
+        return 0;
+    }
+
+    // Cached loops point into the code of the program they came from
+    if (tier->state != state || tier->programVersion != state->programVersion) {
+        tier->state = state;
+        tier->programVersion = state->programVersion;
+        tier->loopCount = 0;
+    }
+
+    loop = findLoop(tier, frame->body.code);
+    if (!loop || loop->status == NATIVE_REJECTED) {
+        return 0;
+    }
+
+    if (loop->status == NATIVE_COUNTING) {
+        if (++loop->iterations < tier->hotIterations) {
+            return 0;
+        }
+        if (!basic_native_compile(tier, frame->body, frame->slot, frame->integerStep < 0, loop)) {
+            loop->status = NATIVE_REJECTED;
+            tier->rejected++;
+            return 0;
+        }
+        loop->status = NATIVE_COMPILED;
+        tier->compiled++;
+    }
+
+    if (loop->stepNegative != (frame->integerStep < 0)) {
+        return 0;
+    }
+
+    // Values live in registers only while they are integers
+    for (i = 0; i < loop->slotCount; i++) {
+        if (state->variableTypes[loop->slots[i]] != VAR_INTEGER) {
+            return 0;
+        }
+        loop->data[i] = (unsigned int)state->integerValues[loop->slots[i]];
+    }
+    loop->data[loop->limitWord] = (unsigned int)frame->integerLimit;
+    loop->data[loop->stepWord] = (unsigned int)frame->integerStep;
+    loop->data[loop->exitWord] = 0;
+
+    if (!tier->executor(tier->executorContext, loop->code, loop->codeWords, tier->codeOrigin,
+                        loop->data, loop->dataWords, tier->dataOrigin)) {
+        // Retrying would fail the same way on every back edge
+        loop->status = NATIVE_REJECTED;
+        tier->rejected++;
+        return 0;
+    }
+    tier->nativeRuns++;
+
+    for (i = 0; i < loop->slotCount; i++) {
+        state->integerValues[loop->slots[i]] = (int)loop->data[i];
+    }
+
+    exitNumber = (int)loop->data[loop->exitWord];
+    if (exitNumber >= loop->statementCount) {
+        state->forStackPtr = frameIndex;
+        basic_jump_to_position(state, loop->after);
+    } else {
+        // Interpreting the statement again reports its error
+        tier->bailouts++;
+        basic_jump_to_position(state, loop->statements[exitNumber]);
+    }
+
+    return 1;
+}
+
+void basic_native_dump(const BasicNativeTier *tier) {
+    int i;
+
+    printf("BASIC Native Tier:\n");
+    printf("  Loops Seen: %d\n", tier->loopCount);
+    printf("  Compiled: %lu\n", tier->compiled);
+    printf("  Rejected: %lu\n", tier->rejected);
+    printf("  Native Runs: %lu\n", tier->nativeRuns);
+    printf("  Bailouts: %lu\n", tier->bailouts);
+
+    for (i = 0; i < tier->loopCount; i++) {
+        const NativeLoop *loop = &tier->loops[i];
+        if (loop->status == NATIVE_COMPILED) {
+            printf("  Loop at line %d: %d statements, %d words of code, %d of data\n",
+                   loop->statements[0].line ? loop->statements[0].line->lineNumber : 0,
+                   loop->statementCount, loop->codeWords, loop->dataWords);
+        }
+    }
+}
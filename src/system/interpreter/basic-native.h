@@ -0,0 +1,123 @@
+/**
+ * OrionRisc-128 BASIC Native Loop Tier - Header File
+ *
+ * Compiles hot integer FOR loops to OrionRisc machine code. Attached to
+ * a BASICState, the tier counts the back edges of every integer loop;
+ * once a loop has gone round hotIterations times its body is translated
+ * and the remaining iterations run as native code through an executor
+ * supplied by the host, such as the emulator's RiscProcessor.
+ *
+ * The CPU has no floating point, so only loops whose body is made of
+ * assignments to integer (%) variables are translated. Any other loop
+ * keeps running in the interpreter, as does every loop while no executor
+ * is installed. Overflow is checked in the generated code: the native
+ * run stops before the faulting statement and the interpreter resumes
+ * there, so errors are reported exactly as without the tier.
+ */
+
+#ifndef BASIC_NATIVE_H
+#define BASIC_NATIVE_H
+
+#include "basic-interpreter.h"
+
+// Back edges a loop takes in the interpreter before it is translated
+#ifndef NATIVE_HOT_ITERATIONS
+#define NATIVE_HOT_ITERATIONS 64
+#endif
+
+#define NATIVE_MAX_LOOPS 32          // Translated or rejected loops kept
+#define NATIVE_MAX_STATEMENTS 16     // Statements in one loop body
+#define NATIVE_MAX_VARIABLES 8       // Integer variables held in registers
+#define NATIVE_MAX_CODE 1024         // Instruction words per loop
+#define NATIVE_MAX_DATA 64           // Data words per loop
+
+// Default load addresses, clear of the interpreter's own image
+#define NATIVE_CODE_ORIGIN 0xC000
+#define NATIVE_DATA_ORIGIN 0xE000
+
+// OrionRisc opcodes, as decoded by RiscProcessor.js
+#define ORION_LOAD 0x01
+#define ORION_STORE 0x02
+#define ORION_ADD 0x03
+#define ORION_SUB 0x04
+#define ORION_AND 0x06
+#define ORION_OR 0x07
+#define ORION_XOR 0x08
+#define ORION_SHIFT_RIGHT 0x0A
+#define ORION_JUMP 0x0B
+#define ORION_JUMP_LT 0x0E
+#define ORION_JUMP_LE 0x0F
+#define ORION_JUMP_GT 0x10
+#define ORION_JUMP_GE 0x11
+#define ORION_MUL 0x12
+#define ORION_HALT 0xFF
+
+// Instruction word: opcode, two register fields and a 16-bit immediate
+#define ORION_ENCODE(op, reg1, reg2, immediate) \
+    (((unsigned int)(op) << 24) | ((unsigned int)(reg1) << 20) | \
+     ((unsigned int)(reg2) << 16) | ((unsigned int)(immediate) & 0xFFFF))
+
+// Runs codeWords instructions loaded at codeOrigin, with dataWords
+// words at dataOrigin, from the first instruction until HALT. Words are
+// stored big-endian in emulated memory. On success data holds the final
+// contents of the data area and 1 is returned; 0 means the run failed
+// and the interpreter carries on as if it had never started.
+typedef int (*BasicNativeExecutor)(void *context,
+                                   const unsigned int *code, int codeWords, unsigned int codeOrigin,
+                                   unsigned int *data, int dataWords, unsigned int dataOrigin);
+
+// One loop body, found by the address of its first statement
+typedef struct {
+    const unsigned char *body;   // NULL for a free entry
+    int iterations;              // Back edges counted while interpreted
+    int status;                  // NATIVE_COUNTING, _COMPILED or _REJECTED
+    int stepNegative;            // Direction the code was compiled for
+
+    unsigned int code[NATIVE_MAX_CODE];
+    int codeWords;
+    unsigned int data[NATIVE_MAX_DATA]; // Constants filled in; the rest per run
+    int dataWords;
+
+    int slots[NATIVE_MAX_VARIABLES];    // Variable slot of data words 0..
+    int slotCount;
+    int limitWord;
+    int stepWord;
+    int exitWord;                       // Statement to resume at
+
+    ProgramPosition statements[NATIVE_MAX_STATEMENTS];
+    int statementCount;
+    ProgramPosition after;              // Statement after the NEXT
+} NativeLoop;
+
+#define NATIVE_COUNTING 0
+#define NATIVE_COMPILED 1
+#define NATIVE_REJECTED 2
+
+// Tier state for one interpreter; attach with basic_native_attach
+typedef struct {
+    BasicNativeExecutor executor;
+    void *executorContext;
+    unsigned int codeOrigin;
+    unsigned int dataOrigin;
+    int hotIterations;
+
+    NativeLoop loops[NATIVE_MAX_LOOPS];
+    int loopCount;
+    const BASICState *state;            // State and program the loops were built from
+    unsigned int programVersion;
+
+    // Statistics
+    unsigned long compiled;
+    unsigned long rejected;
+    unsigned long nativeRuns;
+    unsigned long bailouts;             // Runs that stopped at a statement
+} BasicNativeTier;
+
+void basic_native_init(BasicNativeTier *tier, BasicNativeExecutor executor, void *context);
+void basic_native_attach(BASICState *state, BasicNativeTier *tier);
+void basic_native_detach(BASICState *state);
+int basic_native_compile(const BasicNativeTier *tier, ProgramPosition body, int loopSlot, int stepNegative,
+                         NativeLoop *loop);
+void basic_native_dump(const BasicNativeTier *tier);
+
+#endif // BASIC_NATIVE_H
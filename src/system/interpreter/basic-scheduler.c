@@ -0,0 +1,191 @@
+/**
+ * OrionRisc-128 BASIC Scheduler - Implementation
+ *
+ * The ready queue is the task table itself: the cursor walks it in order
+ * and runs the first task that is neither finished nor waiting, so every
+ * ready task gets one slice before any gets a second.
+ */
+
+#include "basic-scheduler.h"
+
+#include <stdio.h>
+#include <time.h>
+
+static unsigned long readClock(const BasicScheduler *scheduler) {
+    if (scheduler->clock) {
+        return scheduler->clock(scheduler->clockContext);
+    }
+    return (unsigned long)clock();
+}
+
+/**
+ * Prepare an empty scheduler; a slice of 0 uses the default
+ */
+void basic_scheduler_init(BasicScheduler *scheduler, unsigned long slice) {
+    if (!scheduler) {
+        return;
+    }
+
+    scheduler->taskCount = 0;
+    scheduler->next = 0;
+    scheduler->slice = slice ? slice : SCHEDULER_DEFAULT_SLICE;
+    scheduler->clock = NULL;
+    scheduler->clockContext = NULL;
+    scheduler->slicesRun = 0;
+}
+
+/**
+ * Install the time source for queue latency and run time
+ */
+void basic_scheduler_set_clock(BasicScheduler *scheduler, BasicProfileClock clock, void *context) {
+    if (scheduler) {
+        scheduler->clock = clock;
+        scheduler->clockContext = context;
+    }
+}
+
+/**
+ * Start the program loaded in state as a new task. Returns the task
+ * number, or -1 if the table is full or the program cannot start.
+ */
+int basic_scheduler_add(BasicScheduler *scheduler, BASICState *state, const char *name) {
+    BasicTask *task;
+
+    if (!scheduler || !state || scheduler->taskCount >= MAX_SCHEDULED_TASKS) {
+        return -1;
+    }
+    if (!basic_start_program(state)) {
+        return -1;
+    }
+
+    task = &scheduler->tasks[scheduler->taskCount];
+    task->state = state;
+    task->name = name ? name : "task";
+    task->status = BASIC_STEP_RUNNING;
+    task->statements = 0;
+    task->slices = 0;
+    task->readyTick = readClock(scheduler);
+    task->waitTicks = 0;
+    task->maxWaitTicks = 0;
+    task->runTicks = 0;
+
+    return scheduler->taskCount++;
+}
+
+/**
+ * Give a task waiting at INPUT its line; it rejoins the ready queue
+ */
+int basic_scheduler_provide_input(BasicScheduler *scheduler, int task, const char *text, int length) {
+    BasicTask *entry;
+
+    if (!scheduler || task < 0 || task >= scheduler->taskCount) {
+        return 0;
+    }
+
+    entry = &scheduler->tasks[task];
+    if (entry->status != BASIC_STEP_WAITING || !basic_provide_input(entry->state, text, length)) {
+        return 0;
+    }
+
+    entry->status = BASIC_STEP_RUNNING;
+    entry->readyTick = readClock(scheduler);
+    return 1;
+}
+
+/**
+ * Run the next ready task for one slice. Returns its task number, or
+ * -1 when no task is ready.
+ */
+int basic_scheduler_run_slice(BasicScheduler *scheduler) {
+    BasicTask *task = NULL;
+    unsigned long start, wait;
+    int index = -1;
+    int i;
+
+    if (!scheduler) {
+        return -1;
+    }
+
+    for (i = 0; i < scheduler->taskCount; i++) {
+        int candidate = (scheduler->next + i) % scheduler->taskCount;
+
+        if (scheduler->tasks[candidate].status == BASIC_STEP_RUNNING) {
+            index = candidate;
+            task = &scheduler->tasks[candidate];
+            break;
+        }
+    }
+    if (!task) {
+        return -1;
+    }
+    scheduler->next = (index + 1) % scheduler->taskCount;
+
+    start = readClock(scheduler);
+    wait = start - task->readyTick;
+    task->waitTicks += wait;
+    if (wait > task->maxWaitTicks) {
+        task->maxWaitTicks = wait;
+    }
+
+    task->status = basic_step(task->state, scheduler->slice);
+    task->statements += scheduler->slice - task->state->budgetLeft;
+    task->slices++;
+    scheduler->slicesRun++;
+
+    task->readyTick = readClock(scheduler);
+    task->runTicks += task->readyTick - start;
+    return index;
+}
+
+/**
+ * Run slices until no task is ready or maxSlices have run (0 for no
+ * limit). Returns the number of slices run.
+ */
+unsigned long basic_scheduler_run(BasicScheduler *scheduler, unsigned long maxSlices) {
+    unsigned long count = 0;
+
+    while ((maxSlices == 0 || count < maxSlices) && basic_scheduler_run_slice(scheduler) >= 0) {
+        count++;
+    }
+    return count;
+}
+
+/**
+ * Number of tasks that have not finished, ready or waiting
+ */
+int basic_scheduler_active(const BasicScheduler *scheduler) {
+    int count = 0;
+    int i;
+
+    for (i = 0; scheduler && i < scheduler->taskCount; i++) {
+        if (scheduler->tasks[i].status != BASIC_STEP_FINISHED) {
+            count++;
+        }
+    }
+    return count;
+}
+
+/**
+ * Print per-task accounting
+ */
+void basic_scheduler_dump(const BasicScheduler *scheduler) {
+    static const char *statusNames[] = { "ready", "input", "done" };
+    int i;
+
+    if (!scheduler) {
+        return;
+    }
+
+    printf("Scheduler: %d tasks, %lu slices of %lu statements\n",
+           scheduler->taskCount, scheduler->slicesRun, scheduler->slice);
+    printf("  %-12s %-6s %12s %8s %10s %10s %10s\n",
+           "Task", "State", "Statements", "Slices", "Wait", "Max wait", "Run");
+
+    for (i = 0; i < scheduler->taskCount; i++) {
+        const BasicTask *task = &scheduler->tasks[i];
+
+        printf("  %-12s %-6s %12lu %8lu %10lu %10lu %10lu\n",
+               task->name, statusNames[task->status], task->statements, task->slices,
+               task->waitTicks, task->maxWaitTicks, task->runTicks);
+    }
+}
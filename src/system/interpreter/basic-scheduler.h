@@ -0,0 +1,62 @@
+/**
+ * OrionRisc-128 BASIC Scheduler - Header File
+ *
+ * Time-slices many BASIC programs on one thread. Each task is a
+ * BASICState driven with basic_step: the scheduler gives the ready
+ * tasks a fixed statement budget in turn, round robin, so a program
+ * stuck in a GOTO loop only ever holds the interpreter for one slice.
+ * Tasks waiting at INPUT are passed over until the host supplies their
+ * line. Per task it records the statements consumed and the time spent
+ * ready but queued behind other tasks.
+ */
+
+#ifndef BASIC_SCHEDULER_H
+#define BASIC_SCHEDULER_H
+
+#include "basic-interpreter.h"
+
+#define MAX_SCHEDULED_TASKS 32
+
+// Statements per slice unless basic_scheduler_init is given another
+#ifndef SCHEDULER_DEFAULT_SLICE
+#define SCHEDULER_DEFAULT_SLICE 1000
+#endif
+
+// One program under the scheduler
+typedef struct {
+    BASICState *state;          // Owned by the caller
+    const char *name;           // Label used in reports
+    BasicStepResult status;     // RUNNING while ready to run
+
+    // Accounting
+    unsigned long statements;   // Budget consumed
+    unsigned long slices;
+    unsigned long readyTick;    // When it last joined the ready queue
+    unsigned long waitTicks;    // Total time spent ready but not running
+    unsigned long maxWaitTicks; // Longest single wait
+    unsigned long runTicks;
+} BasicTask;
+
+typedef struct {
+    BasicTask tasks[MAX_SCHEDULED_TASKS];
+    int taskCount;
+    int next;                   // Round-robin cursor
+    unsigned long slice;        // Statement budget of one slice
+
+    // Time source for the accounting; NULL uses clock()
+    BasicProfileClock clock;
+    void *clockContext;
+
+    unsigned long slicesRun;
+} BasicScheduler;
+
+void basic_scheduler_init(BasicScheduler *scheduler, unsigned long slice);
+void basic_scheduler_set_clock(BasicScheduler *scheduler, BasicProfileClock clock, void *context);
+int basic_scheduler_add(BasicScheduler *scheduler, BASICState *state, const char *name);
+int basic_scheduler_provide_input(BasicScheduler *scheduler, int task, const char *text, int length);
+int basic_scheduler_run_slice(BasicScheduler *scheduler);
+unsigned long basic_scheduler_run(BasicScheduler *scheduler, unsigned long maxSlices);
+int basic_scheduler_active(const BasicScheduler *scheduler);
+void basic_scheduler_dump(const BasicScheduler *scheduler);
+
+#endif // BASIC_SCHEDULER_H
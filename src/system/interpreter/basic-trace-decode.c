@@ -0,0 +1,142 @@
+/**
+ * OrionRisc-128 BASIC Trace Decoder
+ *
+ * Prints a trace file written with basic_trace_write_header and
+ * basic_trace_drain_to_file, one record per line, naming the variables
+ * from the file's symbol table.
+ *
+ *   basic-trace-decode FILE             print every record
+ *   basic-trace-decode --summary FILE   print statement counts and ticks per line
+ *
+ * The file is read in the byte order and record layout of the host, so
+ * decode on the kind of machine that wrote it.
+ */
+
+#include "basic-trace.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Per-line totals for --summary
+typedef struct {
+    int lineNumber;
+    unsigned long statements;
+    unsigned long ticks;
+} LineTotal;
+
+static int compareLines(const void *a, const void *b) {
+    return ((const LineTotal *)a)->lineNumber - ((const LineTotal *)b)->lineNumber;
+}
+
+static LineTotal *lineTotal(LineTotal *totals, int *count, int lineNumber) {
+    int i;
+
+    for (i = 0; i < *count; i++) {
+        if (totals[i].lineNumber == lineNumber) {
+            return &totals[i];
+        }
+    }
+    if (*count == MAX_LINES + 1) {
+        return NULL;
+    }
+    totals[*count].lineNumber = lineNumber;
+    totals[*count].statements = 0;
+    totals[*count].ticks = 0;
+    return &totals[(*count)++];
+}
+
+int main(int argc, char **argv) {
+    static LineTotal totals[MAX_LINES + 1];   // And immediate mode
+    BasicTraceFileHeader header;
+    BasicTraceRecord record;
+    const char *path = NULL;
+    const char **names;
+    char *symbols;
+    char text[128];
+    unsigned long records = 0;
+    int summary = 0;
+    int totalCount = 0;
+    int i, offset;
+    FILE *file;
+
+    for (i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--summary") == 0) {
+            summary = 1;
+        } else if (!path) {
+            path = argv[i];
+        } else {
+            path = NULL;
+            break;
+        }
+    }
+    if (!path) {
+        fprintf(stderr, "Usage: %s [--summary] FILE\n", argv[0]);
+        return 2;
+    }
+
+    file = fopen(path, "rb");
+    if (!file) {
+        fprintf(stderr, "Cannot open %s\n", path);
+        return 1;
+    }
+    if (fread(&header, sizeof(header), 1, file) != 1 || memcmp(header.magic, BASIC_TRACE_MAGIC, 4) != 0 ||
+        header.version != BASIC_TRACE_VERSION || header.recordSize != sizeof(BasicTraceRecord) ||
+        header.symbolCount < 0 || header.symbolCount > MAX_VARIABLES ||
+        header.symbolBytes < 0 || header.symbolBytes > MAX_VARIABLES * MAX_VAR_NAME_LENGTH) {
+        fprintf(stderr, "%s is not a trace file this decoder can read\n", path);
+        fclose(file);
+        return 1;
+    }
+
+    // Point each slot at its name in the symbol block
+    symbols = (char *)malloc(header.symbolBytes + 1);
+    names = (const char **)calloc(header.symbolCount + 1, sizeof(const char *));
+    if (!symbols || !names || fread(symbols, 1, header.symbolBytes, file) != (size_t)header.symbolBytes) {
+        fprintf(stderr, "%s: truncated symbol table\n", path);
+        free(symbols);
+        free(names);
+        fclose(file);
+        return 1;
+    }
+    symbols[header.symbolBytes] = '\0';
+    for (i = 0, offset = 0; i < header.symbolCount; i++) {
+        if (offset < header.symbolBytes) {
+            names[i] = symbols + offset;
+            offset += strlen(symbols + offset) + 1;
+        } else {
+            names[i] = "?";
+        }
+    }
+
+    while (fread(&record, sizeof(record), 1, file) == 1) {
+        records++;
+        if (summary) {
+            LineTotal *total = record.kind == TRACE_STATEMENT ?
+                               lineTotal(totals, &totalCount, record.lineNumber) : NULL;
+            if (total) {
+                total->statements++;
+                total->ticks += record.value.ticks;
+            }
+            continue;
+        }
+
+        basic_trace_format(&record, record.slot < header.symbolCount ? names[record.slot] : NULL,
+                           text, sizeof(text));
+        printf("%s\n", text);
+    }
+
+    if (summary) {
+        qsort(totals, totalCount, sizeof(LineTotal), compareLines);
+        printf("%6s %12s %12s\n", "Line", "Statements", "Ticks");
+        for (i = 0; i < totalCount; i++) {
+            printf("%6d %12lu %12lu\n", totals[i].lineNumber, totals[i].statements, totals[i].ticks);
+        }
+    }
+    printf("%lu records\n", records);
+
+    free(symbols);
+    free(names);
+    fclose(file);
+    return 0;
+}
@@ -0,0 +1,309 @@
+/**
+ * OrionRisc-128 BASIC Execution Trace - Implementation
+ *
+ * head and tail count records since basic_trace_init and wrap freely;
+ * head - tail is the number waiting. The run loop reads tail, fills the
+ * record at head and then publishes head; the drain reads head, copies
+ * the records before it and then publishes tail. Each index has a single
+ * writer, so ordering the publishing store after the record copy is all
+ * either side needs.
+ */
+
+#include "basic-trace.h"
+
+#include <string.h>
+
+#if (TRACE_CAPACITY & (TRACE_CAPACITY - 1)) != 0
+#error "TRACE_CAPACITY must be a power of two"
+#endif
+
+#if defined(__GNUC__)
+#define LOAD_ACQUIRE(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define STORE_RELEASE(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#else
+// Without the builtins, only a single-threaded host may drain
+#define LOAD_ACQUIRE(p) (*(volatile unsigned int *)(p))
+#define STORE_RELEASE(p, v) (*(volatile unsigned int *)(p) = (v))
+#endif
+
+#define DRAIN_CHUNK 256
+
+static const char *opcodeNames[256] = {
+    [TOK_EOL] = "(empty)",
+    [TOK_COLON] = "(empty)",
+    [TOK_VARIABLE] = "LET",
+    [TOK_PRINT] = "PRINT",
+    [TOK_INPUT] = "INPUT",
+    [TOK_LET] = "LET",
+    [TOK_IF] = "IF",
+    [TOK_FOR] = "FOR",
+    [TOK_NEXT] = "NEXT",
+    [TOK_GOSUB] = "GOSUB",
+    [TOK_RETURN] = "RETURN",
+    [TOK_GOTO] = "GOTO",
+    [TOK_READ] = "READ",
+    [TOK_DATA] = "DATA",
+    [TOK_RESTORE] = "RESTORE",
+    [TOK_DIM] = "DIM",
+    [TOK_MAT] = "MAT",
+    [TOK_END] = "END",
+    [TOK_STOP] = "STOP",
+    [TOK_REM] = "REM"
+};
+
+/**
+ * Append one record, or count it as dropped when the ring is full
+ */
+static void appendRecord(BasicTrace *trace, const BasicTraceRecord *record) {
+    unsigned int head = trace->head;
+
+    if (head - LOAD_ACQUIRE(&trace->tail) >= TRACE_CAPACITY) {
+        trace->dropped++;
+        return;
+    }
+    trace->records[head & (TRACE_CAPACITY - 1)] = *record;
+    STORE_RELEASE(&trace->head, head + 1);
+}
+
+/**
+ * Advance past one token of a statement and its payload, following the
+ * stream layout in basic-interpreter.h
+ */
+static const unsigned char *nextToken(const unsigned char *code) {
+    switch (*code++) {
+        case TOK_NUMBER:
+            return code + sizeof(double);
+        case TOK_STRING:
+            return code + 1 + code[0];
+        case TOK_VARIABLE:
+        case TOK_FUNCTION:
+            return code + 2;
+        case TOK_LINE_REF:
+            return code + sizeof(LineRef);
+        case TOK_EXPR:
+            return code + 2 + (code[0] | (code[1] << 8));
+        default:
+            return code;
+    }
+}
+
+/**
+ * Record the variables a statement assigned, with the values they hold
+ * now it has run. Outside compiled expressions, a variable token in a
+ * LET, INPUT, READ, FOR, NEXT or MAT statement is one it writes.
+ */
+static void traceWrites(BasicTrace *trace, BASICState *state, int lineNumber, const unsigned char *statement) {
+    const unsigned char *code = statement;
+    BasicTraceRecord record;
+
+    switch (*statement) {
+        case TOK_LET:
+        case TOK_INPUT:
+        case TOK_READ:
+        case TOK_FOR:
+        case TOK_NEXT:
+        case TOK_MAT:
+            code++;
+            break;
+        case TOK_VARIABLE:
+            break;
+        default:
+            return;
+    }
+
+    record.lineNumber = lineNumber;
+    record.opcode = *statement;
+
+    while (*code != TOK_EOL && *code != TOK_COLON && *code != TOK_ELSE) {
+        if (*code == TOK_VARIABLE) {
+            int slot = code[1] | (code[2] << 8);
+
+            record.slot = (unsigned short)slot;
+            record.value.number = 0.0;
+            if (state->variableTypes[slot] == VAR_UNDEFINED) {
+                // An INPUT suspended before reaching it, or a failed READ
+                return;
+            } else if (code[3] == TOK_LPAREN || *statement == TOK_MAT) {
+                record.kind = TRACE_ARRAY;
+            } else if (state->variableTypes[slot] == VAR_NUMERIC) {
+                record.kind = TRACE_NUMBER;
+                record.value.number = state->numericValues[slot];
+            } else if (state->variableTypes[slot] == VAR_INTEGER) {
+                record.kind = TRACE_INTEGER;
+                record.value.integer = state->integerValues[slot];
+            } else if (state->variableTypes[slot] == VAR_STRING) {
+                record.kind = TRACE_STRING;
+                record.value.length = state->stringValues[state->variables[slot].index].length;
+            } else {
+                record.kind = TRACE_ARRAY;
+            }
+            appendRecord(trace, &record);
+
+            // Only the first name of a LET, FOR or MAT is assigned
+            if (*statement == TOK_LET || *statement == TOK_VARIABLE || *statement == TOK_FOR ||
+                *statement == TOK_MAT) {
+                return;
+            }
+        }
+        code = nextToken(code);
+    }
+}
+
+static void traceStatement(void *context, BASICState *state, int lineNumber,
+                           const unsigned char *statement, unsigned long ticks) {
+    BasicTrace *trace = (BasicTrace *)context;
+    BasicTraceRecord record;
+
+    record.lineNumber = lineNumber;
+    record.kind = TRACE_STATEMENT;
+    record.opcode = *statement;
+    record.slot = 0;
+    record.value.number = 0.0;
+    record.value.ticks = (unsigned int)ticks;
+    appendRecord(trace, &record);
+
+    if (trace->recordWrites) {
+        traceWrites(trace, state, lineNumber, statement);
+    }
+}
+
+/**
+ * Prepare an empty trace
+ */
+void basic_trace_init(BasicTrace *trace, int recordWrites) {
+    if (!trace) {
+        return;
+    }
+
+    trace->head = 0;
+    trace->tail = 0;
+    trace->recordWrites = recordWrites;
+    trace->dropped = 0;
+}
+
+/**
+ * Trace the runs of state that start from now on
+ */
+void basic_trace_attach(BASICState *state, BasicTrace *trace) {
+    basic_set_statement_hook(state, traceStatement, trace);
+}
+
+void basic_trace_detach(BASICState *state) {
+    basic_set_statement_hook(state, NULL, NULL);
+}
+
+/**
+ * Records waiting to be drained
+ */
+int basic_trace_pending(const BasicTrace *trace) {
+    return (int)(LOAD_ACQUIRE(&trace->head) - trace->tail);
+}
+
+/**
+ * Move up to max of the oldest records into records and return how many
+ * were moved. Safe to call from another thread while the program runs,
+ * as long as only one thread drains.
+ */
+int basic_trace_drain(BasicTrace *trace, BasicTraceRecord *records, int max) {
+    unsigned int tail = trace->tail;
+    unsigned int count = LOAD_ACQUIRE(&trace->head) - tail;
+    unsigned int i;
+
+    if (max < 0) {
+        max = 0;
+    }
+    if (count > (unsigned int)max) {
+        count = (unsigned int)max;
+    }
+
+    for (i = 0; i < count; i++) {
+        records[i] = trace->records[(tail + i) & (TRACE_CAPACITY - 1)];
+    }
+    STORE_RELEASE(&trace->tail, tail + count);
+    return (int)count;
+}
+
+/**
+ * Start a trace file with the variable names of the loaded program, so
+ * the decoder can show them. Returns 1 on success.
+ */
+int basic_trace_write_header(BASICState *state, FILE *file) {
+    BasicTraceFileHeader header;
+    int i;
+
+    memcpy(header.magic, BASIC_TRACE_MAGIC, 4);
+    header.version = BASIC_TRACE_VERSION;
+    header.recordSize = sizeof(BasicTraceRecord);
+    header.symbolCount = state->variableCount;
+    header.symbolBytes = 0;
+    for (i = 0; i < state->variableCount; i++) {
+        header.symbolBytes += strlen(state->variables[i].name) + 1;
+    }
+
+    if (fwrite(&header, sizeof(header), 1, file) != 1) {
+        return 0;
+    }
+    for (i = 0; i < state->variableCount; i++) {
+        const char *name = state->variables[i].name;
+        if (fwrite(name, strlen(name) + 1, 1, file) != 1) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/**
+ * Drain every waiting record to file. Returns the number written, or -1
+ * if writing failed.
+ */
+long basic_trace_drain_to_file(BasicTrace *trace, FILE *file) {
+    BasicTraceRecord chunk[DRAIN_CHUNK];
+    long total = 0;
+    int count;
+
+    while ((count = basic_trace_drain(trace, chunk, DRAIN_CHUNK)) > 0) {
+        if (fwrite(chunk, sizeof(BasicTraceRecord), count, file) != (size_t)count) {
+            return -1;
+        }
+        total += count;
+    }
+    return total;
+}
+
+/**
+ * Keyword of a statement opcode
+ */
+const char *basic_trace_opcode_name(int opcode) {
+    const char *name = opcode >= 0 && opcode < 256 ? opcodeNames[opcode] : NULL;
+    return name ? name : "?";
+}
+
+/**
+ * Format a record as one line of text; name is the variable of a write,
+ * or NULL to show its slot. Returns the length, as snprintf does.
+ */
+int basic_trace_format(const BasicTraceRecord *record, const char *name, char *buffer, int capacity) {
+    char slotName[16];
+
+    if (!name) {
+        snprintf(slotName, sizeof(slotName), "#%d", record->slot);
+        name = slotName;
+    }
+
+    switch (record->kind) {
+        case TRACE_STATEMENT:
+            return snprintf(buffer, capacity, "%6d %-8s %10u", record->lineNumber,
+                            basic_trace_opcode_name(record->opcode), record->value.ticks);
+        case TRACE_NUMBER:
+            return snprintf(buffer, capacity, "%6d   %s = %.9g", record->lineNumber, name, record->value.number);
+        case TRACE_INTEGER:
+            return snprintf(buffer, capacity, "%6d   %s = %d", record->lineNumber, name, record->value.integer);
+        case TRACE_STRING:
+            return snprintf(buffer, capacity, "%6d   %s = (%d characters)", record->lineNumber, name,
+                            record->value.length);
+        case TRACE_ARRAY:
+            return snprintf(buffer, capacity, "%6d   %s() written", record->lineNumber, name);
+        default:
+            return snprintf(buffer, capacity, "%6d   ? record kind %d", record->lineNumber, record->kind);
+    }
+}
@@ -0,0 +1,83 @@
+/**
+ * OrionRisc-128 BASIC Execution Trace - Header File
+ *
+ * Records what a running program does into a fixed ring of compact
+ * binary records: one per statement, with its line, keyword and the
+ * profile clock ticks it took, and, when enabled, one per variable the
+ * statement assigned. The interpreter thread only ever appends and the
+ * host only ever drains, so the two can run on different threads
+ * without a lock; when the host falls behind, new records are dropped
+ * and counted rather than stalling the program.
+ *
+ * Attaching the trace installs a statement hook. Without one the run
+ * loop goes through the same single per-statement test as a run without
+ * profiling, so a detached trace costs nothing.
+ */
+
+#ifndef BASIC_TRACE_H
+#define BASIC_TRACE_H
+
+#include "basic-interpreter.h"
+
+#include <stdio.h>
+
+// Records the ring holds; a power of two
+#ifndef TRACE_CAPACITY
+#define TRACE_CAPACITY 4096
+#endif
+
+// Trace file: a BasicTraceFileHeader, symbolCount NUL-terminated
+// variable names in slot order, then records to the end of the file.
+// Values are in host byte order, as with program images.
+#define BASIC_TRACE_MAGIC "OBTR"
+#define BASIC_TRACE_VERSION 1
+
+typedef enum {
+    TRACE_STATEMENT,    // ticks holds the statement's time
+    TRACE_NUMBER,       // Variable writes: the value assigned
+    TRACE_INTEGER,
+    TRACE_STRING,       // length of the value assigned
+    TRACE_ARRAY         // An element or, for MAT, the whole array
+} BasicTraceKind;
+
+// One record, 16 bytes
+typedef struct {
+    int lineNumber;             // 0 in immediate mode
+    unsigned char kind;         // BasicTraceKind
+    unsigned char opcode;       // TokenType of the statement
+    unsigned short slot;        // Variable written
+    union {
+        unsigned int ticks;
+        double number;
+        int integer;
+        int length;
+    } value;
+} BasicTraceRecord;
+
+typedef struct {
+    char magic[4];
+    unsigned short version;
+    unsigned short recordSize;  // sizeof(BasicTraceRecord)
+    int symbolCount;
+    int symbolBytes;
+} BasicTraceFileHeader;
+
+typedef struct {
+    BasicTraceRecord records[TRACE_CAPACITY];
+    unsigned int head;          // Records appended; stored by the run loop only
+    unsigned int tail;          // Records drained; stored by the drain only
+    int recordWrites;           // Also record the variables each statement assigns
+    unsigned long dropped;      // Records lost to a full ring
+} BasicTrace;
+
+void basic_trace_init(BasicTrace *trace, int recordWrites);
+void basic_trace_attach(BASICState *state, BasicTrace *trace);
+void basic_trace_detach(BASICState *state);
+int basic_trace_pending(const BasicTrace *trace);
+int basic_trace_drain(BasicTrace *trace, BasicTraceRecord *records, int max);
+int basic_trace_write_header(BASICState *state, FILE *file);
+long basic_trace_drain_to_file(BasicTrace *trace, FILE *file);
+const char *basic_trace_opcode_name(int opcode);
+int basic_trace_format(const BasicTraceRecord *record, const char *name, char *buffer, int capacity);
+
+#endif // BASIC_TRACE_H
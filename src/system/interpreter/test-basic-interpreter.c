@@ -7,6 +7,54 @@
 #include <stdio.h>
 #include <string.h>
 
+// Console output collected by the stepping test
+static char captured[256];
+static int capturedLength = 0;
+
+static void captureOutput(void *context, const char *text, int length) {
+    (void)context;
+    if (capturedLength + length < (int)sizeof(captured)) {
+        memcpy(captured + capturedLength, text, length);
+        capturedLength += length;
+        captured[capturedLength] = '\0';
+    }
+}
+
+// Tokens of one line of a saved image
+static unsigned char *imageLineCode(unsigned char *image, int index) {
+    BasicImageHeader header;
+    BasicImageLine entry;
+
+    memcpy(&header, image, sizeof(header));
+    memcpy(&entry, image + sizeof(header) + index * sizeof(entry), sizeof(entry));
+    return image + sizeof(header) + header.lineCount * sizeof(entry) + header.symbolBytes + entry.codeOffset;
+}
+
+// Recompute an edited image's checksum, so only its contents are wrong
+static void resealImage(unsigned char *image, int size) {
+    BasicImageHeader header;
+
+    memcpy(&header, image, sizeof(header));
+    header.checksum = basic_checksum(image + sizeof(header), size - sizeof(header));
+    memcpy(image, &header, sizeof(header));
+}
+
+// Run the loaded program with basic_step, answering its one INPUT
+static int runWithInput(BASICState *state, const char *line) {
+    BasicStepResult step = BASIC_STEP_RUNNING;
+
+    if (!basic_start_program(state)) {
+        return 0;
+    }
+    while (step != BASIC_STEP_FINISHED) {
+        step = basic_step(state, 100);
+        if (step == BASIC_STEP_WAITING && !basic_provide_input(state, line, -1)) {
+            return 0;
+        }
+    }
+    return state->errorCode == ERR_NONE;
+}
+
 int main() {
     BASICState state;
     int success;
@@ -82,6 +130,9 @@ int main() {
 
     success = basic_execute_line(&state, "PRINT \"ARR(1) = \"; ARR(1)");
     printf("Array access: %s\n", success ? "OK" : "ERROR");
+
+    success = basic_execute_line(&state, "LET ARR(6) = 1");
+    printf("Array bounds check: %s\n", !success ? "OK" : "ERROR");
     printf("\n");
 
     // Test 6: Program loading and execution
@@ -119,10 +170,420 @@ int main() {
     printf("Error state: %s\n", state.errorMessage);
     printf("\n");
 
+    // Test 8: Control flow
+    printf("Test 8: Control flow\n");
+    printf("-------------------\n");
+
+    const char *loopProgram =
+        "10 LET S = 0\n"
+        "20 FOR I = 1 TO 10\n"
+        "30 LET S = S + I\n"
+        "40 NEXT I\n"
+        "50 LET N = 0\n"
+        "60 GOSUB 100\n"
+        "70 IF N < 3 THEN 60\n"
+        "80 FOR J = 5 TO 1: LET S = 0: NEXT J\n"
+        "90 END\n"
+        "100 LET N = N + 1: RETURN\n";
+
+    success = basic_load_program(&state, loopProgram) && basic_run_program(&state);
+    printf("Loop program execution: %s\n", success ? "OK" : "ERROR");
+    printf("FOR/NEXT sum (expect 55): %s\n",
+           basic_get_variable_value(&state, "S") == 55.0 ? "OK" : "ERROR");
+    printf("GOSUB/IF THEN loop (expect 3): %s\n",
+           basic_get_variable_value(&state, "N") == 3.0 ? "OK" : "ERROR");
+    printf("\n");
+
+    // Test 9: In-place loading (source is not NUL-terminated)
+    printf("Test 9: In-place loading\n");
+    printf("-----------------------\n");
+
+    const char inPlaceSource[] = "10 LET T = 2\r\n20 LET T = T * 21";
+    success = basic_load_program_in_place(&state, inPlaceSource, sizeof(inPlaceSource) - 1) &&
+              basic_run_program(&state);
+    printf("In-place program execution: %s\n",
+           success && basic_get_variable_value(&state, "T") == 42.0 ? "OK" : "ERROR");
+    printf("\n");
+
+    // Test 10: Line editing
+    printf("Test 10: Line editing\n");
+    printf("--------------------\n");
+
+    success = basic_execute_line(&state, "15 GOTO 30") &&
+              basic_execute_line(&state, "30 LET T = 7") &&
+              basic_execute_line(&state, "30 LET T = T + 1") &&
+              basic_run_program(&state);
+    printf("Insert and retype lines: %s\n",
+           success && basic_get_variable_value(&state, "T") == 3.0 ? "OK" : "ERROR");
+
+    success = basic_execute_line(&state, "15") && basic_run_program(&state);
+    printf("Delete line: %s\n",
+           success && basic_get_variable_value(&state, "T") == 43.0 ? "OK" : "ERROR");
+
+    // A number too large for a line is refused, not wrapped
+    success = basic_execute_line(&state, "99999999999 PRINT 1");
+    int editRejected = !success && state.errorCode == ERR_SYNTAX;
+    success = basic_execute_line(&state, "20 GOTO 99999999999");
+    int jumpRejected = !success && state.errorCode == ERR_SYNTAX;
+    success = basic_load_program(&state, "10 PRINT 1\n4294967306 PRINT 2\n");
+    printf("Line number out of range: %s\n",
+           editRejected && jumpRejected && !success && state.errorCode == ERR_SYNTAX ? "OK" : "ERROR");
+    printf("\n");
+
+    // Test 11: Program images
+    printf("Test 11: Program images\n");
+    printf("----------------------\n");
+
+    static unsigned char image[8192];
+    int imageSize;
+
+    basic_load_program(&state, loopProgram);
+    imageSize = basic_save_image(&state, image, sizeof(image));
+    success = imageSize > 0 &&
+              basic_load_image(&state, image, imageSize, loopProgram, strlen(loopProgram)) &&
+              basic_run_program(&state);
+    printf("Image round trip: %s\n",
+           success && basic_get_variable_value(&state, "S") == 55.0 ? "OK" : "ERROR");
+
+    success = basic_load_image(&state, image, imageSize, inPlaceSource, sizeof(inPlaceSource) - 1);
+    printf("Stale image rejected: %s\n", !success && state.errorCode == ERR_BAD_IMAGE ? "OK" : "ERROR");
+
+    image[imageSize - 2] ^= 0x20;
+    success = basic_load_image(&state, image, imageSize, NULL, 0);
+    printf("Corrupt image rejected: %s\n", !success && state.errorCode == ERR_BAD_IMAGE ? "OK" : "ERROR");
+
+    // Checksummed but malformed: an end of line inside line 10, and a
+    // variable slot past the symbol table in line 30's expression
+    basic_load_program(&state, loopProgram);
+    imageSize = basic_save_image(&state, image, sizeof(image));
+    imageLineCode(image, 0)[0] = TOK_EOL;
+    resealImage(image, imageSize);
+    success = basic_load_image(&state, image, imageSize, NULL, 0);
+    printf("Early end of line rejected: %s\n", !success && state.errorCode == ERR_BAD_IMAGE ? "OK" : "ERROR");
+
+    basic_load_program(&state, loopProgram);
+    imageSize = basic_save_image(&state, image, sizeof(image));
+    unsigned char *expression = imageLineCode(image, 2) + 5;
+    success = expression[0] == TOK_EXPR && expression[3] == OP_VAR;
+    expression[4] = expression[5] = 0xFF;
+    resealImage(image, imageSize);
+    success = success && !basic_load_image(&state, image, imageSize, NULL, 0);
+    printf("Corrupt expression rejected: %s\n", success && state.errorCode == ERR_BAD_IMAGE ? "OK" : "ERROR");
+    printf("\n");
+
+    // Test 12: DATA, READ and RESTORE
+    printf("Test 12: DATA, READ and RESTORE\n");
+    printf("------------------------------\n");
+
+    const char *dataProgram =
+        "10 DIM V(2)\n"
+        "20 READ V(0), V(1), V(2)\n"
+        "30 RESTORE 60\n"
+        "40 READ W\n"
+        "50 DATA 3, -4\n"
+        "60 DATA 5\n";
+
+    success = basic_load_program(&state, dataProgram) && basic_run_program(&state);
+    printf("READ into array and RESTORE line: %s\n",
+           success && basic_get_variable_value(&state, "W") == 5.0 ? "OK" : "ERROR");
+
+    success = basic_execute_line(&state, "40 READ W, X") && basic_run_program(&state);
+    printf("Out of DATA detected: %s\n", !success && state.errorCode == ERR_OUT_OF_DATA ? "OK" : "ERROR");
+    printf("\n");
+
+    // Test 13: Built-in string functions
+    printf("Test 13: Built-in string functions\n");
+    printf("---------------------------------\n");
+
+    success = basic_load_program(&state, "10 N = LEN(5)\n");
+    printf("Type mismatch rejected at load: %s\n",
+           !success && state.errorCode == ERR_TYPE_MISMATCH ? "OK" : "ERROR");
+
+    const char *stringProgram =
+        "10 A$ = \"ORION RISC\"\n"
+        "20 B$ = LEFT$(A$, 5)\n"
+        "30 N = LEN(B$) * 100 + ASC(RIGHT$(A$, 1)) + VAL(STR$(2))\n";
+
+    success = basic_load_program(&state, stringProgram) && basic_run_program(&state);
+    printf("LEFT$, RIGHT$, LEN, ASC, VAL and STR$: %s\n",
+           success && basic_get_variable_value(&state, "N") == 569.0 &&
+           strcmp(basic_get_string_value(&state, "B$"), "ORION") == 0 ? "OK" : "ERROR");
+    printf("\n");
+
+    // Test 14: String expressions
+    printf("Test 14: String expressions\n");
+    printf("--------------------------\n");
+
+    const char *concatProgram =
+        "10 R$ = \"\"\n"
+        "20 FOR I = 1 TO 50\n"
+        "30 R$ = R$ + CHR$(64 + I - INT((I - 1) / 26) * 26) + \",\"\n"
+        "40 NEXT I\n"
+        "50 R$ = MID$(R$, 3, 4) + R$\n"
+        "60 C = (LEFT$(R$, 2) = \"B,\") + (\"AB\" < \"ABC\") + (R$ <> \"\")\n";
+
+    success = basic_load_program(&state, concatProgram) && basic_run_program(&state);
+    printf("Concatenate in a loop: %s\n",
+           success && strlen(basic_get_string_value(&state, "R$")) == 104 &&
+           strncmp(basic_get_string_value(&state, "R$"), "B,C,A,B,", 8) == 0 ? "OK" : "ERROR");
+    printf("String comparison: %s\n",
+           success && basic_get_variable_value(&state, "C") == 3.0 ? "OK" : "ERROR");
+    printf("\n");
+
+    // Test 15: Integer variables
+    printf("Test 15: Integer variables\n");
+    printf("-------------------------\n");
+
+    const char *integerProgram =
+        "10 DIM V(10)\n"
+        "20 S% = 0\n"
+        "30 FOR I% = 10 TO 0 STEP -2\n"
+        "40 S% = S% + I% * 3 : V(I%) = I% / 4\n"
+        "50 NEXT I%\n"
+        "60 K% = -7.9\n";
+    int element[] = { 6 };
+
+    success = basic_load_program(&state, integerProgram) && basic_run_program(&state);
+    printf("Integer FOR loop and subscripts: %s\n",
+           success && basic_get_variable_value(&state, "S%") == 90.0 &&
+           basic_get_variable_value(&state, "I%") == -2.0 &&
+           basic_get_array_element(&state, "V", element) == 1.5 ? "OK" : "ERROR");
+    printf("Fraction dropped on assignment: %s\n",
+           success && basic_get_variable_value(&state, "K%") == -7.0 ? "OK" : "ERROR");
+
+    success = basic_execute_line(&state, "70 K% = 2147483647 + K% - K% * 2") && basic_run_program(&state);
+    printf("Integer overflow trapped: %s\n", !success && state.errorCode == ERR_OVERFLOW ? "OK" : "ERROR");
+    printf("\n");
+
+    // Test 16: Profiling
+    printf("Test 16: Profiling\n");
+    printf("-----------------\n");
+
+    static char profileText[4096];
+
+    basic_set_profiling(&state, 1);
+    success = basic_load_program(&state, loopProgram) && basic_run_program(&state);
+    printf("Per-line hit counts: %s\n",
+           success && state.lineIndex[2]->hits == 10 && state.lineIndex[9]->hits == 6 &&
+           state.profile.statements > 0 ? "OK" : "ERROR");
+
+    success = basic_export_profile(&state, profileText, sizeof(profileText)) > 0;
+    printf("Profile export: %s\n",
+           success && strstr(profileText, "{\"line\":30,\"hits\":10,") ? "OK" : "ERROR");
+
+    success = basic_export_profile(&state, profileText, 16);
+    printf("Short export buffer rejected: %s\n", !success ? "OK" : "ERROR");
+    basic_dump_profile(&state, 5);
+    basic_set_profiling(&state, 0);
+    printf("\n");
+
+    // Test 17: MAT statements
+    printf("Test 17: MAT statements\n");
+    printf("-----------------------\n");
+
+    const char *matProgram =
+        "10 DIM A(1,2), B(1,2), C(2,1), D(1,1)\n"
+        "20 FOR I = 0 TO 1 : FOR J = 0 TO 2 : B(I,J) = I * 3 + J : C(J,I) = I + J : NEXT J : NEXT I\n"
+        "30 MAT A = (2)\n"
+        "40 MAT A = A + B : MAT A = (0.5) * A\n"
+        "50 MAT D = B * C\n"
+        "60 S = SUM(A) : T = SUM(D)\n";
+    int corner[] = { 1, 2 };
+    int product[] = { 1, 0 };
+
+    success = basic_load_program(&state, matProgram) && basic_run_program(&state);
+    printf("Fill, add and scale: %s\n",
+           success && basic_get_array_element(&state, "A", corner) == 3.5 &&
+           basic_get_variable_value(&state, "S") == 13.5 ? "OK" : "ERROR");
+    printf("Matrix product and SUM: %s\n",
+           success && basic_get_array_element(&state, "D", product) == 14.0 &&
+           basic_get_variable_value(&state, "T") == 53.0 ? "OK" : "ERROR");
+
+    success = basic_execute_line(&state, "70 MAT A = C") && basic_run_program(&state);
+    printf("Shape mismatch rejected: %s\n",
+           !success && state.errorCode == ERR_ARRAY_BOUNDS && state.currentLineNumber == 70 ? "OK" : "ERROR");
+    printf("\n");
+
+    // Test 18: Stepping and suspended INPUT
+    printf("Test 18: Stepping and suspended INPUT\n");
+    printf("-------------------------------------\n");
+
+    const char *stepProgram =
+        "10 S = 0 : B = 0\n"
+        "20 FOR I = 1 TO 100 : S = S + I : NEXT I\n"
+        "30 INPUT \"NAME\"; N$, A\n"
+        "40 IF A > 0 THEN INPUT B\n"
+        "50 PRINT N$; A + B\n";
+    BasicStepResult step;
+    int slices = 0;
+
+    basic_set_output_sink(&state, captureOutput, NULL);
+    success = basic_load_program(&state, stepProgram) && basic_start_program(&state);
+    do {
+        step = basic_step(&state, 25);
+        slices++;
+    } while (step == BASIC_STEP_RUNNING);
+    printf("Budgeted slices: %s\n",
+           success && step == BASIC_STEP_WAITING && slices > 5 &&
+           basic_get_variable_value(&state, "S") == 5050.0 ? "OK" : "ERROR");
+
+    success = basic_step(&state, 25) == BASIC_STEP_WAITING &&
+              basic_provide_input(&state, "ORION\n", -1) && basic_step(&state, 25) == BASIC_STEP_WAITING &&
+              basic_provide_input(&state, "2", -1) && basic_step(&state, 25) == BASIC_STEP_WAITING &&
+              basic_provide_input(&state, "3", -1) && basic_step(&state, 25) == BASIC_STEP_FINISHED;
+    basic_set_output_sink(&state, NULL, NULL);
+    printf("INPUT resumed with host lines: %s\n",
+           success && state.errorCode == ERR_NONE &&
+           strncmp(captured, "NAME? ? ? ORION5", 16) == 0 ? "OK" : "ERROR");
+    printf("Input refused when not waiting: %s\n",
+           !basic_provide_input(&state, "1", -1) ? "OK" : "ERROR");
+    printf("\n");
+
+    // Test 19: Number literals and formatting
+    printf("Test 19: Number literals and formatting\n");
+    printf("---------------------------------------\n");
+
+    const char *literal = "123456789012345";
+    const char *rounded = "9007199254740993";
+    const char *numberProgram =
+        "10 A = 0.1 : B = 1.5E3 : C = 2.5E-3\n"
+        "20 A$ = STR$(0.1 + 0.2) : B$ = STR$(-2.5) : C$ = STR$(1 / 3)\n"
+        "30 D$ = STR$(100) : E$ = STR$(1E20) : D = VAL(\"  12.5E1X\")\n"
+        "40 PRINT A$; \" \"; B$; \" \"; C$; \" \"; D$; \" \"; E$\n";
+
+    printf("Integer literals exact or rounded: %s\n",
+           basic_parse_float(&literal) == 123456789012345.0 && *literal == '\0' &&
+           basic_parse_float(&rounded) == 9007199254740992.0 ? "OK" : "ERROR");
+
+    capturedLength = 0;
+    basic_set_output_sink(&state, captureOutput, NULL);
+    success = basic_load_program(&state, numberProgram) && basic_run_program(&state);
+    basic_set_output_sink(&state, NULL, NULL);
+    printf("Decimal and exponent literals: %s\n",
+           success && basic_get_variable_value(&state, "A") == 0.1 &&
+           basic_get_variable_value(&state, "B") == 1500.0 &&
+           basic_get_variable_value(&state, "C") == 0.0025 &&
+           basic_get_variable_value(&state, "D") == 125.0 ? "OK" : "ERROR");
+    printf("Shortest number formatting: %s\n",
+           success && strcmp(captured, "0.3 -2.5 0.333333333333333 100 1E+20\n") == 0 ? "OK" : "ERROR");
+
+    // Exactly halfway between two 15-digit results: ties go to even
+    char halfDown[64], halfUp[64], halfFraction[64];
+    basic_format_number(544463162629544.5, halfDown);
+    basic_format_number(123456789012345.5, halfUp);
+    basic_format_number(29201407942086.25, halfFraction);
+    printf("Halfway values round to even: %s\n",
+           strcmp(halfDown, "544463162629544") == 0 && strcmp(halfUp, "123456789012346") == 0 &&
+           strcmp(halfFraction, "29201407942086.2") == 0 ? "OK" : "ERROR");
+    printf("\n");
+
+    // Test 20: Snapshot and restore
+    printf("Test 20: Snapshot and restore\n");
+    printf("-----------------------------\n");
+
+    static BasicSnapshot snapshot;
+    const char *rerunProgram =
+        "10 INPUT N\n"
+        "20 FOR I = 0 TO 9 : A(I) = A(I) * N + I : NEXT I\n"
+        "30 T$ = T$ + \"X\" : S = SUM(A) + SUM(B)\n";
+    int indices[1] = { 0 };
+
+    basic_set_output_sink(&state, captureOutput, NULL);
+    success = basic_load_program(&state, rerunProgram) &&
+              basic_execute_line(&state, "DIM A(9), B(9) : MAT A = (1) : MAT B = (2)") &&
+              basic_take_snapshot(&state, &snapshot);
+    success = success && runWithInput(&state, "2") && basic_get_variable_value(&state, "S") == 85.0;
+    success = success && basic_restore_snapshot(&state, &snapshot) && runWithInput(&state, "3");
+    printf("Rerun without reloading: %s\n",
+           success && basic_get_variable_value(&state, "S") == 95.0 &&
+           strcmp(basic_get_string_value(&state, "T$"), "X") == 0 ? "OK" : "ERROR");
+
+    success = basic_restore_snapshot(&state, &snapshot);
+    printf("Only written arrays copied: %s\n",
+           success && !state.arrays[0].shared && state.arrays[1].shared &&
+           state.arrays[1].numericArray == snapshot.arrays[1].numericArray &&
+           basic_get_array_element(&state, "A", indices) == 1.0 ? "OK" : "ERROR");
+
+    success = basic_load_program(&state, "10 PRINT 1\n") && !basic_restore_snapshot(&state, &snapshot);
+    basic_release_snapshot(&state, &snapshot);
+    basic_set_output_sink(&state, NULL, NULL);
+    printf("Snapshot refused after reload: %s\n", success ? "OK" : "ERROR");
+    printf("\n");
+
+    // Test 21: Memory accounting and quotas
+    printf("Test 21: Memory accounting and quotas\n");
+    printf("-------------------------------------\n");
+
+    const BasicMemory *memory;
+    const char *memoryProgram =
+        "10 DIM A(99)\n"
+        "20 A$ = \"A STRING OF TWENTY-NINE BYTES\"\n";
+
+    success = basic_load_program(&state, memoryProgram) && basic_run_program(&state);
+    memory = basic_get_memory(&state);
+    printf("Bytes charged by category: %s\n",
+           success && memory->used[MEM_ARRAYS] == 100 * (long)sizeof(double) &&
+           memory->used[MEM_PROGRAM] + memory->used[MEM_TOKENS] == state.programArena.bytesUsed &&
+           memory->used[MEM_STRINGS] > 29 && memory->used[MEM_VARIABLES] > 0 &&
+           memory->total == memory->used[MEM_PROGRAM] + memory->used[MEM_TOKENS] +
+                            memory->used[MEM_VARIABLES] + memory->used[MEM_STRINGS] +
+                            memory->used[MEM_ARRAYS] ? "OK" : "ERROR");
+
+    basic_set_memory_quota(&state, MEM_ARRAYS, 500 * sizeof(double));
+    success = basic_load_program(&state, "10 DIM A(99), B(999)\n") && !basic_run_program(&state) &&
+              state.errorCode == ERR_OUT_OF_MEMORY && memory->refused == 1 &&
+              memory->used[MEM_ARRAYS] == 100 * (long)sizeof(double);
+    basic_set_memory_quota(&state, MEM_ARRAYS, 0);
+    printf("Array quota refused: %s\n", success ? "OK" : "ERROR");
+
+    basic_set_total_memory_quota(&state, 64);
+    success = !basic_load_program(&state, memoryProgram) && state.errorCode == ERR_OUT_OF_MEMORY &&
+              memory->total <= 64;
+    basic_set_total_memory_quota(&state, 0);
+    printf("Total quota refused at load: %s\n", success ? "OK" : "ERROR");
+    printf("\n");
+
+    // Test 22: Static analysis before the run
+    printf("Test 22: Static analysis before the run\n");
+    printf("---------------------------------------\n");
+
+    BasicAnalysis analysis;
+    const char *analysisProgram =
+        "10 REM SUM WITH A CONSTANT STEP\n"
+        "20 S = 0 : K = 3\n"
+        "30 FOR I = 1 TO 10\n"
+        "40 S = S + K * 2 + I\n"
+        "50 NEXT I\n"
+        "60 GOTO 90\n"
+        "70 S = -1\n"
+        "80 REM NEVER REACHED\n"
+        "90 END\n";
+
+    success = basic_load_program(&state, analysisProgram) && basic_analyze_program(&state, &analysis) &&
+              analysis.loops == 1 && analysis.remLines == 2 && analysis.unreachableLines == 1 &&
+              analysis.hoistCount == 1 && analysis.hoists[0].lineNumber == 40 &&
+              analysis.hoists[0].loopLine == 30 && basic_run_program(&state) &&
+              basic_get_variable_value(&state, "S") == 115.0;
+    printf("Dead lines dropped, invariant found: %s\n", success ? "OK" : "ERROR");
+
+    success = basic_execute_line(&state, "60 GOTO 70") && basic_run_program(&state) &&
+              basic_get_variable_value(&state, "S") == -1.0;
+    printf("Edit restores dropped lines: %s\n", success ? "OK" : "ERROR");
+
+    success = basic_load_program(&state, "10 FOR I = 1 TO 2\n20 GOSUB 300\n30 NEXT I\n") &&
+              !basic_analyze_program(&state, &analysis) && state.errorCode == ERR_LINE_NOT_FOUND &&
+              state.currentLineNumber == 20 &&
+              basic_load_program(&state, "10 PRINT 1\n20 NEXT I\n") &&
+              !basic_analyze_program(&state, &analysis) && state.errorCode == ERR_NEXT_WITHOUT_FOR;
+    printf("Bad jump and stray NEXT rejected: %s\n", success ? "OK" : "ERROR");
+    printf("\n");
+
     // Final state
     printf("Final interpreter state:\n");
     basic_dump_state(&state);
 
+    basic_shutdown(&state);
+
     printf("\nBASIC Interpreter Test Complete\n");
     return 0;
 }
\ No newline at end of file
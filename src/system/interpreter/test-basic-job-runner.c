@@ -0,0 +1,78 @@
+/**
+ * OrionRisc-128 BASIC Job Runner Test Program
+ * Runs a batch of programs in parallel and checks every job's output
+ */
+
+#include "basic-job-runner.h"
+#include <stdio.h>
+#include <string.h>
+
+#define JOB_COUNT 200
+
+static const char *sumProgram =
+    "10 S = 0\n"
+    "20 FOR I = 1 TO 100\n"
+    "30 S = S + I\n"
+    "40 NEXT I\n"
+    "50 PRINT S\n";
+
+static const char *loopProgram =
+    "10 N = 0\n"
+    "20 N = N + 1\n"
+    "30 IF N < 500 THEN 20\n"
+    "40 PRINT \"N=\"; N\n";
+
+static const char *errorProgram =
+    "10 PRINT \"BEFORE\"\n"
+    "20 GOTO 99\n";
+
+int main() {
+    static BasicJob jobs[JOB_COUNT];
+    BasicRunStats stats;
+    int outputsOk = 1;
+    int errorsOk = 1;
+    int i;
+
+    printf("OrionRisc-128 BASIC Job Runner Test\n");
+    printf("===================================\n\n");
+
+    for (i = 0; i < JOB_COUNT; i++) {
+        jobs[i].name = "job";
+        switch (i % 3) {
+            case 0: jobs[i].programText = sumProgram; break;
+            case 1: jobs[i].programText = loopProgram; break;
+            default: jobs[i].programText = errorProgram; break;
+        }
+    }
+
+    basic_run_jobs(jobs, JOB_COUNT, 4, &stats);
+
+    for (i = 0; i < JOB_COUNT; i++) {
+        const char *expected;
+
+        switch (i % 3) {
+            case 0: expected = "5050\n"; break;
+            case 1: expected = "N=500\n"; break;
+            default: expected = "BEFORE\n"; break;
+        }
+
+        if (!jobs[i].output || strcmp(jobs[i].output, expected) != 0) {
+            outputsOk = 0;
+        }
+        if ((i % 3 == 2) != (jobs[i].errorCode == ERR_LINE_NOT_FOUND)) {
+            errorsOk = 0;
+        }
+    }
+
+    printf("Per-job output isolation: %s\n", outputsOk ? "OK" : "ERROR");
+    printf("Per-job error reporting: %s\n", errorsOk ? "OK" : "ERROR");
+    printf("Job accounting: %s\n",
+           stats.succeeded + stats.failed == JOB_COUNT && stats.failed == JOB_COUNT / 3 ? "OK" : "ERROR");
+    printf("\n");
+
+    basic_print_run_stats(&stats);
+    basic_release_jobs(jobs, JOB_COUNT);
+
+    printf("\nBASIC Job Runner Test Complete\n");
+    return 0;
+}
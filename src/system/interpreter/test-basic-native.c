@@ -0,0 +1,223 @@
+/**
+ * OrionRisc-128 BASIC Native Loop Tier Test Program
+ * Runs programs with and without the tier and checks they agree. The
+ * executor below follows RiscProcessor.js, including its mix of signed
+ * and unsigned register values and its refusal to STORE a negative one.
+ */
+
+#include "basic-native.h"
+#include <stdio.h>
+#include <string.h>
+
+#define MEMORY_SIZE 0x10000
+#define STEP_BUDGET 10000000L
+
+static unsigned char memory[MEMORY_SIZE];
+
+static long long toInt32(long long value) {
+    unsigned int bits = (unsigned int)(value & 0xFFFFFFFFLL);
+    return bits >= 0x80000000u ? (long long)bits - 0x100000000LL : (long long)bits;
+}
+
+static unsigned int readWord(unsigned int address) {
+    return ((unsigned int)memory[address] << 24) | ((unsigned int)memory[address + 1] << 16) |
+           ((unsigned int)memory[address + 2] << 8) | memory[address + 3];
+}
+
+static void writeWord(unsigned int address, unsigned int value) {
+    memory[address] = (unsigned char)(value >> 24);
+    memory[address + 1] = (unsigned char)(value >> 16);
+    memory[address + 2] = (unsigned char)(value >> 8);
+    memory[address + 3] = (unsigned char)value;
+}
+
+static int runOrion(void *context,
+                    const unsigned int *code, int codeWords, unsigned int codeOrigin,
+                    unsigned int *data, int dataWords, unsigned int dataOrigin) {
+    long long registers[16] = { 0 };
+    unsigned int pc = codeOrigin;
+    long steps;
+    int i;
+
+    (void)context;
+    for (i = 0; i < codeWords; i++) {
+        writeWord(codeOrigin + 4 * i, code[i]);
+    }
+    for (i = 0; i < dataWords; i++) {
+        writeWord(dataOrigin + 4 * i, data[i]);
+    }
+
+    for (steps = 0; steps < STEP_BUDGET; steps++) {
+        unsigned int instruction = readWord(pc);
+        int op = (instruction >> 24) & 0xFF;
+        int reg1 = (instruction >> 20) & 0x0F;
+        int reg2 = (instruction >> 16) & 0x0F;
+        unsigned int immediate = instruction & 0xFFFF;
+        long long a = registers[reg1], b = registers[reg2];
+        int jump = 0;
+
+        switch (op) {
+            case ORION_LOAD: registers[reg1] = readWord((unsigned int)(b + immediate) & 0xFFFF); break;
+            case ORION_STORE:
+                if (a < 0 || a > 0xFFFFFFFFLL) {
+                    return 0; // RiscProcessor throws: value out of range
+                }
+                writeWord((unsigned int)(b + immediate) & 0xFFFF, (unsigned int)a);
+                break;
+            case ORION_ADD: registers[reg1] = toInt32(a + b); break;
+            case ORION_SUB: registers[reg1] = toInt32(a - b); break;
+            case ORION_AND: registers[reg1] = toInt32(toInt32(a) & toInt32(b)); break;
+            case ORION_OR:  registers[reg1] = toInt32(toInt32(a) | toInt32(b)); break;
+            case ORION_XOR: registers[reg1] = toInt32(toInt32(a) ^ toInt32(b)); break;
+            case ORION_SHIFT_RIGHT:
+                registers[reg1] = (unsigned int)toInt32(a) >> (toInt32(b) & 31);
+                break;
+            case ORION_MUL:
+                // JavaScript multiplies in doubles; past 2^53 bits are lost
+                if ((a < 0 ? -a : a) > 0 && (b < 0 ? -b : b) > (1LL << 53) / (a < 0 ? -a : a)) {
+                    return 0;
+                }
+                registers[reg1] = toInt32(a * b);
+                break;
+            case ORION_JUMP:    jump = 1; break;
+            case ORION_JUMP_LT: jump = a < b; break;
+            case ORION_JUMP_LE: jump = a <= b; break;
+            case ORION_JUMP_GT: jump = a > b; break;
+            case ORION_JUMP_GE: jump = a >= b; break;
+            case ORION_HALT:
+                for (i = 0; i < dataWords; i++) {
+                    data[i] = readWord(dataOrigin + 4 * i);
+                }
+                return 1;
+            default:
+                return 0;
+        }
+
+        // As in RiscProcessor.step(), a taken jump is followed by the
+        // usual advance, so execution resumes after the named word
+        pc = (jump ? immediate : pc) + 4;
+    }
+
+    return 0;
+}
+
+// An executor that always fails, counting how often it is asked
+static int failExecutor(void *context,
+                        const unsigned int *code, int codeWords, unsigned int codeOrigin,
+                        unsigned int *data, int dataWords, unsigned int dataOrigin) {
+    (void)code; (void)codeWords; (void)codeOrigin;
+    (void)data; (void)dataWords; (void)dataOrigin;
+    (*(int *)context)++;
+    return 0;
+}
+
+// Load and run a program, optionally with the tier attached
+static int runProgram(BASICState *state, BasicNativeTier *tier, const char *program) {
+    int success;
+
+    basic_init(state);
+    if (tier) {
+        basic_native_attach(state, tier);
+    }
+    success = basic_load_program(state, program) && basic_run_program(state);
+    return success;
+}
+
+static const char *sumProgram =
+    "10 S% = 0 : T% = 0 : K% = 0 : X = 0\n"
+    "20 FOR I% = 1 TO 5000\n"
+    "30 S% = S% + I% * 3 - 7\n"
+    "40 T% = -T% + I% : REM alternate\n"
+    "50 NEXT I%\n"
+    "60 FOR J% = 300 TO -300 STEP -3 : K% = K% - J% * -2 + 1 : NEXT J%\n"
+    "70 FOR R% = 1 TO 200 : X = X + R% / 2 : NEXT R%\n";
+
+static const char *overflowProgram =
+    "10 P% = 0 : Q% = 0\n"
+    "20 FOR I% = 1 TO 100000\n"
+    "30 Q% = Q% + 1\n"
+    "40 P% = P% + I% * 40000\n"
+    "50 NEXT I%\n";
+
+static const char *countProgram =
+    "10 S% = 0\n"
+    "20 FOR I% = 1 TO 200 : S% = S% + 1 : NEXT I%\n";
+
+static const char *doubleProgram =
+    "10 S% = 0\n"
+    "20 FOR I% = 1 TO 200 : S% = S% + 2 : NEXT I%\n";
+
+static const char *longProgram =
+    "10 S% = 0\n"
+    "20 FOR I% = 1 TO 100000 : S% = S% + 1 : NEXT I%\n";
+
+int main() {
+    static BASICState plain, tiered;
+    static BasicNativeTier tier;
+    int plainOk, tieredOk, failures = 0, slices = 0;
+    BasicStepResult step;
+
+    printf("OrionRisc-128 BASIC Native Loop Tier Test\n");
+    printf("=========================================\n\n");
+
+    basic_native_init(&tier, runOrion, NULL);
+    plainOk = runProgram(&plain, NULL, sumProgram);
+    tieredOk = runProgram(&tiered, &tier, sumProgram);
+    printf("Integer loops translated: %s\n", tier.compiled == 2 && tier.rejected == 1 ? "OK" : "ERROR");
+    printf("Same results as the interpreter: %s\n",
+           plainOk && tieredOk &&
+           basic_get_variable_value(&tiered, "S%") == basic_get_variable_value(&plain, "S%") &&
+           basic_get_variable_value(&tiered, "T%") == basic_get_variable_value(&plain, "T%") &&
+           basic_get_variable_value(&tiered, "K%") == basic_get_variable_value(&plain, "K%") &&
+           basic_get_variable_value(&tiered, "I%") == basic_get_variable_value(&plain, "I%") &&
+           basic_get_variable_value(&tiered, "J%") == basic_get_variable_value(&plain, "J%") &&
+           basic_get_variable_value(&tiered, "X") == basic_get_variable_value(&plain, "X") ? "OK" : "ERROR");
+    basic_native_dump(&tier);
+    basic_shutdown(&plain);
+    basic_shutdown(&tiered);
+
+    basic_native_init(&tier, runOrion, NULL);
+    plainOk = runProgram(&plain, NULL, overflowProgram);
+    tieredOk = runProgram(&tiered, &tier, overflowProgram);
+    printf("Overflow reported at the same statement: %s\n",
+           !plainOk && !tieredOk && tier.bailouts == 1 &&
+           tiered.errorCode == ERR_OVERFLOW && tiered.currentLineNumber == plain.currentLineNumber &&
+           basic_get_variable_value(&tiered, "Q%") == basic_get_variable_value(&plain, "Q%") &&
+           basic_get_variable_value(&tiered, "P%") == basic_get_variable_value(&plain, "P%") ? "OK" : "ERROR");
+    basic_shutdown(&plain);
+    basic_shutdown(&tiered);
+
+    // basic_init restarts the program version, so the second program
+    // must not pick up the loop compiled from the first
+    basic_native_init(&tier, runOrion, NULL);
+    tieredOk = runProgram(&tiered, &tier, countProgram);
+    basic_shutdown(&tiered);
+    tieredOk = tieredOk && runProgram(&tiered, &tier, doubleProgram);
+    printf("Reused tier recompiles a new program: %s\n",
+           tieredOk && tier.compiled == 2 && basic_get_variable_value(&tiered, "S%") == 400 ? "OK" : "ERROR");
+    basic_shutdown(&tiered);
+
+    // A native run cannot stop at the end of a basic_step slice
+    basic_native_init(&tier, runOrion, NULL);
+    basic_init(&tiered);
+    basic_native_attach(&tiered, &tier);
+    tieredOk = basic_load_program(&tiered, longProgram) && basic_start_program(&tiered);
+    do {
+        step = basic_step(&tiered, 100);
+        slices++;
+    } while (tieredOk && step == BASIC_STEP_RUNNING);
+    printf("Stepping keeps its budget: %s\n",
+           tieredOk && tier.nativeRuns == 0 && slices > 1000 &&
+           tiered.errorCode == ERR_NONE && basic_get_variable_value(&tiered, "S%") == 100000 ? "OK" : "ERROR");
+    basic_shutdown(&tiered);
+
+    basic_native_init(&tier, failExecutor, &failures);
+    tieredOk = runProgram(&tiered, &tier, longProgram);
+    printf("Failed executor is not retried: %s\n",
+           tieredOk && failures == 1 && tier.rejected == 1 &&
+           basic_get_variable_value(&tiered, "S%") == 100000 ? "OK" : "ERROR");
+    basic_shutdown(&tiered);
+
+    printf("\nBASIC Native Loop Tier Test Complete\n");
+    return 0;
+}
@@ -0,0 +1,174 @@
+/**
+ * OrionRisc-128 BASIC Execution Trace Test Program
+ * Checks the records a traced run leaves in the ring, drains it from a
+ * second thread while a program runs, and writes a trace file
+ */
+
+#include "basic-trace.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+
+static unsigned long fakeTicks;
+
+// Every statement takes exactly one tick
+static unsigned long fakeClock(void *context) {
+    (void)context;
+    return fakeTicks++;
+}
+
+static const char *sumProgram =
+    "10 S = 0\n"
+    "20 FOR I% = 1 TO 3\n"
+    "30 S = S + I%\n"
+    "40 NEXT I%\n"
+    "50 A$ = \"DONE\"\n";
+
+static const char *matProgram =
+    "10 DIM A(2), B(2), C(2)\n"
+    "20 MAT A = B + C\n"
+    "30 MAT A = (3) * A\n";
+
+static const char *longProgram =
+    "10 N = 0\n"
+    "20 N = N + 1\n"
+    "30 IF N < 20000 THEN 20\n";
+
+// Drains on its own thread until the program has finished
+typedef struct {
+    BasicTrace *trace;
+    int finished;               // Set once the run returns
+    unsigned long drained;
+    int whole;                  // Every record matches its line's statement
+} Drainer;
+
+static void *drainLoop(void *context) {
+    Drainer *drainer = (Drainer *)context;
+    BasicTraceRecord records[64];
+    int count, finished, i;
+
+    do {
+        // Checked before draining, so the last drain sees the last record
+        finished = __atomic_load_n(&drainer->finished, __ATOMIC_ACQUIRE);
+        count = basic_trace_drain(drainer->trace, records, 64);
+        for (i = 0; i < count; i++) {
+            const BasicTraceRecord *record = &records[i];
+            int expected = record->lineNumber == 30 ? TOK_IF : TOK_VARIABLE;
+
+            if (record->kind != TRACE_STATEMENT || record->opcode != expected || record->value.ticks != 1 ||
+                record->lineNumber < 10 || record->lineNumber > 30 || record->lineNumber % 10 != 0) {
+                drainer->whole = 0;
+            }
+        }
+        drainer->drained += count;
+    } while (count > 0 || !finished);
+
+    return NULL;
+}
+
+int main() {
+    static BASICState state;
+    static BasicTrace trace;
+    BasicTraceRecord records[64];
+    char text[128];
+    int count, i, statements = 0, ticksOk = 1;
+    int success;
+
+    printf("OrionRisc-128 BASIC Execution Trace Test\n");
+    printf("========================================\n\n");
+
+    basic_init(&state);
+    basic_set_profile_clock(&state, fakeClock, NULL);
+    basic_trace_init(&trace, 1);
+    basic_trace_attach(&state, &trace);
+
+    success = basic_load_program(&state, sumProgram) && basic_run_program(&state);
+    count = basic_trace_drain(&trace, records, 64);
+    for (i = 0; i < count; i++) {
+        if (records[i].kind == TRACE_STATEMENT) {
+            statements++;
+            ticksOk = ticksOk && records[i].value.ticks == 1;
+        }
+        basic_trace_format(&records[i], state.variables[records[i].slot].name, text, sizeof(text));
+        printf("  %s\n", text);
+    }
+
+    // LET, FOR, three of LET and NEXT, LET; each with the variable it set
+    printf("Statement records in order: %s\n",
+           success && statements == 9 && ticksOk &&
+           records[0].kind == TRACE_STATEMENT && records[0].lineNumber == 10 &&
+           records[2].opcode == TOK_FOR && records[count - 2].lineNumber == 50 ? "OK" : "ERROR");
+    printf("Variable writes recorded: %s\n",
+           count == 18 && records[1].kind == TRACE_NUMBER && records[1].value.number == 0.0 &&
+           records[3].kind == TRACE_INTEGER && records[3].value.integer == 1 &&
+           records[13].kind == TRACE_NUMBER && records[13].value.number == 6.0 &&
+           records[15].kind == TRACE_INTEGER && records[15].value.integer == 4 &&
+           records[17].kind == TRACE_STRING && records[17].value.length == 4 ? "OK" : "ERROR");
+
+    // MAT writes only its target, however many arrays it reads
+    basic_trace_init(&trace, 1);
+    success = basic_load_program(&state, matProgram) && basic_run_program(&state);
+    count = basic_trace_drain(&trace, records, 64);
+    printf("MAT records its target only: %s\n",
+           success && count == 5 &&
+           records[2].opcode == TOK_MAT && records[2].kind == TRACE_ARRAY &&
+           strcmp(state.variables[records[2].slot].name, "A") == 0 &&
+           records[4].opcode == TOK_MAT && records[4].kind == TRACE_ARRAY &&
+           strcmp(state.variables[records[4].slot].name, "A") == 0 ? "OK" : "ERROR");
+
+    // Undrained, the ring keeps the oldest records and counts the rest
+    basic_trace_init(&trace, 0);
+    success = basic_load_program(&state, longProgram) && basic_run_program(&state);
+    count = basic_trace_drain(&trace, records, 1);
+    printf("Full ring drops new records: %s\n",
+           success && count == 1 && records[0].lineNumber == 10 &&
+           basic_trace_pending(&trace) == TRACE_CAPACITY - 1 &&
+           trace.dropped == 1 + 2 * 20000 - TRACE_CAPACITY ? "OK" : "ERROR");
+
+    // Drained as it runs, every record arrives whole or is counted dropped
+    {
+        Drainer drainer;
+        pthread_t thread;
+
+        basic_trace_init(&trace, 0);
+        drainer.trace = &trace;
+        drainer.finished = 0;
+        drainer.drained = 0;
+        drainer.whole = 1;
+        pthread_create(&thread, NULL, drainLoop, &drainer);
+        success = basic_load_program(&state, longProgram) && basic_run_program(&state);
+        __atomic_store_n(&drainer.finished, 1, __ATOMIC_RELEASE);
+        pthread_join(thread, NULL);
+        printf("Drained while running: %s\n",
+               success && drainer.whole && drainer.drained + trace.dropped == 1 + 2 * 20000 ? "OK" : "ERROR");
+    }
+
+    // A trace file holds the header, the names and every record
+    {
+        FILE *file = tmpfile();
+        BasicTraceFileHeader header;
+        long written;
+
+        basic_trace_init(&trace, 1);
+        success = basic_load_program(&state, sumProgram) && basic_run_program(&state) && file &&
+                  basic_trace_write_header(&state, file);
+        written = success ? basic_trace_drain_to_file(&trace, file) : -1;
+        if (file) {
+            rewind(file);
+            success = success && fread(&header, sizeof(header), 1, file) == 1 &&
+                      memcmp(header.magic, BASIC_TRACE_MAGIC, 4) == 0 &&
+                      header.symbolCount == state.variableCount &&
+                      fseek(file, 0, SEEK_END) == 0 &&
+                      ftell(file) == (long)sizeof(header) + header.symbolBytes +
+                                     written * (long)sizeof(BasicTraceRecord);
+            fclose(file);
+        }
+        printf("Trace file written: %s\n", success && written == 18 ? "OK" : "ERROR");
+    }
+
+    basic_trace_detach(&state);
+    basic_shutdown(&state);
+
+    printf("\nBASIC Execution Trace Test Complete\n");
+    return 0;
+}